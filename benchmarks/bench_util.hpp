@@ -0,0 +1,216 @@
+#pragma once
+
+// Shared by the benchmarks: the dictionary and corpus they run on, timers
+// and the tries under test. Without arguments a dictionary and a corpus are
+// generated, with a few hundred thousand words drawn like a real one: short
+// words from a skewed alphabet, frequencies and text following Zipf's law.
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "cppjieba/DictTrie.hpp"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CPPJIEBA_BENCH_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CPPJIEBA_BENCH_TSC 1
+#endif
+
+namespace bench {
+
+using cppjieba::DatElementFormat;
+using cppjieba::DatEngine;
+using cppjieba::DictTrie;
+using std::string;
+using std::vector;
+
+struct Input {
+    string dict_path;
+    string corpus;         // UTF-8 text, lines joined
+    vector<string> words;  // of the dictionary, to probe exact lookups
+    string cache_dir;      // empty per run, caches are built once there
+};
+
+inline string Slurp(const string& path) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in) {
+        fprintf(stderr, "cannot read %s\n", path.c_str());
+        exit(1);
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+inline string ScratchDir(const string& name) {
+    MKDIR(CPPJIEBA_BENCH_TMP_DIR);
+    const string dir = string(CPPJIEBA_BENCH_TMP_DIR) + PATH_SEPARATOR + name + "_" +
+                       std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    if (MKDIR(dir.c_str()) != 0) {
+        fprintf(stderr, "cannot create %s\n", dir.c_str());
+        exit(1);
+    }
+    return dir;
+}
+
+// Index in [0, n) with P(k) ~ 1 / (k + 1)
+inline size_t Zipf(std::mt19937& rng, size_t n) {
+    const double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    return std::min(n - 1, size_t(std::exp(u * std::log(double(n) + 1.0)) - 1.0));
+}
+
+inline string GenerateDict(std::mt19937& rng, size_t words_num) {
+    const size_t kAlphabet = 6000; // CJK unified ideographs from U+4E00
+    const size_t kLengths[] = {1, 2, 2, 2, 2, 3, 3, 4};
+    vector<string> words;
+    words.reserve(words_num);
+    std::unordered_set<string> seen;
+
+    while (words.size() < words_num) {
+        const size_t len = kLengths[rng() % 8];
+        string word;
+        for (size_t i = 0; i < len; i++) {
+            const size_t rune = 0x4E00 + Zipf(rng, kAlphabet); // three bytes in UTF-8
+            word += char(0xE0 | (rune >> 12));
+            word += char(0x80 | ((rune >> 6) & 0x3F));
+            word += char(0x80 | (rune & 0x3F));
+        }
+        if (seen.insert(word).second) {
+            words.push_back(word);
+        }
+    }
+
+    string dict;
+    for (size_t i = 0; i < words.size(); i++) {
+        dict += words[i] + " " + std::to_string(1 + 100000 / (i + 1)) + " n\n";
+    }
+    return dict;
+}
+
+// dict.utf8 and corpus from argv[1] and argv[2] when given, else generated
+inline Input LoadInput(int argc, char** argv, const string& name) {
+    Input input;
+    const string dir = ScratchDir(name);
+    input.cache_dir = dir + PATH_SEPARATOR + "cache";
+    std::mt19937 rng(2024);
+    string dict;
+
+    if (argc > 1) {
+        input.dict_path = argv[1];
+        dict = Slurp(input.dict_path);
+    } else {
+        dict = GenerateDict(rng, 300000);
+        input.dict_path = dir + PATH_SEPARATOR + "dict.utf8";
+        std::ofstream(input.dict_path.c_str(), std::ios::binary) << dict;
+    }
+
+    std::istringstream lines(dict);
+    string line;
+    while (std::getline(lines, line)) {
+        const string word = line.substr(0, line.find(' '));
+        if (!word.empty()) {
+            input.words.push_back(word);
+        }
+    }
+
+    if (argc > 2) {
+        input.corpus = Slurp(argv[2]);
+        std::replace(input.corpus.begin(), input.corpus.end(), '\n', ' ');
+    } else {
+        for (size_t i = 0; i < 400000; i++) {
+            input.corpus += input.words[Zipf(rng, input.words.size())];
+            if (rng() % 9 == 0) {
+                input.corpus += "，";
+            }
+        }
+    }
+
+    printf("dictionary %s: %zu words, corpus %zu bytes\n", input.dict_path.c_str(), input.words.size(),
+           input.corpus.size());
+    return input;
+}
+
+// Cycles on x86 (the time stamp counter, at the nominal clock), else ns
+inline unsigned long long Ticks() {
+#ifdef CPPJIEBA_BENCH_TSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+inline const char* TickUnit() {
+#ifdef CPPJIEBA_BENCH_TSC
+    return "cycles";
+#else
+    return "ns";
+#endif
+}
+
+// Fewest ticks of run over a few repetitions
+template <class F>
+unsigned long long BestTicks(F run, int repeat = 5) {
+    unsigned long long best = ~0ULL;
+    for (int r = 0; r < repeat; r++) {
+        const unsigned long long start = Ticks();
+        run();
+        best = std::min(best, Ticks() - start);
+    }
+    return best;
+}
+
+template <class F>
+double BestSeconds(F run, int repeat = 5) {
+    double best = 1e300;
+    for (int r = 0; r < repeat; r++) {
+        const auto start = std::chrono::steady_clock::now();
+        run();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+inline const char* FormatName(DatElementFormat format) {
+    return format == cppjieba::DAT_ELEMENTS_WIDE ? "wide" : format == cppjieba::DAT_ELEMENTS_COMPACT ? "compact"
+                                                                                                      : "inline";
+}
+
+inline const char* EngineName(DatEngine engine) {
+    return engine == cppjieba::DAT_ENGINE_BYTES ? "bytes" : engine == cppjieba::DAT_ENGINE_RUNES ? "runes"
+                                                                                                 : "louds";
+}
+
+// Main dictionary only; the cache is built on first use and attached after
+inline DictTrie* OpenDict(const Input& input, DatElementFormat format, DatEngine engine) {
+    return new DictTrie(input.dict_path, "", input.cache_dir, DictTrie::WordWeightMedian, DictTrie::ValidateFast,
+                        cppjieba::MmapOptions(), format, engine);
+}
+
+// The corpus cut into ranges of at most max_len runes, as the segmenters
+// hand them to DatTrie::Find
+struct Ranges {
+    cppjieba::RuneStrArray runes;
+    vector<std::pair<size_t, size_t> > ranges;
+
+    Ranges(const string& text, size_t max_len = 64) {
+        if (!cppjieba::DecodeRunesInString(text, runes)) {
+            fprintf(stderr, "corpus is no valid UTF-8\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < runes.size(); i += max_len) {
+            ranges.push_back(std::make_pair(i, std::min(runes.size(), i + max_len)));
+        }
+    }
+};
+
+} // namespace bench
@@ -0,0 +1,50 @@
+// The byte-keyed darts-clone engine against the rune-alphabet double-array,
+// per element format: cache size, build and attach time, DatTrie::Find in
+// cycles per character and MPSegment throughput on the corpus.
+//
+//   engine_bench [dict.utf8 [corpus.txt]]
+#include "bench_util.hpp"
+#include "cppjieba/MPSegment.hpp"
+
+using namespace cppjieba;
+
+int main(int argc, char** argv) {
+    const bench::Input input = bench::LoadInput(argc, argv, "engine_bench");
+    const bench::Ranges ranges(input.corpus);
+    const DatEngine engines[] = {DAT_ENGINE_BYTES, DAT_ENGINE_RUNES};
+    const DatElementFormat formats[] = {DAT_ELEMENTS_WIDE, DAT_ELEMENTS_INLINE};
+
+    printf("%-6s %-8s %12s %9s %10s %14s %10s\n", "engine", "format", "cache bytes", "build s", "attach ms",
+           (string(bench::TickUnit()) + "/char").c_str(), "cut MB/s");
+
+    for (DatEngine engine : engines) {
+        for (DatElementFormat format : formats) {
+            const double build = bench::BestSeconds([&]() { delete bench::OpenDict(input, format, engine); }, 1);
+            std::unique_ptr<DictTrie> dict;
+            const double attach = bench::BestSeconds([&]() {
+                dict.reset(); // else the new instance shares its base
+                dict.reset(bench::OpenDict(input, format, engine));
+            });
+            const std::shared_ptr<const DatTrie> base = dict->GetBaseLayer();
+            vector<DatDag> dags;
+            string text;
+
+            const unsigned long long ticks = bench::BestTicks([&]() {
+                for (size_t i = 0; i < ranges.ranges.size(); i++) {
+                    base->Find(ranges.runes.begin() + ranges.ranges[i].first,
+                               ranges.runes.begin() + ranges.ranges[i].second, dags, MAX_WORD_LENGTH, text);
+                }
+            });
+
+            const MPSegment seg(dict.get());
+            SegmentContext ctx;
+            const double cut =
+                bench::BestSeconds([&]() { seg.CutToRanges(input.corpus, false, MAX_WORD_LENGTH, ctx); });
+
+            printf("%-6s %-8s %12zu %9.2f %10.2f %14.2f %10.2f\n", bench::EngineName(base->GetEngine()),
+                   bench::FormatName(base->GetElementFormat()), base->GetCacheFileSize(), build, attach * 1e3,
+                   double(ticks) / ranges.runes.size(), input.corpus.size() / cut / 1e6);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+// DatTrie::Find per element format: the DAG of the corpus in cycles per
+// character, and exact lookups of dictionary words. The inline format reads
+// weights from the DAT values instead of the element array.
+//
+//   find_bench [dict.utf8 [corpus.txt]]
+#include "bench_util.hpp"
+
+using namespace cppjieba;
+
+int main(int argc, char** argv) {
+    const bench::Input input = bench::LoadInput(argc, argv, "find_bench");
+    const bench::Ranges ranges(input.corpus);
+    const DatElementFormat formats[] = {DAT_ELEMENTS_WIDE, DAT_ELEMENTS_COMPACT, DAT_ELEMENTS_INLINE};
+
+    printf("%-8s %14s %14s %12s\n", "format", (string(bench::TickUnit()) + "/char").c_str(), "ns/lookup",
+           "cache bytes");
+
+    for (DatElementFormat format : formats) {
+        std::unique_ptr<DictTrie> dict(bench::OpenDict(input, format, DAT_ENGINE_BYTES));
+        const std::shared_ptr<const DatTrie> base = dict->GetBaseLayer();
+        vector<DatDag> dags;
+        string text;
+        double sink = 0.0;
+
+        const unsigned long long ticks = bench::BestTicks([&]() {
+            for (size_t i = 0; i < ranges.ranges.size(); i++) {
+                base->Find(ranges.runes.begin() + ranges.ranges[i].first,
+                           ranges.runes.begin() + ranges.ranges[i].second, dags, MAX_WORD_LENGTH, text);
+                sink += dags.back().nexts[0].weight;
+            }
+        });
+
+        const double seconds = bench::BestSeconds([&]() {
+            DatMemElem elem;
+            for (size_t i = 0; i < input.words.size(); i++) {
+                if (base->Find(input.words[i], &elem)) {
+                    sink += elem.weight;
+                }
+            }
+        });
+
+        printf("%-8s %14.2f %14.1f %12zu%s\n", bench::FormatName(base->GetElementFormat()),
+               double(ticks) / ranges.runes.size(), seconds / input.words.size() * 1e9, base->GetCacheFileSize(),
+               sink == 0.0 ? " (no matches)" : "");
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+// The LOUDS trie against the double-arrays, in the inline element format
+// that memory-constrained deployments pair it with: cache size, exact
+// lookups, DatTrie::Find in cycles per character and MPSegment throughput,
+// each also relative to the darts-clone byte engine.
+//
+//   louds_bench [dict.utf8 [corpus.txt]]
+#include "bench_util.hpp"
+#include "cppjieba/MPSegment.hpp"
+
+using namespace cppjieba;
+
+int main(int argc, char** argv) {
+    const bench::Input input = bench::LoadInput(argc, argv, "louds_bench");
+    const bench::Ranges ranges(input.corpus);
+    const DatEngine engines[] = {DAT_ENGINE_BYTES, DAT_ENGINE_RUNES, DAT_ENGINE_LOUDS};
+    double bytes_size = 0.0, bytes_lookup = 0.0, bytes_find = 0.0, bytes_cut = 0.0;
+
+    printf("%-6s %20s %18s %22s %18s\n", "engine", "cache bytes", "ns/lookup",
+           (string(bench::TickUnit()) + "/char").c_str(), "cut MB/s");
+
+    for (DatEngine engine : engines) {
+        std::unique_ptr<DictTrie> dict(bench::OpenDict(input, DAT_ELEMENTS_INLINE, engine));
+        const std::shared_ptr<const DatTrie> base = dict->GetBaseLayer();
+        vector<DatDag> dags;
+        string text;
+        size_t found = 0;
+
+        const double lookup = bench::BestSeconds([&]() {
+            found = 0;
+            for (size_t i = 0; i < input.words.size(); i++) {
+                found += base->Find(input.words[i]);
+            }
+        }) / input.words.size() * 1e9;
+
+        const double find = double(bench::BestTicks([&]() {
+            for (size_t i = 0; i < ranges.ranges.size(); i++) {
+                base->Find(ranges.runes.begin() + ranges.ranges[i].first,
+                           ranges.runes.begin() + ranges.ranges[i].second, dags, MAX_WORD_LENGTH, text);
+            }
+        })) / ranges.runes.size();
+
+        const MPSegment seg(dict.get());
+        SegmentContext ctx;
+        const double cut = input.corpus.size() / 1e6 /
+                           bench::BestSeconds([&]() { seg.CutToRanges(input.corpus, false, MAX_WORD_LENGTH, ctx); });
+
+        const double size = double(base->GetCacheFileSize());
+        if (engine == DAT_ENGINE_BYTES) {
+            bytes_size = size;
+            bytes_lookup = lookup;
+            bytes_find = find;
+            bytes_cut = cut;
+        }
+
+        printf("%-6s %12.0f (%4.2fx) %9.1f (%4.2fx) %13.2f (%4.2fx) %9.2f (%4.2fx)%s\n",
+               bench::EngineName(base->GetEngine()), size, size / bytes_size, lookup, lookup / bytes_lookup, find,
+               find / bytes_find, cut, cut / bytes_cut, found == input.words.size() ? "" : " (words missing)");
+    }
+    return 0;
+}
@@ -1,5 +1,6 @@
 # src/cppjieba_py_dat/__init__.py
 import os
+import re
 import sys
 import threading
 import platform  # For OS specific paths
@@ -50,8 +51,13 @@ def _get_resource_path(filename):
         raise FileNotFoundError(f"Could not find resource '{filename}' within the package.")
 
 
-def _get_default_dat_cache_dir():
-    """获取默认的 DAT 缓存目录 (跨平台)"""
+def _read_file(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def _get_default_dat_cache_dir(create: bool = True):
+    """获取默认的 DAT 缓存目录 (跨平台)；create=False 时不创建 (只读模式)"""
     app_name = "cppjieba_py_dat"
     if _use_appdirs:
         cache_dir = appdirs.user_cache_dir(app_name)
@@ -65,6 +71,8 @@ def _get_default_dat_cache_dir():
         else:
             xdg_cache_home = os.environ.get("XDG_CACHE_HOME", os.path.join(home, ".cache"))
             cache_dir = os.path.join(xdg_cache_home, app_name)
+    if not create:
+        return cache_dir
     try:
         os.makedirs(cache_dir, exist_ok=True)
     except OSError as e:
@@ -73,17 +81,113 @@ def _get_default_dat_cache_dir():
     return cache_dir
 
 
+def _user_dict_paths(paths, skip_missing=False):
+    """以 ';' 或 '|' 分隔的用户词典逐个转为绝对路径，保留分隔符。用户词典缓存按这个字符串命名，
+    离线编译和运行时必须得到相同的结果；skip_missing 时去掉不存在的文件并给出警告"""
+    if not paths:
+        return ""
+    pieces = re.split(r"([;|])", paths)
+    result = []
+    for i in range(0, len(pieces), 2):
+        if not pieces[i]:
+            continue
+        path = os.path.abspath(pieces[i])
+        if skip_missing and not os.path.exists(path):
+            print(f"Warning: User dictionary path '{path}' does not exist.", file=sys.stderr)
+            continue
+        if result:
+            result.append(pieces[i - 1])  # 前面的分隔符
+        result.append(path)
+    return "".join(result)
+
+
+def _cache_validation(mode):
+    """'fast' (默认) 只比较词典的 (路径, 大小, mtime, inode)，变化时再哈希内容；'strict' 每次对词典做 MD5；
+    'readonly' 只挂载 python -m cppjieba_py_dat.compile 预先生成的缓存，不检查、不写入、不重建"""
+    if mode == "strict":
+        return _bindings.CacheValidation.STRICT
+    if mode == "fast":
+        return _bindings.CacheValidation.FAST
+    if mode == "readonly":
+        return _bindings.CacheValidation.READONLY
+    raise ValueError(f"cache_validation must be 'fast', 'strict' or 'readonly', got {mode!r}")
+
+
+def _element_format(name):
+    """'wide' 16 字节词条；'compact' 8 字节编号；'inline' 权重和词性编号直接存在 DAT 叶子值里，没有词条数组"""
+    formats = {
+        "wide": _bindings.ElementFormat.WIDE,
+        "compact": _bindings.ElementFormat.COMPACT,
+        "inline": _bindings.ElementFormat.INLINE,
+    }
+    if name not in formats:
+        raise ValueError(f"element_format must be 'wide', 'compact' or 'inline', got {name!r}")
+    return formats[name]
+
+
+def _dat_engine(name):
+    """'bytes' 按 UTF-8 字节的 darts DAT；'runes' 按字符的双数组，每个汉字一次转移；'louds' 按字符的简洁 trie，体积最小"""
+    engines = {
+        "bytes": _bindings.DatEngine.BYTES,
+        "runes": _bindings.DatEngine.RUNES,
+        "louds": _bindings.DatEngine.LOUDS,
+    }
+    if name not in engines:
+        raise ValueError(f"dat_engine must be 'bytes', 'runes' or 'louds', got {name!r}")
+    return engines[name]
+
+
+def _components(names):
+    """None 表示全部；否则为 'hmm' (HMM 模型，用于 HMM=True 的分词和词性标注)、'keywords' (IDF 和停用词) 的列表"""
+    if names is None:
+        return int(_bindings.Component.ALL)
+    if isinstance(names, str):
+        names = [names]
+    components = {
+        "hmm": _bindings.Component.HMM,
+        "keywords": _bindings.Component.KEYWORDS,
+    }
+    flags = 0
+    for name in names:
+        if name not in components:
+            raise ValueError(f"components must be 'hmm' or 'keywords', got {name!r}")
+        flags |= int(components[name])
+    return flags
+
+
+def _mmap_options(prefetch, access, huge_pages, lock):
+    """prefetch: None / 'willneed' (后台预读) / 'populate' (返回前读入全部页)；access: 'normal' / 'random' / 'sequential'"""
+    options = _bindings.MmapOptions()
+    prefetch_modes = {
+        None: _bindings.MmapOptions.Prefetch.NONE,
+        "willneed": _bindings.MmapOptions.Prefetch.WILLNEED,
+        "populate": _bindings.MmapOptions.Prefetch.POPULATE,
+    }
+    access_modes = {
+        "normal": _bindings.MmapOptions.Access.NORMAL,
+        "random": _bindings.MmapOptions.Access.RANDOM,
+        "sequential": _bindings.MmapOptions.Access.SEQUENTIAL,
+    }
+    if prefetch not in prefetch_modes:
+        raise ValueError(f"mmap_prefetch must be None, 'willneed' or 'populate', got {prefetch!r}")
+    if access not in access_modes:
+        raise ValueError(f"mmap_access must be 'normal', 'random' or 'sequential', got {access!r}")
+    options.prefetch = prefetch_modes[prefetch]
+    options.access = access_modes[access]
+    options.huge_pages = huge_pages
+    options.lock = lock
+    return options
+
+
 def _initialize_global_instance(**kwargs):
     """内部函数：实际初始化全局实例"""
     user_dict_path = kwargs.get('user_dict_path')
     dat_cache_dir = kwargs.get('dat_cache_dir')
 
-    _user_dict_path = os.path.abspath(user_dict_path) if user_dict_path else ""
-    if user_dict_path and not os.path.exists(_user_dict_path):
-        print(f"Warning: User dictionary path '{_user_dict_path}' does not exist.", file=sys.stderr)
-        _user_dict_path = ""
-
-    _dat_cache_dir = dat_cache_dir if dat_cache_dir is not None else _get_default_dat_cache_dir()
+    _user_dict_path = _user_dict_paths(user_dict_path, skip_missing=True)
+    cache_validation = kwargs.get('cache_validation') or "fast"
+    _dat_cache_dir = dat_cache_dir if dat_cache_dir is not None else _get_default_dat_cache_dir(
+        create=cache_validation != "readonly")
 
     try:
         dict_path = _get_resource_path("dict/jieba.dict.utf8")
@@ -108,7 +212,8 @@ def _initialize_global_instance(**kwargs):
             user_dict_path=_user_dict_path,
             idf_path=idf_path,
             stop_word_path=stop_word_path,
-            dat_cache_path=_dat_cache_dir
+            dat_cache_path=_dat_cache_dir,
+            cache_validation=_cache_validation(cache_validation)
         )
     except Exception as e:
         print(f"Error initializing global Jieba instance: {e}")
@@ -125,7 +230,7 @@ def _get_instance(**kwargs):
     elif kwargs:  # 检查是否传入了新的配置参数
         # 如果用户尝试用不同配置获取已初始化的单例，发出警告
         # 注意：这个检查很简单，可能无法覆盖所有情况
-        current_config_keys = ['user_dict_path', 'dat_cache_dir', 'idf_path', 'stop_word_path']
+        current_config_keys = ['user_dict_path', 'dat_cache_dir', 'idf_path', 'stop_word_path', 'cache_validation']
         if any(kwargs.get(k) is not None for k in current_config_keys):
             print("Warning: Global Jieba instance already initialized. "
                   "Ignoring new configuration parameters passed to functional API.", file=sys.stderr)
@@ -133,31 +238,32 @@ def _get_instance(**kwargs):
 
 
 # --- 函数式接口定义 ---
-def cut(sentence: str, cut_all: bool = False, HMM: bool = True) -> List[str]:
+def cut(sentence: str, cut_all: bool = False, HMM: bool = True, threads: int = 1) -> List[str]:
     # ... (代码同前) ...
+    # threads > 1: 超长文本在分隔符处切块后多线程分词，结果与单线程一致
     instance = _get_instance()
     if instance is None: raise RuntimeError("Jieba core failed to initialize.")
     if cut_all:
-        return instance.cut_all(sentence)
+        return instance.cut_all(sentence, threads=threads)
     else:
-        return instance.cut(sentence, hmm=HMM)
+        return instance.cut(sentence, hmm=HMM, threads=threads)
 
 
-def cut_for_search(sentence: str, HMM: bool = True) -> List[str]:
+def cut_for_search(sentence: str, HMM: bool = True, threads: int = 1) -> List[str]:
     instance = _get_instance()
     if instance is None:
         raise RuntimeError("Jieba core failed to initialize.")
-    return instance.cut_for_search(sentence, hmm=HMM)
+    return instance.cut_for_search(sentence, hmm=HMM, threads=threads)
 
 
-def lcut(sentence: str, cut_all: bool = False, HMM: bool = True) -> List[str]:
+def lcut(sentence: str, cut_all: bool = False, HMM: bool = True, threads: int = 1) -> List[str]:
     # lcut 通常是 cut 的别名，返回列表
-    return cut(sentence, cut_all=cut_all, HMM=HMM)
+    return cut(sentence, cut_all=cut_all, HMM=HMM, threads=threads)
 
 
-def lcut_for_search(sentence: str, HMM: bool = True) -> List[str]:
+def lcut_for_search(sentence: str, HMM: bool = True, threads: int = 1) -> List[str]:
     # lcut_for_search 通常是 cut_for_search 的别名
-    return cut_for_search(sentence, HMM=HMM)
+    return cut_for_search(sentence, HMM=HMM, threads=threads)
 
 
 def tag(sentence: str) -> List[Tuple[str, str]]:
@@ -193,6 +299,13 @@ def extract_keywords(sentence: str, top_k: int = 20, allow_pos: Tuple[str, ...]
     return filtered_results
 
 
+def warmup(components: Optional[List[str]] = None) -> None:
+    instance = _get_instance()
+    if instance is None:
+        raise RuntimeError("Jieba core failed to initialize.")
+    instance.warmup(_components(components))
+
+
 def word_exists(word: str) -> bool:
     instance = _get_instance()
     if instance is None:
@@ -200,6 +313,14 @@ def word_exists(word: str) -> bool:
     return instance.find(word)
 
 
+def add_word(word: str, freq: Optional[int] = None, tag: Optional[str] = None) -> bool:
+    # 运行时添加用户词，立即生效，无需重建缓存
+    instance = _get_instance()
+    if instance is None:
+        raise RuntimeError("Jieba core failed to initialize.")
+    return instance.insert_user_word(word, freq=freq or 0, tag=tag or "")
+
+
 # --- 添加面向对象的 Jieba 类 ---
 class Jieba:
     """
@@ -212,7 +333,19 @@ class Jieba:
                  user_dict_path: Optional[str] = None,
                  dat_cache_dir: Optional[str] = None,
                  idf_path: Optional[str] = "",  # 允许指定 IDF 路径
-                 stop_word_path: Optional[str] = ""  # 允许指定停用词路径
+                 stop_word_path: Optional[str] = "",  # 允许指定停用词路径
+                 cache_validation: str = "fast",
+                 bundle_path: Optional[str] = None,
+                 mmap_prefetch: Optional[str] = None,
+                 mmap_access: str = "normal",
+                 mmap_hugepage: bool = False,
+                 mmap_lock: bool = False,
+                 element_format: str = "wide",
+                 dat_engine: str = "bytes",
+                 profiled_layout: bool = False,
+                 dict_data: Optional[bytes] = None,
+                 hmm_data: Optional[bytes] = None,
+                 user_dict_data: Optional[bytes] = None
                  ):
         """
         Initializes a new Jieba instance.
@@ -222,14 +355,63 @@ class Jieba:
             dat_cache_dir (Optional[str]): Directory for DAT cache files. Uses default if None.
             idf_path (Optional[str]): Path to IDF dictionary. Defaults to "" (uses internal if available, or none).
             stop_word_path (Optional[str]): Path to stop word file. Defaults to "" (uses internal if available, or none).
+            cache_validation (str): "fast" checks the dictionaries' size/mtime/inode against the cache manifest and
+                only hashes them when those changed; "strict" MD5s every dictionary on each start; "readonly" only
+                attaches the caches written by `python -m cppjieba_py_dat.compile` for the same dat_cache_dir,
+                element_format, dat_engine and user_dict_path, and raises if they are missing.
+            bundle_path (Optional[str]): Model bundle written by save_bundle. Everything is loaded from it with
+                a single mmap and the other arguments except the mmap_* ones are ignored.
+            mmap_prefetch (Optional[str]): "willneed" starts readahead of the dictionary mapping, "populate" reads
+                all of it in before returning, so the first cuts after a deploy do not page-fault.
+            mmap_access (str): "normal", "random" or "sequential" madvise hint.
+            mmap_hugepage (bool): MADV_HUGEPAGE, effective where the kernel supports THP for file mappings.
+            mmap_lock (bool): mlock the mapping (bounded by RLIMIT_MEMLOCK; a failure is only logged).
+            See memory_residency() for the result.
+            element_format (str): How the main dictionary cache stores its entries. "wide" uses 16 bytes per word,
+                "compact" 8 bytes of weight and tag ids into tables of the distinct values, "inline" packs those
+                ids into the double-array leaf itself so a lookup reads no element array. Segmentation results
+                are identical; "inline" falls back to "compact" for dictionaries with over 65536 distinct weights.
+            dat_engine (str): Trie of the main dictionary cache. "bytes" is darts-clone over UTF-8 bytes, three
+                transitions per CJK character; "runes" walks one unit per character over a frequency-ranked rune
+                alphabet, at the cost of a larger cache; "louds" is a succinct trie a few times smaller than "bytes",
+                for tight memory budgets, at two to three times the lookup cost. Segmentation results are identical.
+            profiled_layout (bool): Use the main dictionary cache written by save_profiled_layout for these
+                dictionary and format settings, falling back to the normal cache when there is none or the
+                dictionary changed since.
+            dict_data, hmm_data, user_dict_data (Optional[bytes]): Contents of the main dictionary, HMM model and
+                user dictionary. If any is given, everything is built in memory and no cache file is read or
+                written; the others default to the package files and user_dict_path. dat_cache_dir,
+                cache_validation and profiled_layout are ignored then.
         """
         print("Initializing new Jieba object instance...")  # Log 区分
-        _user_dict_path = os.path.abspath(user_dict_path) if user_dict_path else ""
-        if user_dict_path and not os.path.exists(_user_dict_path):
-            print(f"Warning: User dictionary path '{_user_dict_path}' does not exist.", file=sys.stderr)
-            _user_dict_path = ""
+        _mmap = _mmap_options(mmap_prefetch, mmap_access, mmap_hugepage, mmap_lock)
+        if bundle_path:
+            self._jieba_cpp = _bindings.Jieba.from_bundle(os.path.abspath(bundle_path), mmap_options=_mmap)
+            print("New Jieba object instance initialized from bundle successfully!")
+            return
+
+        _user_dict_path = _user_dict_paths(user_dict_path, skip_missing=True)
+
+        if dict_data is not None or hmm_data is not None or user_dict_data is not None:
+            # 不读写任何缓存文件，适合只读文件系统
+            if user_dict_data is None:
+                user_dict_data = b"\n".join(_read_file(p) for p in re.split(r"[;|]", _user_dict_path)) \
+                    if _user_dict_path else b""
+            self._jieba_cpp = _bindings.Jieba.from_memory(
+                dict=dict_data if dict_data is not None else _read_file(_get_resource_path("dict/jieba.dict.utf8")),
+                hmm_model=hmm_data if hmm_data is not None else _read_file(_get_resource_path("dict/hmm_model.utf8")),
+                user_dict=user_dict_data,
+                idf_path=_get_resource_path("dict/idf.utf8") if idf_path is None else idf_path,
+                stop_word_path=_get_resource_path("dict/stop_words.utf8") if stop_word_path is None else stop_word_path,
+                mmap_options=_mmap,
+                element_format=_element_format(element_format),
+                engine=_dat_engine(dat_engine)
+            )
+            print("New Jieba object instance initialized from memory successfully!")
+            return
 
-        _dat_cache_dir = dat_cache_dir if dat_cache_dir is not None else _get_default_dat_cache_dir()
+        _dat_cache_dir = dat_cache_dir if dat_cache_dir is not None else _get_default_dat_cache_dir(
+            create=cache_validation != "readonly")
 
         try:
             dict_path = _get_resource_path("dict/jieba.dict.utf8")
@@ -254,7 +436,12 @@ class Jieba:
                 user_dict_path=_user_dict_path,
                 idf_path=_idf_path,
                 stop_word_path=_stop_word_path,
-                dat_cache_path=_dat_cache_dir
+                dat_cache_path=_dat_cache_dir,
+                cache_validation=_cache_validation(cache_validation),
+                mmap_options=_mmap,
+                element_format=_element_format(element_format),
+                engine=_dat_engine(dat_engine),
+                profiled_layout=profiled_layout
             )
             print("New Jieba object instance initialized successfully!")
         except Exception as e:
@@ -262,24 +449,24 @@ class Jieba:
             raise
 
     # --- 类方法：调用 self._jieba_cpp ---
-    def cut(self, sentence: str, cut_all: bool = False, HMM: bool = True) -> List[str]:
-        """Cut sentence using this Jieba instance."""
+    def cut(self, sentence: str, cut_all: bool = False, HMM: bool = True, threads: int = 1) -> List[str]:
+        """Cut sentence using this Jieba instance. threads > 1 splits large inputs across threads."""
         if cut_all:
-            return self._jieba_cpp.cut_all(sentence)
+            return self._jieba_cpp.cut_all(sentence, threads=threads)
         else:
-            return self._jieba_cpp.cut(sentence, hmm=HMM)
+            return self._jieba_cpp.cut(sentence, hmm=HMM, threads=threads)
 
-    def cut_for_search(self, sentence: str, HMM: bool = True) -> List[str]:
+    def cut_for_search(self, sentence: str, HMM: bool = True, threads: int = 1) -> List[str]:
         """Cut sentence for search engine using this Jieba instance."""
-        return self._jieba_cpp.cut_for_search(sentence, hmm=HMM)
+        return self._jieba_cpp.cut_for_search(sentence, hmm=HMM, threads=threads)
 
-    def lcut(self, sentence: str, cut_all: bool = False, HMM: bool = True) -> List[str]:
+    def lcut(self, sentence: str, cut_all: bool = False, HMM: bool = True, threads: int = 1) -> List[str]:
         """Alias for cut."""
-        return self.cut(sentence, cut_all=cut_all, HMM=HMM)
+        return self.cut(sentence, cut_all=cut_all, HMM=HMM, threads=threads)
 
-    def lcut_for_search(self, sentence: str, HMM: bool = True) -> List[str]:
+    def lcut_for_search(self, sentence: str, HMM: bool = True, threads: int = 1) -> List[str]:
         """Alias for cut_for_search."""
-        return self.cut_for_search(sentence, HMM=HMM)
+        return self.cut_for_search(sentence, HMM=HMM, threads=threads)
 
     def tag(self, sentence: str) -> List[Tuple[str, str]]:
         """Perform POS tagging using this Jieba instance."""
@@ -314,13 +501,103 @@ class Jieba:
         """Check word existence using this Jieba instance."""
         return self._jieba_cpp.find(word)
 
+    def add_word(self, word: str, freq: Optional[int] = None, tag: Optional[str] = None) -> bool:
+        """
+        Add or replace a word at runtime using this Jieba instance; it is visible to the next cut.
+
+        Without freq the word gets the default user word weight. Inserted words live in an in-memory
+        overlay over the DAT cache; once it holds `set_overlay_compact_threshold` words (default 4096)
+        a background thread rebuilds this instance's user layer in memory with them. That layer is private
+        to the process; no cache file is written, and the words are not saved across restarts.
+        """
+        return self._jieba_cpp.insert_user_word(word, freq=freq or 0, tag=tag or "")
+
+    def set_overlay_compact_threshold(self, threshold: int) -> None:
+        """Number of added words that triggers background compaction; 0 disables it."""
+        self._jieba_cpp.set_overlay_compact_threshold(threshold)
+
+    def memory_residency(self) -> dict:
+        """resident_pages / total_pages of the dictionary mappings right now (mincore, POSIX only)."""
+        resident, total = self._jieba_cpp.resident_pages
+        return {
+            "resident_pages": resident,
+            "total_pages": total,
+            "ratio": resident / total if total else 0.0,
+        }
+
+    def save_bundle(self, path: str) -> None:
+        """
+        Save dictionaries, HMM model, IDF and stop words as one model bundle for Jieba(bundle_path=...).
+        Words added with add_word are not included.
+        """
+        self._jieba_cpp.save_bundle(os.path.abspath(path))
+
+    def save_profiled_layout(self, corpus_path: str) -> str:
+        """
+        Offline tuning step: count which dictionary words the sample corpus (a UTF-8 text file, or several
+        joined by "|") hits and write a main dictionary cache with those hot entries packed at its front.
+        Instances created with profiled_layout=True and the same dictionary settings then load it.
+        Returns the path of the written cache file.
+        """
+        paths = "|".join(os.path.abspath(p) for p in corpus_path.split("|"))
+        return self._jieba_cpp.save_profiled_layout(paths)
+
+    def reload(self, user_dict_path: Optional[str] = None, async_: bool = False) -> bool:
+        """
+        Reload the dictionaries after they changed on disk, without restarting or blocking cuts.
+
+        The new DAT is attached (or rebuilt) next to the current one and swapped in atomically; the old
+        one is unmapped once running calls finish. user_dict_path switches to another user dictionary.
+        Words added with add_word are kept. With async_=True the reload runs in the background and
+        this returns right away; see reload_info(). Returns False if a reload is already running or,
+        when synchronous, if it failed (the current dictionaries stay in use).
+        """
+        if user_dict_path:
+            user_dict_path = _user_dict_paths(user_dict_path)
+        return self._jieba_cpp.reload(user_dict_path, async_=async_)
+
+    def wait_reload(self) -> None:
+        """Wait for a background reload started by reload(async_=True)."""
+        self._jieba_cpp.wait_reload()
+
+    def reload_info(self) -> dict:
+        """generation (successful reloads so far), in_progress, and ok / duration_ms of the last reload."""
+        return {
+            "generation": self._jieba_cpp.reload_generation,
+            "in_progress": self._jieba_cpp.reload_in_progress,
+            "ok": self._jieba_cpp.last_reload_ok,
+            "duration_ms": self._jieba_cpp.last_reload_ms,
+        }
+
+    def warmup(self, components: Optional[List[str]] = None) -> None:
+        """
+        Load components now instead of on first use. Only the dictionary is loaded when the instance is
+        created; the HMM model ("hmm") is loaded by the first cut with HMM=True or tag(), the IDF and stop
+        words ("keywords") by the first extract_keywords(). None warms up all of them.
+        """
+        self._jieba_cpp.warmup(_components(components))
+
+    def set_range_limits(self, max_range_len: int, overlap: int = 1024, max_work_bytes: int = 64 << 20) -> bool:
+        """
+        Bound the working memory used for text without separators (minified code, base64, long unpunctuated runs).
+
+        Such ranges are cut in windows of at most max_range_len characters, each looking `overlap`
+        characters ahead, and the window is shrunk so its working state stays below max_work_bytes.
+        0 disables a limit. Defaults: 65536 characters, overlap 1024, 64 MB; max_work_bytes keeps
+        the 64 MB cap when only the window length is changed, pass 0 to lift it.
+
+        max_work_bytes only covers the per-window working state; the decoded text and the returned
+        words still grow with the input.
+        """
+        return self._jieba_cpp.set_range_limits(max_range_len, overlap=overlap, max_work_bytes=max_work_bytes)
+
 
 # --- 暴露公共接口 ---
 # 同时暴露函数式接口和面向对象接口
 __all__ = [
     # 函数式接口
     'cut', 'cut_for_search', 'lcut', 'lcut_for_search', 'tag', 'lookup_tag',
-    'extract_keywords', 'word_exists',
+    'extract_keywords', 'word_exists', 'add_word', 'warmup',
     # 面向对象接口
     'Jieba',
 ]
@@ -1,5 +1,51 @@
 from enum import Enum
-from typing import List, Tuple
+from typing import Any, Dict, List, Optional, Tuple
+
+class CacheValidation(Enum):
+    STRICT = ...
+    FAST = ...
+    READONLY = ...
+
+class ElementFormat(Enum):
+    WIDE = ...
+    COMPACT = ...
+    INLINE = ...
+
+class DatEngine(Enum):
+    BYTES = ...
+    RUNES = ...
+    LOUDS = ...
+
+class Component(Enum):
+    HMM = ...
+    KEYWORDS = ...
+    ALL = ...
+
+class MmapOptions:
+    class Prefetch(Enum):
+        NONE = ...
+        WILLNEED = ...
+        POPULATE = ...
+
+    class Access(Enum):
+        NORMAL = ...
+        RANDOM = ...
+        SEQUENTIAL = ...
+
+    prefetch: "MmapOptions.Prefetch"
+    access: "MmapOptions.Access"
+    huge_pages: bool
+    lock: bool
+    def __init__(self) -> None: ...
+
+def compile_caches(
+    dict_path: str,
+    model_path: str,
+    user_dict_path: str = ...,
+    cache_dir: str = ...,
+    element_format: ElementFormat = ...,
+    engine: DatEngine = ...
+) -> Dict[str, Any]: ...
 
 class Jieba:
     # 构造函数
@@ -10,12 +56,32 @@ class Jieba:
         user_dict_path: str,
         idf_path: str = ...,
         stop_word_path: str = ...,
-        dat_cache_path: str = ...
+        dat_cache_path: str = ...,
+        cache_validation: CacheValidation = ...,
+        mmap_options: MmapOptions = ...,
+        element_format: ElementFormat = ...,
+        engine: DatEngine = ...,
+        profiled_layout: bool = ...
     ) -> None: ...
+    @staticmethod
+    def from_bundle(bundle_path: str, mmap_options: MmapOptions = ...) -> "Jieba": ...
+    @staticmethod
+    def from_memory(
+        dict: bytes,
+        hmm_model: bytes,
+        user_dict: bytes = ...,
+        idf_path: str = ...,
+        stop_word_path: str = ...,
+        mmap_options: MmapOptions = ...,
+        element_format: ElementFormat = ...,
+        engine: DatEngine = ...
+    ) -> "Jieba": ...
+    def save_bundle(self, path: str) -> None: ...
+    def save_profiled_layout(self, corpus_paths: str) -> str: ...
 
-    def cut(self, sentence: str, hmm: bool = ...) -> List[str]: ...
-    def cut_all(self, sentence: str) -> List[str]: ...
-    def cut_for_search(self, sentence: str, hmm: bool = ...) -> List[str]: ...
+    def cut(self, sentence: str, hmm: bool = ..., threads: int = ...) -> List[str]: ...
+    def cut_all(self, sentence: str, threads: int = ...) -> List[str]: ...
+    def cut_for_search(self, sentence: str, hmm: bool = ..., threads: int = ...) -> List[str]: ...
 
     # 词性标注
     def tag(self, sentence: str) -> List[Tuple[str, str]]: ...
@@ -24,4 +90,24 @@ class Jieba:
     # 查找
     def find(self, word: str) -> bool: ...
 
+    def insert_user_word(self, word: str, freq: int = ..., tag: str = ...) -> bool: ...
+    def set_overlay_compact_threshold(self, threshold: int) -> None: ...
+
+    def reload(self, user_dict_path: Optional[str] = None, async_: bool = False) -> bool: ...
+    def wait_reload(self) -> None: ...
+    @property
+    def resident_pages(self) -> Tuple[int, int]: ...
+    @property
+    def reload_generation(self) -> int: ...
+    @property
+    def reload_in_progress(self) -> bool: ...
+    @property
+    def last_reload_ok(self) -> bool: ...
+    @property
+    def last_reload_ms(self) -> float: ...
+
+    def warmup(self, components: int = ...) -> None: ...
+
+    def set_range_limits(self, max_range_len: int, overlap: int = ..., max_work_bytes: int = ...) -> bool: ...
+
     def extract_keywords(self, sentence: str, top_k: int = ...) -> List[Tuple[str, float]]: ...
@@ -0,0 +1,59 @@
+# src/cppjieba_py_dat/compile.py
+"""
+离线生成缓存，例如在构建 Docker 镜像时：
+
+    python -m cppjieba_py_dat.compile --cache-dir /opt/jieba-cache [--user-dict user.dict.utf8]
+        [--element-format wide|compact|inline] [--dat-engine bytes|runes|louds]
+
+生成的主词典 / 用户词典 DAT 缓存和 HMM 模型缓存，在运行时以相同的 dat_cache_dir、user_dict_path、
+element_format 和 dat_engine 配合 cache_validation="readonly" 只读挂载，不再检查或重建。
+"""
+import argparse
+import sys
+
+from . import _dat_engine, _element_format, _get_default_dat_cache_dir, _get_resource_path, _user_dict_paths
+from . import bindings as _bindings
+
+
+def compile_caches(cache_dir: str = None, user_dict_path: str = None, element_format: str = "wide",
+                   dat_engine: str = "bytes") -> dict:
+    """生成与 Jieba(...) 相同参数对应的缓存文件，不创建分词器；返回写入的文件及其大小"""
+    _cache_dir = cache_dir if cache_dir is not None else _get_default_dat_cache_dir()
+    if not _cache_dir:
+        raise ValueError("No usable cache directory")
+    # 与 Jieba 一样逐个使用绝对路径，用户词典缓存按路径命名
+    _user_dict_path = _user_dict_paths(user_dict_path)
+    return _bindings.compile_caches(
+        dict_path=_get_resource_path("dict/jieba.dict.utf8"),
+        model_path=_get_resource_path("dict/hmm_model.utf8"),
+        user_dict_path=_user_dict_path,
+        cache_dir=_cache_dir,
+        element_format=_element_format(element_format),
+        engine=_dat_engine(dat_engine)
+    )
+
+
+def main(argv=None) -> int:
+    parser = argparse.ArgumentParser(prog="python -m cppjieba_py_dat.compile",
+                                     description="Build the dictionary and HMM model caches ahead of time.")
+    parser.add_argument("--cache-dir", help="cache directory, the default cache directory if omitted")
+    parser.add_argument("--user-dict", help="user dictionary path(s), separated by ';'")
+    parser.add_argument("--element-format", default="wide", choices=["wide", "compact", "inline"])
+    parser.add_argument("--dat-engine", default="bytes", choices=["bytes", "runes", "louds"])
+    args = parser.parse_args(argv)
+
+    try:
+        result = compile_caches(args.cache_dir, args.user_dict, args.element_format, args.dat_engine)
+    except Exception as e:
+        print(f"Error compiling caches: {e}", file=sys.stderr)
+        return 1
+
+    print(f"element format: {args.element_format}, engine: {args.dat_engine}, "
+          f"dictionaries: {result['total_dict_size']} bytes, {result['seconds']:.2f} s")
+    for f in result["files"]:
+        print(f"{f['kind']:<4} {f['size']:>12} bytes {f['words']:>10} words  {f['path']}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -6,6 +6,8 @@
 
 // Core CppJieba headers needed for bindings
 #include "cppjieba/Jieba.hpp"
+#include "cppjieba/CacheCompiler.hpp"
+#include "cppjieba/SegmentContext.hpp"
 #include "cppjieba/KeywordExtractor.hpp" // Needed for extractor access and its result type (pair)
 
 // Logging header for setting log level
@@ -13,52 +15,246 @@
 
 namespace py = pybind11;
 
+namespace {
+
+// One context per OS thread, reused by every call made from that thread.
+cppjieba::SegmentContext& ThreadSegmentContext() {
+    thread_local cppjieba::SegmentContext ctx;
+    return ctx;
+}
+
+// Copies the UTF-8 form of a str (cached by CPython) or bytes into the context's reusable buffer.
+const std::string& LoadSentence(py::handle sentence, cppjieba::SegmentContext& ctx) {
+    const char* data = nullptr;
+    Py_ssize_t size = 0;
+    if (PyUnicode_Check(sentence.ptr())) {
+        data = PyUnicode_AsUTF8AndSize(sentence.ptr(), &size);
+        if (!data) {
+            throw py::error_already_set();
+        }
+    } else if (PyBytes_Check(sentence.ptr())) {
+        char* bytes = nullptr;
+        if (PyBytes_AsStringAndSize(sentence.ptr(), &bytes, &size) != 0) {
+            throw py::error_already_set();
+        }
+        data = bytes;
+    } else {
+        throw py::type_error("sentence must be str or bytes");
+    }
+    ctx.sentence.assign(data, static_cast<size_t>(size));
+    return ctx.sentence;
+}
+
+py::list WordRangesToList(const std::string& sentence, const std::vector<cppjieba::WordRange>& wrs) {
+    py::list result(wrs.size());
+    for (size_t i = 0; i < wrs.size(); ++i) {
+        const uint32_t offset = wrs[i].left->offset;
+        const uint32_t len = wrs[i].right->offset - offset + wrs[i].right->len;
+        PyObject* word = PyUnicode_DecodeUTF8(sentence.data() + offset, len, nullptr);
+        if (!word) {
+            throw py::error_already_set();
+        }
+        PyList_SET_ITEM(result.ptr(), static_cast<Py_ssize_t>(i), word);
+    }
+    return result;
+}
+
+} // namespace
+
 // Define the Python module 'bindings'
 PYBIND11_MODULE(bindings, m) {
     m.doc() = "Python bindings for DAT-optimized CppJieba";
+
+    // --- Bind DAT cache validation modes ---
+    py::enum_<cppjieba::DictTrie::CacheValidation>(m, "CacheValidation",
+                                                   "How an existing DAT cache is checked against the dictionaries.")
+        .value("STRICT", cppjieba::DictTrie::ValidateStrict)  // MD5 of all dictionaries on every start
+        .value("FAST", cppjieba::DictTrie::ValidateFast)      // stat() manifest, content hash only if it differs
+        .value("READONLY", cppjieba::DictTrie::ValidateReadOnly); // attach compiled caches only, never build
+
+    // --- Bind DAT element formats ---
+    py::enum_<cppjieba::DatElementFormat>(m, "ElementFormat", "How the main dictionary cache stores its entries.")
+        .value("WIDE", cppjieba::DAT_ELEMENTS_WIDE)          // 16 bytes: double weight + tag
+        .value("COMPACT", cppjieba::DAT_ELEMENTS_COMPACT)    // 8 bytes: weight and tag ids into tables
+        .value("INLINE", cppjieba::DAT_ELEMENTS_INLINE);     // the ids packed into the DAT leaf values
+
+    // --- Bind DAT engines ---
+    py::enum_<cppjieba::DatEngine>(m, "DatEngine", "Trie over the main dictionary's words.")
+        .value("BYTES", cppjieba::DAT_ENGINE_BYTES)  // darts-clone over UTF-8 bytes
+        .value("RUNES", cppjieba::DAT_ENGINE_RUNES)  // one transition per character
+        .value("LOUDS", cppjieba::DAT_ENGINE_LOUDS); // succinct, a few times smaller
+
+    // --- Bind lazily loaded components ---
+    py::enum_<cppjieba::JiebaComponent>(m, "Component", "Parts of a Jieba loaded on first use, flags for warmup().",
+                                        py::arithmetic())
+        .value("HMM", cppjieba::JIEBA_COMPONENT_HMM)            // for cuts with hmm=True and tag()
+        .value("KEYWORDS", cppjieba::JIEBA_COMPONENT_KEYWORDS)  // IDF and stop words, for extract_keywords()
+        .value("ALL", cppjieba::JIEBA_COMPONENT_ALL);
+
+    // --- Bind attach-time mmap hints ---
+    py::class_<cppjieba::MmapOptions> mmap_options(m, "MmapOptions",
+                                                   "Hints applied to the DAT / bundle mapping after it is attached.");
+    py::enum_<cppjieba::MmapOptions::Prefetch>(mmap_options, "Prefetch")
+        .value("NONE", cppjieba::MmapOptions::PrefetchNone)
+        .value("WILLNEED", cppjieba::MmapOptions::PrefetchWillNeed)  // background readahead
+        .value("POPULATE", cppjieba::MmapOptions::PrefetchPopulate); // every page faulted in before returning
+    py::enum_<cppjieba::MmapOptions::Access>(mmap_options, "Access")
+        .value("NORMAL", cppjieba::MmapOptions::AccessNormal)
+        .value("RANDOM", cppjieba::MmapOptions::AccessRandom)
+        .value("SEQUENTIAL", cppjieba::MmapOptions::AccessSequential);
+    mmap_options
+        .def(py::init<>())
+        .def_readwrite("prefetch", &cppjieba::MmapOptions::prefetch)
+        .def_readwrite("access", &cppjieba::MmapOptions::access)
+        .def_readwrite("huge_pages", &cppjieba::MmapOptions::huge_pages)
+        .def_readwrite("lock", &cppjieba::MmapOptions::lock);
+
+    // --- Bind the offline cache compiler ---
+    m.def("compile_caches",
+          [](const std::string& dict_path, const std::string& model_path, const std::string& user_dict_path,
+             const std::string& cache_dir, cppjieba::DatElementFormat element_format, cppjieba::DatEngine engine) {
+              cppjieba::CompiledCaches caches;
+              {
+                  py::gil_scoped_release release;
+                  caches = cppjieba::CompileCaches(dict_path, model_path, user_dict_path, cache_dir,
+                                                   element_format, engine);
+              }
+              py::list files;
+              for (const auto& file : caches.files) {
+                  py::dict entry;
+                  entry["kind"] = file.kind;
+                  entry["path"] = file.path;
+                  entry["size"] = file.size;
+                  entry["words"] = file.words_num;
+                  files.append(entry);
+              }
+              py::dict result;
+              result["files"] = files;
+              result["total_dict_size"] = caches.total_dict_size;
+              result["seconds"] = caches.seconds;
+              return result;
+          },
+          "Build the dictionary and HMM model caches a Jieba with these arguments attaches into cache_dir, "
+          "without loading segmenters. Returns the files written with their sizes.",
+          py::arg("dict_path"),
+          py::arg("model_path"),
+          py::arg("user_dict_path") = "",
+          py::arg("cache_dir") = "",
+          py::arg("element_format") = cppjieba::DAT_ELEMENTS_WIDE,
+          py::arg("engine") = cppjieba::DAT_ENGINE_BYTES);
+
     // --- Bind Jieba class ---
     py::class_<cppjieba::Jieba>(m, "Jieba", "Main Jieba interface for segmentation, tagging, etc.")
         // Constructor binding
-        .def(py::init<const std::string&, const std::string&, const std::string&, const std::string&, const std::string&, const std::string&>(),
+        .def(py::init<const std::string&, const std::string&, const std::string&, const std::string&, const std::string&, const std::string&,
+                      cppjieba::DictTrie::CacheValidation, const cppjieba::MmapOptions&, cppjieba::DatElementFormat,
+                      cppjieba::DatEngine, bool>(),
              py::arg("dict_path"),           // Main dictionary path
              py::arg("model_path"),          // HMM model path
              py::arg("user_dict_path"),      // User dictionary path
              py::arg("idf_path") = "",       // Optional IDF path
              py::arg("stop_word_path") = "", // Optional stop word path
-             py::arg("dat_cache_path") = ""  // Optional DAT cache directory (passed from Python __init__)
+             py::arg("dat_cache_path") = "", // Optional DAT cache directory (passed from Python __init__)
+             py::arg("cache_validation") = cppjieba::DictTrie::ValidateFast,
+             py::arg("mmap_options") = cppjieba::MmapOptions(),
+             py::arg("element_format") = cppjieba::DAT_ELEMENTS_WIDE,
+             py::arg("engine") = cppjieba::DAT_ENGINE_BYTES,
+             py::arg("profiled_layout") = false
+            )
+        .def_static("from_bundle",
+             [](const std::string& bundle_path, const cppjieba::MmapOptions& mmap_options) {
+                 py::gil_scoped_release release;
+                 return std::unique_ptr<cppjieba::Jieba>(
+                     new cppjieba::Jieba(cppjieba::ModelBundle::Open(bundle_path, mmap_options)));
+             },
+             "Load everything from one model bundle written by save_bundle, mapped with a single mmap.",
+             py::arg("bundle_path"),
+             py::arg("mmap_options") = cppjieba::MmapOptions()
+            )
+        .def_static("from_memory",
+             [](std::string dict, std::string hmm_model, std::string user_dict, const std::string& idf_path,
+                const std::string& stop_word_path, const cppjieba::MmapOptions& mmap_options,
+                cppjieba::DatElementFormat element_format, cppjieba::DatEngine engine) {
+                 auto contents = std::make_shared<cppjieba::ModelContents>();
+                 contents->dict = std::move(dict);
+                 contents->hmm_model = std::move(hmm_model);
+                 contents->user_dict = std::move(user_dict);
+                 py::gil_scoped_release release;
+                 return std::unique_ptr<cppjieba::Jieba>(new cppjieba::Jieba(
+                     contents, idf_path, stop_word_path, mmap_options, element_format, engine));
+             },
+             "Build the dictionaries and HMM model from their contents in memory, without reading or writing "
+             "any cache file.",
+             py::arg("dict"),
+             py::arg("hmm_model"),
+             py::arg("user_dict") = "",
+             py::arg("idf_path") = "",
+             py::arg("stop_word_path") = "",
+             py::arg("mmap_options") = cppjieba::MmapOptions(),
+             py::arg("element_format") = cppjieba::DAT_ELEMENTS_WIDE,
+             py::arg("engine") = cppjieba::DAT_ENGINE_BYTES
+            )
+        .def("save_bundle", &cppjieba::Jieba::SaveBundle,
+             "Write the dictionaries, HMM model, IDF and stop words as one model bundle. "
+             "Words added with insert_user_word are not saved.",
+             py::arg("path"),
+             py::call_guard<py::gil_scoped_release>()
+            )
+        .def("save_profiled_layout", &cppjieba::Jieba::SaveProfiledLayout,
+             "Write a main dictionary cache with the words matched most often in the sample corpus files laid out "
+             "first, used by instances created with profiled_layout. Returns its path.",
+             py::arg("corpus_paths"),
+             py::call_guard<py::gil_scoped_release>()
             )
 
         // --- Bind Segmentation Methods (returning List[str]) ---
+        // They cut into the calling thread's SegmentContext and build the result list straight
+        // from the word offsets, so steady-state calls make no C++ heap allocations.
         .def("cut",
-             [](const cppjieba::Jieba& self, const std::string& sentence, bool hmm) -> std::vector<std::string> {
-                 std::vector<std::string> words;
-                 self.Cut(sentence, words, hmm); // Uses MixSegment
-                 return words;
+             [](const cppjieba::Jieba& self, py::handle sentence, bool hmm, size_t threads) -> py::list {
+                 cppjieba::SegmentContext& ctx = ThreadSegmentContext();
+                 const std::string& text = LoadSentence(sentence, ctx);
+                 {
+                     py::gil_scoped_release release;
+                     self.CutRanges(text, hmm, ctx, threads); // Uses MixSegment
+                 }
+                 return WordRangesToList(text, ctx.wrs);
              },
-             "Cut sentence using MixSegment.",
+             "Cut sentence using MixSegment. threads > 1 cuts large inputs on several threads.",
              py::arg("sentence"),
-             py::arg("hmm") = true // Default to HMM enabled
+             py::arg("hmm") = true, // Default to HMM enabled
+             py::arg("threads") = 1
             )
 
         .def("cut_all",
-             [](const cppjieba::Jieba& self, const std::string& sentence) -> std::vector<std::string> {
-                 std::vector<std::string> words;
-                 self.CutAll(sentence, words); // Uses FullSegment
-                 return words;
+             [](const cppjieba::Jieba& self, py::handle sentence, size_t threads) -> py::list {
+                 cppjieba::SegmentContext& ctx = ThreadSegmentContext();
+                 const std::string& text = LoadSentence(sentence, ctx);
+                 {
+                     py::gil_scoped_release release;
+                     self.CutAllRanges(text, ctx, threads); // Uses FullSegment
+                 }
+                 return WordRangesToList(text, ctx.wrs);
              },
              "Cut sentence using FullSegment (cuts all possible words).",
-             py::arg("sentence")
+             py::arg("sentence"),
+             py::arg("threads") = 1
             )
 
         .def("cut_for_search",
-             [](const cppjieba::Jieba& self, const std::string& sentence, bool hmm) -> std::vector<std::string> {
-                 std::vector<std::string> words;
-                 self.CutForSearch(sentence, words, hmm); // Uses QuerySegment
-                 return words;
+             [](const cppjieba::Jieba& self, py::handle sentence, bool hmm, size_t threads) -> py::list {
+                 cppjieba::SegmentContext& ctx = ThreadSegmentContext();
+                 const std::string& text = LoadSentence(sentence, ctx);
+                 {
+                     py::gil_scoped_release release;
+                     self.CutForSearchRanges(text, hmm, ctx, threads); // Uses QuerySegment
+                 }
+                 return WordRangesToList(text, ctx.wrs);
              },
              "Cut sentence for search engine using QuerySegment.",
              py::arg("sentence"),
-             py::arg("hmm") = true // Default to HMM enabled
+             py::arg("hmm") = true, // Default to HMM enabled
+             py::arg("threads") = 1
             )
 
         // --- Bind POS Tagging Methods ---
@@ -83,13 +279,87 @@ PYBIND11_MODULE(bindings, m) {
              py::arg("word")
             )
 
+        // --- Bind Runtime Dictionary Insertion ---
+        .def("insert_user_word",
+             [](cppjieba::Jieba& self, const std::string& word, int freq, const std::string& tag) -> bool {
+                 return freq > 0 ? self.InsertUserWord(word, freq, tag) : self.InsertUserWord(word, tag);
+             },
+             "Add or replace a word at runtime (freq <= 0 uses the default user word weight). "
+             "Lookups see it immediately; large overlays are compacted into an in-memory user layer in the background, "
+             "private to this process; no cache file is written.",
+             py::arg("word"),
+             py::arg("freq") = 0,
+             py::arg("tag") = "",
+             py::call_guard<py::gil_scoped_release>()
+            )
+        .def("set_overlay_compact_threshold", &cppjieba::Jieba::SetOverlayCompactThreshold,
+             "Number of inserted words that triggers background compaction (0 disables it).",
+             py::arg("threshold")
+            )
+
+        // --- Bind Hot Reload ---
+        .def("reload",
+             [](cppjieba::Jieba& self, py::object user_dict_path, bool async) -> bool {
+                 if (user_dict_path.is_none()) {
+                     py::gil_scoped_release release;
+                     return self.Reload(async);
+                 }
+
+                 const std::string paths = user_dict_path.cast<std::string>();
+                 py::gil_scoped_release release;
+                 return self.ReloadUserDict(paths, async);
+             },
+             "Reload the dictionaries (optionally with other user dictionaries) and swap them in without "
+             "blocking cuts. With async_=True it returns once the background reload has started; "
+             "False means another reload is running or, when synchronous, that it failed.",
+             py::arg("user_dict_path") = py::none(),
+             py::arg("async_") = false
+            )
+        .def("wait_reload", &cppjieba::Jieba::WaitForReload,
+             "Wait for a background reload to finish.",
+             py::call_guard<py::gil_scoped_release>()
+            )
+        .def_property_readonly("reload_generation",
+             [](const cppjieba::Jieba& self) { return self.GetDictTrie()->GetGeneration(); },
+             "Number of successful reloads.")
+        .def_property_readonly("reload_in_progress",
+             [](const cppjieba::Jieba& self) { return self.GetDictTrie()->IsReloading(); })
+        .def_property_readonly("last_reload_ok",
+             [](const cppjieba::Jieba& self) { return self.GetDictTrie()->LastReloadSucceeded(); })
+        .def_property_readonly("last_reload_ms",
+             [](const cppjieba::Jieba& self) { return self.GetDictTrie()->GetLastReloadMicros() / 1000.0; },
+             "Wall time of the last finished reload in milliseconds.")
+
+        .def_property_readonly("resident_pages",
+             [](const cppjieba::Jieba& self) {
+                 const cppjieba::Residency residency = self.GetDictTrie()->GetResidency();
+                 return std::make_pair(residency.resident_pages, residency.total_pages);
+             },
+             "(resident, total) pages of the dictionary mappings, from mincore(); (0, total) where unsupported.")
+
+        .def("warmup", &cppjieba::Jieba::Warmup,
+             "Load the given Component flags now instead of on first use.",
+             py::arg("components") = static_cast<int>(cppjieba::JIEBA_COMPONENT_ALL),
+             py::call_guard<py::gil_scoped_release>()
+            )
+
+        // --- Bind Range Limit Configuration ---
+        .def("set_range_limits", &cppjieba::Jieba::SetRangeLimits,
+             "Cut separator-free ranges longer than max_range_len runes in overlapping windows, "
+             "capping per-window working memory at max_work_bytes (0 disables a limit). "
+             "The decoded text and the output words are not counted in max_work_bytes.",
+             py::arg("max_range_len"),
+             py::arg("overlap") = cppjieba::DEFAULT_RANGE_OVERLAP,
+             py::arg("max_work_bytes") = cppjieba::DEFAULT_MAX_WORK_BYTES
+            )
+
         // --- Bind Keyword Extraction Method ---
         .def("extract_keywords",
              [](const cppjieba::Jieba& self, const std::string& sentence, int top_k) -> std::vector<std::pair<std::string, double>> {
                  // Directly call the Extract overload returning pairs
                  std::vector<std::pair<std::string, double>> keywords;
-                 // Access the public 'extractor' member and call its 'Extract' method
-                 self.extractor.Extract(sentence, keywords, top_k);
+                 // The extractor is loaded on the first call, see Jieba::GetKeywordExtractor
+                 self.GetKeywordExtractor().Extract(sentence, keywords, top_k);
                  return keywords; // pybind11 automatically converts to List[Tuple[str, float]]
              },
              "Extract keywords from sentence using TF-IDF.",
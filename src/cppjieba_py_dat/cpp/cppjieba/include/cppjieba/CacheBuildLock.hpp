@@ -0,0 +1,179 @@
+#pragma once
+
+#include <errno.h>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "limonp/Logging.hpp"
+
+#if defined(_WIN32) || defined(_WIN64)
+#    include <windows.h>
+#else
+#    include "limonp/FileLock.hpp"
+#endif
+
+namespace cppjieba {
+
+using std::string;
+
+// How long a process waits for another one building the same cache file
+// before it takes the builder for hung and builds the file itself.
+const size_t DEFAULT_CACHE_LOCK_TIMEOUT_MS = 10 * 60 * 1000;
+
+// Advisory lock on <cache file>.lock, held while the cache file is built,
+// so that of many processes starting on a new dictionary one builds it and
+// the others wait and then attach the finished file.
+//
+// The lock goes away with the process holding it, so a crashed builder
+// leaves nothing stale behind; the lock file itself is never removed, as
+// that would let two processes lock different files of the same name.
+// Without a lock, after the timeout or when the lock file cannot be
+// opened, the cache is built anyway, it is renamed into place atomically
+// either way. Record locks belong to a process, not a thread, so builds of
+// the same file within one process are serialized here as well, under a
+// mutex per lock file; builds of other files go ahead. Do not nest two
+// locks of the same file.
+class CacheBuildLock {
+public:
+    explicit CacheBuildLock(const string& cache_file, size_t timeout_ms = DEFAULT_CACHE_LOCK_TIMEOUT_MS)
+        : path_mutex_(PathMutex(cache_file + ".lock")), path_lock_(*path_mutex_), locked_(false), waited_(false) {
+        const string path = cache_file + ".lock";
+        const auto start = std::chrono::steady_clock::now();
+        size_t sleep_ms = 10;
+
+        while (!TryLock(path)) {
+            if (!waited_) {
+                return; // locking is not possible, TryLock logged why
+            }
+
+            const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start);
+            if (size_t(elapsed.count()) >= timeout_ms) {
+                XLOG(WARNING) << "Cache build lock " << path << " still held after " << timeout_ms
+                              << " ms, building without it";
+                return;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+            sleep_ms = sleep_ms < 200 ? sleep_ms * 2 : sleep_ms;
+        }
+    }
+
+    ~CacheBuildLock() {
+        if (!locked_) {
+            return;
+        }
+#if defined(_WIN32) || defined(_WIN64)
+        OVERLAPPED overlapped = {};
+        ::UnlockFileEx(file_, 0, 1, 0, &overlapped);
+        ::CloseHandle(file_);
+#else
+        file_lock_->UnLock();
+#endif
+    }
+
+    // Whether this process holds the lock
+    bool Locked() const {
+        return locked_;
+    }
+
+    // Whether another process held the lock first, so the cache file may
+    // have been built meanwhile
+    bool Waited() const {
+        return waited_;
+    }
+
+private:
+    CacheBuildLock(const CacheBuildLock&);
+    CacheBuildLock& operator=(const CacheBuildLock&);
+
+    // The in-process mutex of a lock file, shared by the locks on it while
+    // any exists; map_mutex only guards the map.
+    static std::shared_ptr<std::mutex> PathMutex(const string& path) {
+        static std::mutex map_mutex;
+        static std::map<string, std::weak_ptr<std::mutex> > mutexes;
+        std::lock_guard<std::mutex> lock(map_mutex);
+
+        for (auto it = mutexes.begin(); it != mutexes.end();) {
+            if (it->second.expired()) {
+                it = mutexes.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        std::shared_ptr<std::mutex> path_mutex = mutexes[path].lock();
+        if (!path_mutex) {
+            path_mutex = std::make_shared<std::mutex>();
+            mutexes[path] = path_mutex;
+        }
+        return path_mutex;
+    }
+
+    // True once locked. Sets waited_ while another process holds the lock;
+    // false with neither set when locking is not possible at all.
+    bool TryLock(const string& path) {
+#if defined(_WIN32) || defined(_WIN64)
+        HANDLE file = ::CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_ALWAYS,
+                                    FILE_ATTRIBUTE_NORMAL, NULL);
+        if (INVALID_HANDLE_VALUE == file) {
+            XLOG(WARNING) << "Cannot open cache build lock " << path << ", error code: " << ::GetLastError();
+            return false;
+        }
+
+        OVERLAPPED overlapped = {};
+        if (::LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped)) {
+            file_ = file;
+            locked_ = true;
+            return true;
+        }
+
+        const DWORD error = ::GetLastError();
+        ::CloseHandle(file);
+        if (error != ERROR_LOCK_VIOLATION) {
+            XLOG(WARNING) << "Cannot lock cache build lock " << path << ", error code: " << error;
+            return false;
+        }
+#else
+        std::unique_ptr<limonp::FileLock> lock(new limonp::FileLock());
+        lock->Open(path);
+        if (!lock->Ok()) {
+            XLOG(WARNING) << "Cannot open cache build lock " << path << ": " << lock->Error();
+            return false;
+        }
+
+        lock->Lock();
+        if (lock->Ok()) {
+            file_lock_.swap(lock);
+            locked_ = true;
+            return true;
+        }
+
+        if (errno != EAGAIN && errno != EACCES) {
+            XLOG(WARNING) << "Cannot lock cache build lock " << path << ": " << lock->Error();
+            return false;
+        }
+#endif
+        if (!waited_) {
+            XLOG(INFO) << "Waiting for another process to build the cache, lock " << path;
+        }
+        waited_ = true;
+        return false;
+    }
+
+    std::shared_ptr<std::mutex> path_mutex_;
+    std::unique_lock<std::mutex> path_lock_;
+    bool locked_;
+    bool waited_;
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE file_ = NULL;
+#else
+    std::unique_ptr<limonp::FileLock> file_lock_;
+#endif
+}; // class CacheBuildLock
+
+} // namespace cppjieba
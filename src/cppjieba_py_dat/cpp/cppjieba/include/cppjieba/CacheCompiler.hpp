@@ -0,0 +1,86 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "DictTrie.hpp"
+#include "HMMModel.hpp"
+
+namespace cppjieba {
+
+using std::string;
+using std::vector;
+
+// One file written by CompileCaches
+struct CompiledCacheFile {
+    string kind; // "dict", "user" or "hmm"
+    string path;
+    size_t size;
+    size_t words_num; // 0 for the HMM model
+};
+
+struct CompiledCaches {
+    vector<CompiledCacheFile> files;
+    DatElementFormat element_format;
+    DatEngine engine;
+    size_t total_dict_size;
+    double seconds;
+};
+
+// Builds into cache_dir the dictionary and HMM model caches that a Jieba
+// over the same files and settings attaches, without loading segmenters or
+// keyword tables, e.g. once while building an image. Caches are named as
+// with ValidateFast, so instances started with ValidateFast or
+// ValidateReadOnly map them; current ones are kept as they are. IDF and stop
+// words have no cache of their own, Jieba::SaveBundle covers them.
+inline CompiledCaches CompileCaches(const string& dict_path, const string& model_path,
+                                    const string& user_dict_paths, const string& cache_dir,
+                                    DatElementFormat element_format = DAT_ELEMENTS_WIDE,
+                                    DatEngine engine = DAT_ENGINE_BYTES) {
+    if (cache_dir.empty()) {
+        throw std::invalid_argument("Cache directory cannot be empty.");
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    CompiledCaches result;
+    result.element_format = element_format;
+    result.engine = engine;
+
+    {
+        DictTrie dict_trie(dict_path, user_dict_paths, cache_dir, DictTrie::WordWeightMedian,
+                           DictTrie::ValidateFast, MmapOptions(), element_format, engine);
+        result.total_dict_size = dict_trie.GetTotalDictSize();
+
+        std::shared_ptr<const DatTrie> base = dict_trie.GetBaseLayer();
+        CompiledCacheFile base_file = {"dict", base->GetCacheFile(), base->GetCacheFileSize(),
+                                       base->GetElementsNum()};
+        result.files.push_back(base_file);
+
+        // empty when the main dictionary has every user word already
+        const string user_cache_file = dict_trie.GetUserCacheFile();
+        if (!user_cache_file.empty()) {
+            std::shared_ptr<const DatTrie> user = dict_trie.GetUserLayer();
+            std::ifstream file(user_cache_file.c_str(), std::ios::binary | std::ios::ate);
+            CompiledCacheFile user_file = {"user", user_cache_file, size_t(file.tellg()),
+                                           user ? user->GetElementsNum() : 0};
+            result.files.push_back(user_file);
+        }
+    }
+
+    if (!model_path.empty()) {
+        HMMModel model(model_path, cache_dir);
+        if (model.GetCacheFile().empty()) {
+            throw std::runtime_error("Failed to write HMM model cache into " + cache_dir);
+        }
+
+        CompiledCacheFile model_file = {"hmm", model.GetCacheFile(), model.GetCacheFileSize(), 0};
+        result.files.push_back(model_file);
+    }
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+} // namespace cppjieba
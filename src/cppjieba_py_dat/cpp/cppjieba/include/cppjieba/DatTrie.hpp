@@ -7,16 +7,27 @@
 #else
 #    include <sys/mman.h>
 #    include <unistd.h>
+#    if defined(__linux__)
+#        include <sys/syscall.h>
+#    endif
 #endif
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <algorithm>
+#include <limits>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <stdexcept>
 
 #include "Unicode.hpp"
+#include "FastHash.hpp"
+#include "LoudsTrie.hpp"
+#include "ModelBundle.hpp"
+#include "RuneDoubleArray.hpp"
 #include "darts.h"
 #include "limonp/Md5.hpp"
 
@@ -41,6 +52,7 @@ uint64_t GetFileSize(const std::string &fname, uint64_t *size) {
 #endif
 
 using std::pair;
+using std::unordered_set;
 
 struct DatElement {
     string word;
@@ -56,6 +68,9 @@ struct DatElement {
     }
 };
 
+// Lookups per word in a sample corpus, see DictTrie::SaveProfiledLayout
+typedef std::unordered_map<string, uint64_t> WordHeat;
+
 inline std::ostream &operator<<(std::ostream &os, const DatElement &elem) {
     return os << "word=" << elem.word << "/tag=" << elem.tag << "/weight=" << elem.weight;
 }
@@ -80,109 +95,879 @@ inline std::ostream &operator<<(std::ostream &os, const DatMemElem &elem) {
     return os << "/tag=" << elem.GetTag() << "/weight=" << elem.weight;
 }
 
+// Element of compact caches: indexes into the trie's tables of distinct
+// weights and tags, so it is half the size of a DatMemElem and lookups
+// still return exactly the weights the wide format stores.
+struct DatCompactElem {
+    uint32_t weight_id = 0;
+    uint16_t tag_id = 0;
+    uint16_t reserved = 0;
+};
+
+struct DatTag {
+    char tag[8] = {};
+};
+
+// A dictionary's words in key order, each once, as the trie build takes
+// them: all keys in one buffer and tags numbered, where DatElement holds
+// three strings per word. Tags are cut to what DatMemElem stores.
+class DatWordTable {
+   public:
+    // Words must come in key order; of equal words only the first is kept.
+    void Append(const char *word, size_t len, double weight, const char *tag, size_t tag_len) {
+        if (!weights_.empty() && key_starts_.back() + len + 1 == keys_.size() &&
+            keys_.compare(key_starts_.back(), len, word, len) == 0) {
+            return;
+        }
+
+        key_starts_.push_back(keys_.size());
+        keys_.append(word, len);
+        keys_.push_back('\0');
+        weights_.push_back(weight);
+
+        const string name(tag, std::min(tag_len, sizeof(DatTag) - 1));
+        const auto it = tag_ids_.insert(std::make_pair(name, uint32_t(tags_.size()))).first;
+        if (it->second == tags_.size()) {
+            tags_.push_back(DatTag());
+            memcpy(tags_.back().tag, name.data(), name.size());
+        }
+        word_tags_.push_back(it->second);
+    }
+
+    size_t Size() const { return weights_.size(); }
+
+    const char *Key(size_t i) const { return keys_.data() + key_starts_[i]; }
+
+    double Weight(size_t i) const { return weights_[i]; }
+
+    uint32_t TagId(size_t i) const { return word_tags_[i]; }
+
+    const vector<DatTag> &Tags() const { return tags_; }
+
+    DatMemElem Element(size_t i) const {
+        DatMemElem elem;
+        elem.weight = weights_[i];
+        memcpy(elem.tag, tags_[word_tags_[i]].tag, sizeof(elem.tag));
+        return elem;
+    }
+
+   private:
+    string keys_; // each followed by a NUL
+    vector<size_t> key_starts_;
+    vector<double> weights_;
+    vector<uint32_t> word_tags_;
+    vector<DatTag> tags_;
+    std::unordered_map<string, uint32_t> tag_ids_;
+};
+
+enum DatElementFormat {
+    DAT_ELEMENTS_WIDE = 0,    // DatMemElem[]
+    DAT_ELEMENTS_COMPACT = 1, // DatCompactElem[] plus weight and tag tables
+    DAT_ELEMENTS_INLINE = 2,  // no element array, DAT values are tag id << 16 | weight id
+};
+
+// Trie over the words of a cache, see CacheFileHeader::engine
+enum DatEngine {
+    DAT_ENGINE_BYTES = 0, // darts-clone over UTF-8 bytes
+    DAT_ENGINE_RUNES = 1, // RuneDoubleArray, one transition per character
+    DAT_ENGINE_LOUDS = 2, // LoudsTrie, a few times smaller, slower transitions
+};
+
+// Edge weight of a single rune that is no dictionary word. Dictionary
+// weights are finite log probabilities.
+const double DAG_NO_WORD = std::numeric_limits<double>::infinity();
+
+// An edge of the DAG. Trivially copyable, as LocalVector copies with memcpy.
+struct DagNext {
+    size_t end;    // rune index one past the word
+    double weight; // or DAG_NO_WORD
+};
+
 struct DatDag {
-    limonp::LocalVector<pair<size_t, const DatMemElem *> > nexts;
+    limonp::LocalVector<DagNext> nexts;
     double max_weight;
     int max_next;
 };
 
 typedef Darts::DoubleArray JiebaDAT;
 
+// Where a scan stands after the first character, see DatTrie::BuildJumpTable
+struct DatJump {
+    uint32_t node = 0;  // trie position after the rune, 0 if no word starts with it
+    int32_t value = -1; // DAT value of the rune as a word
+};
+
+// (path, size, mtime, inode) of one dictionary file, as recorded in the
+// cache manifest. Equal stamps mean the file can be trusted unchanged.
+struct FileStamp {
+    uint64_t path_hash = 0;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint64_t inode = 0;
+
+    bool operator==(const FileStamp &b) const {
+        return path_hash == b.path_hash && size == b.size && mtime_ns == b.mtime_ns && inode == b.inode;
+    }
+};
+
+const uint32_t CACHE_FILE_MAGIC = 0x35544144; // "DAT5"
+
+// Cache file layout: header | FileStamp[stamps_num] | Rune single_words[single_words_num], padded
+// to a multiple of 16 bytes | elements | DAT units, the elements being
+// DatMemElem[elements_num], or for DAT_ELEMENTS_COMPACT
+// DatCompactElem[elements_num] | double weights[weights_num] | DatTag tags[tags_num],
+// or for DAT_ELEMENTS_INLINE only the two tables. The units are darts units, dat_size of them,
+// or for DAT_ENGINE_RUNES and DAT_ENGINE_LOUDS a RuneDoubleArray or LoudsTrie
+// image of dat_size bytes. Counts that grow with the dictionary are 64-bit.
 struct CacheFileHeader {
     char md5_hex[32] = {};
     double min_weight = 0;
-    uint32_t elements_num = 0;
-    uint32_t dat_size = 0;
+    uint64_t elements_num = 0;
+    uint64_t dat_size = 0;
+    uint32_t magic = CACHE_FILE_MAGIC;
+    uint32_t stamps_num = 0;
+    uint64_t content_hash = 0; // FastHash64 of the dictionaries, 0 if not recorded
+    double freq_sum = 0;       // of the main dictionary, to weigh words inserted later
+    double user_word_default_weight = 0;
+    uint32_t element_format = DAT_ELEMENTS_WIDE;
+    uint32_t engine = DAT_ENGINE_BYTES;
+    uint64_t weights_num = 0;
+    uint32_t tags_num = 0;
+    uint32_t single_words_num = 0; // see DatTrie::SetSingleWords
 };
 
 static_assert(sizeof(DatMemElem) == 16, "DatMemElem length invalid");
+static_assert(sizeof(DatCompactElem) == 8, "DatCompactElem length invalid");
+static_assert(sizeof(DatTag) == 8, "DatTag length invalid");
+static_assert(sizeof(FileStamp) == 32, "FileStamp length invalid");
+static_assert(sizeof(CacheFileHeader) == 112, "CacheFileHeader length invalid");
 static_assert((sizeof(CacheFileHeader) % sizeof(DatMemElem)) == 0, "DatMemElem CacheFileHeader length equal");
 
 class DatTrie {
    public:
     DatTrie() {}
     ~DatTrie() {
-#if defined(_WIN32) || defined(_WIN64)
-        BOOL ret = ::UnmapViewOfFile(mmap_addr_);
-        assert(ret);
-
-        ret = ::CloseHandle(mmap_fd_);
-        assert(ret);
+        Detach();
+    }
 
-        ret = ::CloseHandle(file_fd_);
-        assert(ret);
-#else
+    // elem, if given, receives the entry in wide form whatever the format
+    bool Find(const string &key, DatMemElem *elem = nullptr) const {
+        if (elements_num_ == 0) {
+            return false;
+        }
 
-        ::munmap(mmap_addr_, mmap_length_);
-        mmap_addr_ = nullptr;
-        mmap_length_ = 0;
+        int value = -1;
 
-        ::close(mmap_fd_);
-        mmap_fd_ = -1;
-#endif
-    }
+        if (!runes_.Empty()) {
+            value = runes_.ExactMatch(key);
+        } else if (!louds_.Empty()) {
+            value = louds_.ExactMatch(key);
+        } else {
+            JiebaDAT::result_pair_type find_result;
+            dat_.exactMatchSearch(key.c_str(), find_result);
+            value = find_result.length ? find_result.value : -1;
+        }
 
-    const DatMemElem *Find(const string &key) const {
-        JiebaDAT::result_pair_type find_result;
-        dat_.exactMatchSearch(key.c_str(), find_result);
+        if (!IsValue(value)) {
+            return false;
+        }
 
-        if ((0 == find_result.length) || (find_result.value < 0) || (find_result.value >= (int)elements_num_)) {
-            return nullptr;
+        if (elem) {
+            *elem = ElementAt(value);
         }
 
-        return &elements_ptr_[find_result.value];
+        return true;
     }
 
+    // kBoundedLen == false drops the max_word_len check from the inner loop
+    template <bool kBoundedLen = true>
     void Find(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<struct DatDag> &res,
-              size_t max_word_len) const {
+              size_t max_word_len, string &text_str) const {
         res.clear();
         res.resize(end - begin);
-        const string text_str = EncodeRunesToString(begin, end);
+        EncodeRunesToString(begin, end, text_str);
+
+        if (!runes_.Empty()) {
+            ScanRunes<kBoundedLen, false>(begin, end, res, max_word_len);
+            return;
+        }
+
+        if (!louds_.Empty()) {
+            ScanLouds<kBoundedLen, false>(begin, end, res, max_word_len);
+            return;
+        }
+
+        Scan<kBoundedLen, false>(begin, end, res, max_word_len, text_str);
+    }
+
+    // Merges this trie's matches into a DAG that Find on another trie built
+    // for the same range, with text_str as Find left it. Matches of a length
+    // already present replace that entry.
+    template <bool kBoundedLen = true>
+    void MergeFind(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<struct DatDag> &res,
+                   size_t max_word_len, const string &text_str) const {
+        assert(res.size() == size_t(end - begin));
+        if (elements_num_ == 0) {
+            return;
+        }
+
+        if (!runes_.Empty()) {
+            ScanRunes<kBoundedLen, true>(begin, end, res, max_word_len);
+            return;
+        }
+
+        if (!louds_.Empty()) {
+            ScanLouds<kBoundedLen, true>(begin, end, res, max_word_len);
+            return;
+        }
+
+        Scan<kBoundedLen, true>(begin, end, res, max_word_len, text_str);
+    }
+
+    size_t GetElementsNum() const { return elements_num_; }
+
+    DatEngine GetEngine() const {
+        return !runes_.Empty() ? DAT_ENGINE_RUNES : !louds_.Empty() ? DAT_ENGINE_LOUDS : DAT_ENGINE_BYTES;
+    }
+
+    // Looks up every BMP rune once, so Find starts each position at depth one
+    // from a table instead of walking the first character from the root, and
+    // a single-character word costs no trie access. 512 KB; worth it for the
+    // main dictionary, which nearly every position of a text is looked up in.
+    void BuildJumpTable() {
+        vector<DatJump> jumps;
+
+        if (elements_num_ != 0) {
+            jumps.resize(kJumpTableSize);
+        }
+
+        string key;
+        for (Rune rune = 1; rune < jumps.size(); rune++) {
+            DatJump &jump = jumps[rune];
+
+            if (!runes_.Empty()) {
+                const int32_t node = runes_.Child(RuneDoubleArray::kRoot, rune);
+                if (node > 0) {
+                    jump.node = node;
+                    jump.value = runes_.Value(node);
+                }
+                continue;
+            }
 
-        for (size_t i = 0, begin_pos = 0; i < size_t(end - begin); i++) {
-            static const size_t max_num = 128;
-            JiebaDAT::result_pair_type result_pairs[max_num] = {};
-            std::size_t num_results = dat_.commonPrefixSearch(&text_str[begin_pos], &result_pairs[0], max_num);
+            if (!louds_.Empty()) {
+                const int32_t node = louds_.Child(LoudsTrie::kRoot, rune);
+                if (node > 0) {
+                    jump.node = node;
+                    jump.value = louds_.Value(node);
+                }
+                continue;
+            }
+
+            // the same bytes EncodeRunesToString gives the text
+            limonp::Unicode32ToUtf8(&rune, &rune + 1, key);
+            size_t node_pos = 0;
+            size_t key_pos = 0;
+            const int value = dat_.traverse(key.data(), node_pos, key_pos, key.size());
+            if (value != -2) {
+                jump.node = node_pos;
+                jump.value = value;
+            }
+        }
+
+        jumps_.swap(jumps);
+    }
+
+    DatElementFormat GetElementFormat() const {
+        return elements_ptr_ ? DAT_ELEMENTS_WIDE : compact_ptr_ ? DAT_ELEMENTS_COMPACT : DAT_ELEMENTS_INLINE;
+    }
+
+    double GetMinWeight() const { return min_weight_; }
+
+    void SetMinWeight(double d) { min_weight_ = d; }
 
-            res[i].nexts.push_back(pair<size_t, const DatMemElem *>(i + 1, nullptr));
+    double GetFreqSum() const { return freq_sum_; }
 
-            for (std::size_t idx = 0; idx < num_results; ++idx) {
-                auto &match = result_pairs[idx];
+    double GetUserWordDefaultWeight() const { return user_word_default_weight_; }
 
-                if ((match.value < 0) || (match.value >= (int)elements_num_)) {
+    // written into the header of caches built afterwards
+    void SetWordWeightStats(double freq_sum, double user_word_default_weight) {
+        freq_sum_ = freq_sum;
+        user_word_default_weight_ = user_word_default_weight;
+    }
+
+    // The one-character words of the dictionaries a user layer was built
+    // from, stored in caches built afterwards so that attaching one needs no
+    // parse of those dictionaries. Some of them may be no elements, as the
+    // base weighs them higher.
+    void SetSingleWords(const unordered_set<Rune> &words) {
+        single_words_.assign(words.begin(), words.end());
+        std::sort(single_words_.begin(), single_words_.end());
+    }
+
+    // Those of the attached cache
+    void GetSingleWords(unordered_set<Rune> &words) const {
+        words.insert(single_words_ptr_, single_words_ptr_ + single_words_num_);
+    }
+
+    // Builds a heap-owned DAT, no cache file involved. Used for small tries
+    // such as the runtime overlay.
+    void InitInMemory(vector<DatElement> &elements) {
+        Detach();
+        if (elements.empty()) {
+            return;
+        }
+
+        DatWordTable words;
+        SortElements(elements, words);
+        vector<DatMemElem> mem_elem_vec;
+        BuildDat(words, mem_elem_vec);
+        owned_elements_.swap(mem_elem_vec);
+        elements_ptr_ = owned_elements_.data();
+        elements_num_ = owned_elements_.size();
+        value_limit_ = elements_num_;
+    }
+
+    // Attaches to a trie stored elsewhere, e.g. in a ModelBundle, whose memory
+    // owner keeps alive. False if the units are malformed.
+    bool InitFromMemory(const DatMemElem *elements, size_t elements_num, const void *units, size_t units_size,
+                        const std::shared_ptr<const void> &owner, DatEngine engine = DAT_ENGINE_BYTES) {
+        Detach();
+        if (!AttachUnits(static_cast<const char *>(units), units_size, engine)) {
+            return false;
+        }
+
+        owner_ = owner;
+        elements_ptr_ = elements;
+        elements_num_ = elements_num;
+        value_limit_ = elements_num_;
+        return true;
+    }
+
+    // False if the bundle has no such trie.
+    bool InitFromBundle(const std::shared_ptr<const ModelBundle> &bundle, uint32_t elements_id, uint32_t units_id,
+                        DatEngine engine = DAT_ENGINE_BYTES) {
+        size_t units_size = 0;
+        const char *units = bundle->Section(units_id, &units_size);
+        if (!units) {
+            return false;
+        }
+
+        size_t elements_num = 0;
+        const DatMemElem *elements = bundle->Array<DatMemElem>(elements_id, &elements_num);
+        if (!InitFromMemory(elements, elements_num, units, units_size, bundle, engine)) {
+            throw std::runtime_error("Model bundle " + bundle->Path() + " has a malformed trie");
+        }
+
+        return true;
+    }
+
+    // An inline trie stored by AddToBundle: units plus weight and tag tables.
+    bool InitFromBundle(const std::shared_ptr<const ModelBundle> &bundle, uint32_t units_id, uint32_t weights_id,
+                        uint32_t tags_id, size_t words_num, DatEngine engine = DAT_ENGINE_BYTES) {
+        size_t units_size = 0;
+        const char *units = bundle->Section(units_id, &units_size);
+        size_t weights_num = 0;
+        const double *weights = reinterpret_cast<const double *>(bundle->Section(weights_id, &weights_num));
+        if (!units || !weights) {
+            return false;
+        }
+
+        size_t tags_num = 0;
+        const DatTag *tags = bundle->Array<DatTag>(tags_id, &tags_num);
+        Detach();
+        if (!AttachUnits(units, units_size, engine) || weights_num != sizeof(double) * (kWeightIdMask + 1) ||
+            tags_num > kMaxInlineTags + 1) {
+            Detach();
+            throw std::runtime_error("Model bundle " + bundle->Path() + " has a malformed trie");
+        }
+
+        owner_ = bundle;
+        weights_ptr_ = weights;
+        tags_ptr_ = tags;
+        tags_num_ = tags_num;
+        elements_num_ = words_num;
+        value_limit_ = kInlineValueLimit;
+        return true;
+    }
+
+    // Only cache files this trie mapped itself; bundles are advised as a whole.
+    void AdviseMapping(const MmapOptions &options) const {
+        cppjieba::AdviseMapping(mmap_addr_, mmap_length_, options);
+    }
+
+    void AddResidency(Residency &residency) const {
+        if (mmap_addr_) {
+            cppjieba::AddResidency(mmap_addr_, mmap_length_, residency);
+            return;
+        }
+
+        cppjieba::AddResidency(elements_ptr_, sizeof(DatMemElem) * elements_num_, residency);
+        if (value_limit_ == kInlineValueLimit) {
+            cppjieba::AddResidency(weights_ptr_, sizeof(double) * (kWeightIdMask + 1), residency);
+        }
+        cppjieba::AddResidency(UnitsData(), UnitsSize(), residency);
+    }
+
+    // Inline tries store their tables under weights_id and tags_id instead
+    // of elements under elements_id, rune and LOUDS tries their image under
+    // rune_units_id and louds_units_id instead of units_id.
+    void AddToBundle(BundleWriter &writer, uint32_t elements_id, uint32_t units_id, uint32_t weights_id = 0,
+                     uint32_t tags_id = 0, uint32_t rune_units_id = 0, uint32_t louds_units_id = 0) const {
+        if (elements_num_ == 0) {
+            return;
+        }
+
+        if ((!runes_.Empty() && rune_units_id == 0) || (!louds_.Empty() && louds_units_id == 0)) {
+            throw std::logic_error("no bundle section for a rune or LOUDS trie");
+        }
+
+        if (!elements_ptr_ && !compact_ptr_) {
+            if (weights_id == 0 || tags_id == 0) {
+                throw std::logic_error("no bundle sections for an inline trie");
+            }
+
+            writer.Add(weights_id, weights_ptr_, sizeof(double) * (kWeightIdMask + 1));
+            writer.Add(tags_id, tags_ptr_, sizeof(DatTag) * tags_num_);
+        } else if (compact_ptr_) {
+            // compact tries go in as wide elements
+            vector<DatMemElem> elements(elements_num_);
+            for (size_t i = 0; i < elements_num_; i++) {
+                elements[i] = ElementAt(i);
+            }
+
+            writer.Add(elements_id, elements.data(), sizeof(DatMemElem) * elements_num_);
+        } else {
+            writer.Add(elements_id, elements_ptr_, sizeof(DatMemElem) * elements_num_);
+        }
+
+        const DatEngine engine = GetEngine();
+        writer.Add(engine == DAT_ENGINE_RUNES   ? rune_units_id
+                   : engine == DAT_ENGINE_LOUDS ? louds_units_id
+                                                : units_id,
+                   UnitsData(), UnitsSize());
+    }
+
+   private:
+    // Inline values: tag id << 16 | weight id, non-negative as darts requires
+    static const uint32_t kWeightIdMask = 0xffff;
+    static const uint32_t kMaxInlineTags = 0x7fff;
+    static const size_t kInlineValueLimit = 0x80000000u;
+    static const size_t kJumpTableSize = 0x10000;
+
+    bool IsValue(int value) const {
+        return size_t(unsigned(value)) < value_limit_;
+    }
+
+    double WeightAt(int value) const {
+        if (elements_ptr_) {
+            return elements_ptr_[value].weight;
+        }
+
+        if (compact_ptr_) {
+            return weights_ptr_[compact_ptr_[value].weight_id];
+        }
+
+        return weights_ptr_[value & kWeightIdMask]; // no access beyond the DAT unit and this small table
+    }
+
+    DatMemElem ElementAt(int value) const {
+        if (elements_ptr_) {
+            return elements_ptr_[value];
+        }
+
+        uint32_t weight_id = value & kWeightIdMask;
+        uint32_t tag_id = uint32_t(value) >> 16;
+
+        if (compact_ptr_) {
+            weight_id = compact_ptr_[value].weight_id;
+            tag_id = compact_ptr_[value].tag_id;
+        }
+
+        DatMemElem elem;
+        elem.weight = weights_ptr_[weight_id];
+        memcpy(elem.tag, tags_ptr_[tag_id].tag, sizeof(elem.tag));
+        return elem;
+    }
+
+    bool AttachUnits(const char *units, size_t size, DatEngine engine) {
+        if (engine == DAT_ENGINE_RUNES) {
+            return runes_.Attach(units, size);
+        }
+
+        if (engine == DAT_ENGINE_LOUDS) {
+            return louds_.Attach(units, size);
+        }
+
+        if (engine != DAT_ENGINE_BYTES || size % dat_.unit_size() != 0) {
+            return false;
+        }
+
+        dat_.set_array(units, size / dat_.unit_size());
+        return true;
+    }
+
+    const char *UnitsData() const {
+        return !runes_.Empty() ? runes_.Image() : !louds_.Empty() ? louds_.Image()
+                                                                  : static_cast<const char *>(dat_.array());
+    }
+
+    size_t UnitsSize() const {
+        return !runes_.Empty() ? runes_.ImageSize() : !louds_.Empty() ? louds_.ImageSize()
+                                                                      : dat_.size() * dat_.unit_size();
+    }
+
+    // Scan and ScanRunes walk the prefix searches of kScanLanes positions in
+    // lockstep, one transition per lane and round: a lane's next unit is
+    // prefetched as soon as it is known and read a round later, so the cache
+    // misses of the lanes overlap instead of queueing one after another.
+    static const size_t kScanLanes = 8;
+
+    struct RuneLane {
+        size_t pos;      // where the words start
+        size_t next_pos; // rune checked by next
+        size_t last;     // from here on words exceed max_word_len
+        int32_t node;
+        int32_t next;    // candidate child of node
+    };
+
+    struct ByteLane {
+        size_t pos;
+        size_t key_pos;  // byte checked by unit
+        size_t char_num; // characters up to and including that byte
+        size_t unit;     // candidate child of the node reached
+    };
+
+    // Scan for rune tries: walks the runes themselves, no text_str needed
+    template <bool kBoundedLen, bool kMerge>
+    void ScanRunes(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<struct DatDag> &res,
+                   size_t max_word_len) const {
+        const size_t len = end - begin;
+        RuneLane lanes[kScanLanes];
+        size_t lane_num = 0;
+
+        for (size_t i = 0;;) {
+            for (; lane_num < kScanLanes && i < len; i++) {
+                if (!kMerge) {
+                    res[i].nexts.push_back(DagNext{i + 1, DAG_NO_WORD});
+                }
+
+                RuneLane lane = {i, i, kBoundedLen ? std::min(len, i + max_word_len) : len, RuneDoubleArray::kRoot, -1};
+                const Rune rune = (begin + i)->rune;
+
+                if (rune < jumps_.size()) {
+                    const DatJump &jump = jumps_[rune];
+                    if (jump.node == 0 || lane.last == i) {
+                        continue;
+                    }
+
+                    if (IsValue(jump.value)) {
+                        res[i].nexts[0].weight = WeightAt(jump.value);
+                    }
+                    lane.node = jump.node;
+                    lane.next_pos++;
+                }
+
+                if (lane.next_pos == lane.last) {
+                    continue;
+                }
+
+                lane.next = runes_.Next(lane.node, (begin + lane.next_pos)->rune);
+                if (lane.next >= 0) {
+                    runes_.Prefetch(lane.next);
+                    lanes[lane_num++] = lane;
+                }
+            }
+
+            if (lane_num == 0) {
+                break;
+            }
+
+            for (size_t k = 0; k < lane_num;) {
+                RuneLane &lane = lanes[k];
+
+                if (!runes_.IsChild(lane.node, lane.next)) {
+                    lane = lanes[--lane_num];
                     continue;
                 }
 
-                auto const char_num = Utf8CharNum(&text_str[begin_pos], match.length);
+                lane.node = lane.next;
+                lane.next_pos++;
 
-                if (char_num > max_word_len) {
+                const int value = runes_.Value(lane.node);
+                if (IsValue(value)) {
+                    AddNext<kMerge>(res[lane.pos], lane.pos, lane.next_pos, WeightAt(value));
+                }
+
+                if (lane.next_pos == lane.last ||
+                    (lane.next = runes_.Next(lane.node, (begin + lane.next_pos)->rune)) < 0) {
+                    lane = lanes[--lane_num];
                     continue;
                 }
 
-                auto pValue = &elements_ptr_[match.value];
+                runes_.Prefetch(lane.next);
+                k++;
+            }
+        }
+    }
+
+    // Scan for LOUDS tries: one position after another, the select and label
+    // search of a transition leaving little for interleaving to hide
+    template <bool kBoundedLen, bool kMerge>
+    void ScanLouds(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<struct DatDag> &res,
+                   size_t max_word_len) const {
+        const size_t len = end - begin;
+
+        for (size_t i = 0; i < len; i++) {
+            if (!kMerge) {
+                res[i].nexts.push_back(DagNext{i + 1, DAG_NO_WORD});
+            }
+
+            const size_t last = kBoundedLen ? std::min(len, i + max_word_len) : len;
+            const Rune rune = (begin + i)->rune;
+            int32_t node = LoudsTrie::kRoot;
+            size_t pos = i;
 
-                if (1 == char_num) {
-                    res[i].nexts[0].second = pValue;
+            if (rune < jumps_.size()) {
+                const DatJump &jump = jumps_[rune];
+                if (jump.node == 0 || last == i) {
                     continue;
                 }
 
-                res[i].nexts.push_back(pair<size_t, const DatMemElem *>(i + char_num, pValue));
+                if (IsValue(jump.value)) {
+                    res[i].nexts[0].weight = WeightAt(jump.value);
+                }
+                node = jump.node;
+                pos++;
             }
 
-            begin_pos += limonp::UnicodeToUtf8Bytes((begin + i)->rune);
+            for (; pos < last && (node = louds_.Child(node, (begin + pos)->rune)) >= 0;) {
+                pos++;
+
+                const int value = louds_.Value(node);
+                if (IsValue(value)) {
+                    AddNext<kMerge>(res[i], i, pos, WeightAt(value));
+                }
+            }
         }
     }
 
-    double GetMinWeight() const { return min_weight_; }
+    template <bool kBoundedLen, bool kMerge>
+    void Scan(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<struct DatDag> &res,
+              size_t max_word_len, const string &text_str) const {
+        typedef Darts::Details::DoubleArrayUnit DatUnit;
+        const DatUnit *units = static_cast<const DatUnit *>(dat_.array());
+        const unsigned char *text = reinterpret_cast<const unsigned char *>(text_str.c_str());
+        const size_t len = end - begin;
+        ByteLane lanes[kScanLanes];
+        size_t lane_num = 0;
+
+        for (size_t i = 0, begin_pos = 0;;) {
+            for (; lane_num < kScanLanes && i < len; i++) {
+                const Rune rune = (begin + i)->rune;
+                ByteLane lane = {i, begin_pos, 1, 0};
+                size_t node = 0;
+
+                if (!kMerge) {
+                    res[i].nexts.push_back(DagNext{i + 1, DAG_NO_WORD});
+                }
 
-    void SetMinWeight(double d) { min_weight_ = d; }
+                begin_pos += limonp::UnicodeToUtf8Bytes(rune);
+
+                if (rune < jumps_.size()) {
+                    const DatJump &jump = jumps_[rune];
+                    if (IsValue(jump.value) && (!kBoundedLen || max_word_len > 0)) {
+                        res[i].nexts[0].weight = WeightAt(jump.value);
+                    }
 
-    bool InitBuildDat(vector<DatElement> &elements, const string &dat_cache_file, const string &md5) {
-        BuildDatCache(elements, dat_cache_file, md5);
-        return InitAttachDat(dat_cache_file, md5);
+                    if (jump.node == 0 || (kBoundedLen && max_word_len < 2)) {
+                        continue;
+                    }
+
+                    node = jump.node;
+                    lane.key_pos = begin_pos;
+                    lane.char_num = 2;
+                } else if (kBoundedLen && max_word_len == 0) {
+                    continue;
+                }
+
+                if (text[lane.key_pos] != 0) {
+                    lane.unit = node ^ units[node].offset() ^ text[lane.key_pos];
+                    CPPJIEBA_PREFETCH(units + lane.unit);
+                    lanes[lane_num++] = lane;
+                }
+            }
+
+            if (lane_num == 0) {
+                break;
+            }
+
+            for (size_t k = 0; k < lane_num;) {
+                ByteLane &lane = lanes[k];
+                const DatUnit unit = units[lane.unit];
+
+                if (unit.label() != text[lane.key_pos]) {
+                    lane = lanes[--lane_num];
+                    continue;
+                }
+
+                const size_t node = lane.unit ^ unit.offset();
+
+                // keys are whole characters, so leaves only follow a character's last byte
+                if (unit.has_leaf()) {
+                    const int value = units[node].value();
+                    if (IsValue(value)) {
+                        AddNext<kMerge>(res[lane.pos], lane.pos, lane.pos + lane.char_num, WeightAt(value));
+                    }
+                }
+
+                const unsigned char label = text[++lane.key_pos];
+                const bool lead = (label & 0xc0) != 0x80;
+
+                if (label == 0 || (kBoundedLen && lead && lane.char_num == max_word_len)) {
+                    lane = lanes[--lane_num];
+                    continue;
+                }
+
+                lane.char_num += lead;
+                lane.unit = node ^ label;
+                CPPJIEBA_PREFETCH(units + lane.unit);
+                k++;
+            }
+        }
+    }
+
+    // Records a match from pos to next, replacing the DAG_NO_WORD edge for a
+    // single character
+    template <bool kMerge>
+    static void AddNext(DatDag &dag, size_t pos, size_t next, double weight) {
+        if (next == pos + 1) {
+            dag.nexts[0].weight = weight;
+        } else if (kMerge) {
+            MergeNext(dag.nexts, next, weight);
+        } else {
+            dag.nexts.push_back(DagNext{next, weight});
+        }
+    }
+
+    // nexts stays ordered by end position, as Scan produces it
+    static void MergeNext(limonp::LocalVector<DagNext> &nexts, size_t next, double value) {
+        size_t pos = 1;
+
+        while (pos < nexts.size() && nexts[pos].end < next) {
+            pos++;
+        }
+
+        if (pos < nexts.size() && nexts[pos].end == next) {
+            nexts[pos].weight = value;
+            return;
+        }
+
+        nexts.push_back(DagNext{next, value});
+
+        for (size_t k = nexts.size() - 1; k > pos; k--) {
+            std::swap(nexts[k], nexts[k - 1]);
+        }
+    }
+
+   public:
+    // stamps and content_hash are stored for fast validation, see MatchStamps.
+    // With heat, hot words come first among the elements and, for the rune
+    // engine, their trie nodes first among the units; darts decides its own
+    // unit layout.
+    bool InitBuildDat(vector<DatElement> &elements, const string &dat_cache_file, const string &md5,
+                      const vector<FileStamp> &stamps = vector<FileStamp>(), uint64_t content_hash = 0,
+                      DatElementFormat format = DAT_ELEMENTS_WIDE, DatEngine engine = DAT_ENGINE_BYTES,
+                      const WordHeat *heat = NULL) {
+        DatWordTable words;
+        SortElements(elements, words);
+        return InitBuildDat(words, dat_cache_file, md5, stamps, content_hash, format, engine, heat);
+    }
+
+    // From words already in key order, e.g. merged by a DatWordSorter. With
+    // an empty dat_cache_file the cache image is kept in memory, see MapImage.
+    bool InitBuildDat(const DatWordTable &words, const string &dat_cache_file, const string &md5,
+                      const vector<FileStamp> &stamps, uint64_t content_hash, DatElementFormat format,
+                      DatEngine engine, const WordHeat *heat) {
+        Detach();
+        BuildDatCache(words, dat_cache_file, md5, stamps, content_hash, format, engine, heat);
+        return dat_cache_file.empty() ? AttachImage(md5) : InitAttachDat(dat_cache_file, md5);
+    }
+
+    bool MatchStamps(const vector<FileStamp> &stamps) const {
+        return stamps.size() == stamps_num_ && std::equal(stamps.begin(), stamps.end(), stamps_ptr_);
+    }
+
+    uint64_t GetContentHash() const { return content_hash_; }
+
+    // Rewrites the manifest of an attached cache whose contents were verified
+    // by hash, so the next start can skip hashing again. Best effort.
+    void RefreshStamps(const string &dat_cache_file, const vector<FileStamp> &stamps) const {
+        if (stamps.size() != stamps_num_ || stamps.empty()) {
+            return;
+        }
+#if defined(_WIN32) || defined(_WIN64)
+        // the file is mapped by this process and cannot be opened for writing here
+        (void)dat_cache_file;
+#else
+        const int fd = ::open(dat_cache_file.c_str(), O_WRONLY);
+        if (fd < 0) {
+            return;
+        }
+
+        const size_t len = sizeof(FileStamp) * stamps.size();
+        if (::pwrite(fd, &stamps[0], len, sizeof(CacheFileHeader)) != (ssize_t)len) {
+            XLOG(WARNING) << "failed to refresh manifest of " << dat_cache_file;
+        }
+        ::close(fd);
+#endif
+    }
+
+    void Detach() {
+#if defined(_WIN32) || defined(_WIN64)
+        if (mmap_addr_) {
+            ::UnmapViewOfFile(mmap_addr_);
+        }
+        if (mmap_fd_) {
+            ::CloseHandle(mmap_fd_);
+        }
+        if (file_fd_) {
+            ::CloseHandle(file_fd_);
+        }
+        mmap_fd_ = NULL;
+        file_fd_ = NULL;
+#else
+        if (mmap_addr_) {
+            ::munmap(mmap_addr_, mmap_length_);
+        }
+        if (mmap_fd_ >= 0) {
+            ::close(mmap_fd_);
+        }
+        mmap_fd_ = -1;
+#endif
+        mmap_addr_ = nullptr;
+        mmap_length_ = 0;
+        cache_file_.clear();
+        elements_ptr_ = nullptr;
+        compact_ptr_ = nullptr;
+        weights_ptr_ = nullptr;
+        tags_ptr_ = nullptr;
+        elements_num_ = 0;
+        stamps_ptr_ = nullptr;
+        stamps_num_ = 0;
+        single_words_ptr_ = nullptr;
+        single_words_num_ = 0;
+        content_hash_ = 0;
+        value_limit_ = 0;
+        tags_num_ = 0;
+        runes_.Clear();
+        louds_.Clear();
+        vector<DatJump>().swap(jumps_);
+        vector<DatMemElem>().swap(owned_elements_);
+        owner_.reset();
     }
 
     bool InitAttachDat(const string &dat_cache_file, const string &md5) {
+        Detach();
 #if defined(_WIN32) || defined(_WIN64)
         const static DWORD fileFlags = FILE_ATTRIBUTE_READONLY | FILE_FLAG_RANDOM_ACCESS;
         HANDLE hFile =
@@ -231,64 +1016,331 @@ class DatTrie {
         assert(seek_off >= 0);
         mmap_length_ = seek_off;
 
+        if (mmap_length_ < sizeof(CacheFileHeader)) {
+            Detach();
+            return false;
+        }
+
         mmap_addr_ = reinterpret_cast<char *>(mmap(NULL, mmap_length_, PROT_READ, MAP_SHARED, mmap_fd_, 0));
-        assert(MAP_FAILED != mmap_addr_);
+        if (MAP_FAILED == mmap_addr_) {
+            mmap_addr_ = nullptr;
+            Detach();
+            return false;
+        }
 
 #endif
-        assert(mmap_length_ >= sizeof(CacheFileHeader));
-        CacheFileHeader &header = *reinterpret_cast<CacheFileHeader *>(mmap_addr_);
+        if (!AttachImage(md5)) {
+            return false;
+        }
+
+        cache_file_ = dat_cache_file;
+        return true;
+    }
+
+    // The cache file this trie is mapped from, empty unless InitAttachDat
+    // succeeded
+    const string &GetCacheFile() const { return cache_file_; }
+
+    size_t GetCacheFileSize() const { return cache_file_.empty() ? 0 : mmap_length_; }
+
+   private:
+    // Takes the cache image mapped at mmap_addr_ apart; detaches if it is
+    // malformed or of other dictionaries than md5.
+    bool AttachImage(const string &md5) {
+        const CacheFileHeader &header = *reinterpret_cast<const CacheFileHeader *>(mmap_addr_);
+        assert(sizeof(header.md5_hex) == md5.size());
+
+        const uint64_t tables_size =
+            uint64_t(header.weights_num) * sizeof(double) + uint64_t(header.tags_num) * sizeof(DatTag);
+        uint64_t elements_size = uint64_t(header.elements_num) * sizeof(DatMemElem);
+        const uint64_t single_words_size = SingleWordsSize(header.single_words_num);
+
+        if (header.element_format == DAT_ELEMENTS_COMPACT) {
+            elements_size = uint64_t(header.elements_num) * sizeof(DatCompactElem) + tables_size;
+        } else if (header.element_format == DAT_ELEMENTS_INLINE) {
+            elements_size = tables_size;
+        }
+
+        // older layouts or truncated files are rejected and rebuilt
+        if (mmap_length_ < sizeof(header) || header.magic != CACHE_FILE_MAGIC ||
+            header.element_format > DAT_ELEMENTS_INLINE || header.engine > DAT_ENGINE_LOUDS ||
+            (header.element_format == DAT_ELEMENTS_INLINE && header.weights_num != kWeightIdMask + 1) ||
+            0 != memcmp(&header.md5_hex[0], md5.c_str(), md5.size()) ||
+            mmap_length_ != sizeof(header) + header.stamps_num * sizeof(FileStamp) + single_words_size +
+                                elements_size + header.dat_size * (header.engine == DAT_ENGINE_BYTES ? dat_.unit_size() : 1)) {
+            Detach();
+            return false;
+        }
+
         elements_num_ = header.elements_num;
         min_weight_ = header.min_weight;
-        assert(sizeof(header.md5_hex) == md5.size());
+        freq_sum_ = header.freq_sum;
+        user_word_default_weight_ = header.user_word_default_weight;
+        stamps_num_ = header.stamps_num;
+        content_hash_ = header.content_hash;
+        stamps_ptr_ = (const FileStamp *)(mmap_addr_ + sizeof(header));
+        single_words_num_ = header.single_words_num;
+        single_words_ptr_ = (const Rune *)(stamps_ptr_ + stamps_num_);
+        const char *elements_ptr = (const char *)single_words_ptr_ + single_words_size;
+
+        value_limit_ = elements_num_;
+        tags_num_ = header.tags_num;
+
+        if (header.element_format == DAT_ELEMENTS_COMPACT) {
+            compact_ptr_ = (const DatCompactElem *)elements_ptr;
+            weights_ptr_ = (const double *)(compact_ptr_ + elements_num_);
+            tags_ptr_ = (const DatTag *)(weights_ptr_ + header.weights_num);
+        } else if (header.element_format == DAT_ELEMENTS_INLINE) {
+            weights_ptr_ = (const double *)elements_ptr;
+            tags_ptr_ = (const DatTag *)(weights_ptr_ + header.weights_num);
+            value_limit_ = kInlineValueLimit;
+        } else {
+            elements_ptr_ = (const DatMemElem *)elements_ptr;
+        }
 
-        if (0 != memcmp(&header.md5_hex[0], md5.c_str(), md5.size())) {
+        const size_t units_size = mmap_length_ - (elements_ptr + elements_size - mmap_addr_);
+        if (!AttachUnits(elements_ptr + elements_size, units_size, DatEngine(header.engine))) {
+            Detach();
             return false;
         }
 
-        assert(mmap_length_ ==
-               sizeof(header) + header.elements_num * sizeof(DatMemElem) + header.dat_size * dat_.unit_size());
-        elements_ptr_ = (const DatMemElem *)(mmap_addr_ + sizeof(header));
-        const char *dat_ptr = mmap_addr_ + sizeof(header) + sizeof(DatMemElem) * elements_num_;
-        dat_.set_array(dat_ptr, header.dat_size);
         return true;
     }
 
-   private:
-    void BuildDatCache(vector<DatElement> &elements, const string &dat_cache_file, const string &md5) {
+    // Builds dat_ over words, each word's value being its index into
+    // mem_elem_vec.
+    void BuildDat(const DatWordTable &words, vector<DatMemElem> &mem_elem_vec,
+                  DatEngine engine = DAT_ENGINE_BYTES, const WordHeat *heat = NULL) {
+        mem_elem_vec.clear();
+        mem_elem_vec.reserve(words.Size());
+
+        vector<int> values_vec(words.Size());
+        for (size_t i = 0; i < words.Size(); ++i) {
+            mem_elem_vec.push_back(words.Element(i));
+            values_vec[i] = i;
+        }
+
+        vector<uint64_t> heats;
+        if (heat) {
+            HeatsOf(words, *heat, heats);
+
+            // stable, so cold words stay in key order behind the hot ones
+            vector<size_t> order(words.Size());
+            for (size_t i = 0; i < order.size(); ++i) {
+                order[i] = i;
+            }
+            std::stable_sort(order.begin(), order.end(),
+                             [&heats](size_t a, size_t b) { return heats[a] > heats[b]; });
+
+            vector<DatMemElem> hot_first(mem_elem_vec.size());
+            for (size_t i = 0; i < order.size(); ++i) {
+                hot_first[i] = mem_elem_vec[order[i]];
+                values_vec[order[i]] = i;
+            }
+            mem_elem_vec.swap(hot_first);
+        }
+
+        BuildUnits(words, values_vec, engine, heats);
+    }
+
+    static void HeatsOf(const DatWordTable &words, const WordHeat &heat, vector<uint64_t> &heats) {
+        heats.assign(words.Size(), 0);
+        for (size_t i = 0; i < words.Size(); ++i) {
+            const auto it = heat.find(words.Key(i));
+            if (it != heat.end()) {
+                heats[i] = it->second;
+            }
+        }
+    }
+
+    // Of duplicate words the one with the highest weight wins
+    static void SortElements(vector<DatElement> &elements, DatWordTable &words) {
         std::sort(elements.begin(), elements.end());
 
+        for (size_t i = 0; i < elements.size(); ++i) {
+            const DatElement &elem = elements[i];
+            words.Append(elem.word.data(), elem.word.size(), elem.weight, elem.tag.data(), elem.tag.size());
+        }
+    }
+
+    // Into runes_ or louds_ for DAT_ENGINE_RUNES and DAT_ENGINE_LOUDS, falling
+    // back to dat_ if the words do not fit a rune alphabet. heats, one per
+    // element or empty, guide the rune engine's layout.
+    void BuildUnits(const DatWordTable &words, vector<int> &values_vec, DatEngine engine,
+                    const vector<uint64_t> &heats = vector<uint64_t>()) {
         vector<const char *> keys_ptr_vec;
-        vector<int> values_vec;
-        vector<DatMemElem> mem_elem_vec;
+        keys_ptr_vec.reserve(words.Size());
 
-        keys_ptr_vec.reserve(elements.size());
-        values_vec.reserve(elements.size());
-        mem_elem_vec.reserve(elements.size());
+        for (size_t i = 0; i < words.Size(); ++i) {
+            keys_ptr_vec.push_back(words.Key(i));
+        }
 
-        CacheFileHeader header;
-        header.min_weight = min_weight_;
-        assert(sizeof(header.md5_hex) == md5.size());
-        memcpy(&header.md5_hex[0], md5.c_str(), md5.size());
+        runes_.Clear();
+        louds_.Clear();
+        if (engine == DAT_ENGINE_LOUDS) {
+            if (louds_.Build(keys_ptr_vec.size(), &keys_ptr_vec[0], &values_vec[0])) {
+                XLOG(DEBUG) << "LOUDS trie build successful. Image size: " << louds_.ImageSize();
+                return;
+            }
 
-        for (size_t i = 0; i < elements.size(); ++i) {
-            keys_ptr_vec.push_back(elements[i].word.data());
-            values_vec.push_back(i);
-            mem_elem_vec.push_back(DatMemElem());
-            auto &mem_elem = mem_elem_vec.back();
-            mem_elem.weight = elements[i].weight;
-            mem_elem.SetTag(elements[i].tag);
+            XLOG(WARNING) << "Dictionary does not fit a LOUDS trie, using the byte DAT";
+        } else if (engine == DAT_ENGINE_RUNES) {
+            if (runes_.Build(keys_ptr_vec.size(), &keys_ptr_vec[0], &values_vec[0],
+                             heats.empty() ? NULL : heats.data())) {
+                XLOG(DEBUG) << "Rune DAT build successful. Image size: " << runes_.ImageSize();
+                return;
+            }
+
+            XLOG(WARNING) << "Dictionary does not fit a rune double array, using the byte DAT";
         }
 
-        XLOG(DEBUG) << "Building DAT for " << elements.size() << " elements."; // 添加日志
+        XLOG(DEBUG) << "Building DAT for " << words.Size() << " elements."; // 添加日志
         auto const ret = dat_.build(keys_ptr_vec.size(), &keys_ptr_vec[0], NULL, &values_vec[0]);
         if (0 != ret) {
             XLOG(ERROR) << "Darts::DoubleArray::build failed with error code: " << ret;
             throw std::runtime_error("Failed to build Double-Array Trie."); // 抛出异常
         }
         XLOG(DEBUG) << "DAT build successful. DAT size: " << dat_.size();
+    }
+
+    // Splits wide elements into the compact form and the tables of distinct
+    // weights and tags. False if the tags do not fit a 16-bit id.
+    static bool CompactElements(const vector<DatMemElem> &mem_elem_vec, vector<DatCompactElem> &compact,
+                                vector<double> &weights, vector<DatTag> &tags) {
+        weights.clear();
+        std::map<string, uint16_t> tag_ids;
+
+        for (size_t i = 0; i < mem_elem_vec.size(); ++i) {
+            weights.push_back(mem_elem_vec[i].weight);
+            tag_ids[mem_elem_vec[i].GetTag()] = 0;
+        }
+
+        if (tag_ids.size() > 0xffff) {
+            return false;
+        }
+
+        std::sort(weights.begin(), weights.end());
+        weights.erase(std::unique(weights.begin(), weights.end()), weights.end());
+
+        tags.assign(tag_ids.size(), DatTag());
+        uint16_t tag_id = 0;
+        for (auto &kv : tag_ids) {
+            kv.second = tag_id;
+            memcpy(tags[tag_id].tag, kv.first.c_str(), kv.first.size());
+            tag_id++;
+        }
+
+        compact.assign(mem_elem_vec.size(), DatCompactElem());
+        for (size_t i = 0; i < mem_elem_vec.size(); ++i) {
+            compact[i].weight_id =
+                std::lower_bound(weights.begin(), weights.end(), mem_elem_vec[i].weight) - weights.begin();
+            compact[i].tag_id = tag_ids[mem_elem_vec[i].GetTag()];
+        }
+
+        return true;
+    }
+
+    // DAT values of the inline format, straight from the word table. False if
+    // the weights or tags do not fit their ids.
+    static bool InlineValues(const DatWordTable &words, vector<int> &values_vec, vector<double> &weights) {
+        if (words.Tags().size() > kMaxInlineTags + 1) {
+            return false;
+        }
+
+        weights.clear();
+        weights.reserve(words.Size());
+        for (size_t i = 0; i < words.Size(); ++i) {
+            weights.push_back(words.Weight(i));
+        }
+        std::sort(weights.begin(), weights.end());
+        weights.erase(std::unique(weights.begin(), weights.end()), weights.end());
+        if (weights.size() > kWeightIdMask + 1) {
+            return false;
+        }
+
+        values_vec.resize(words.Size());
+        for (size_t i = 0; i < words.Size(); ++i) {
+            const size_t weight_id =
+                std::lower_bound(weights.begin(), weights.end(), words.Weight(i)) - weights.begin();
+            values_vec[i] = int(words.TagId(i) << 16 | weight_id);
+        }
+        return true;
+    }
+
+    template <class T>
+    static void AppendBytes(string &out, const vector<T> &items) {
+        out.append(reinterpret_cast<const char *>(items.data()), sizeof(T) * items.size());
+    }
+
+    static uint64_t SingleWordsSize(uint64_t single_words_num) {
+        return (single_words_num * sizeof(Rune) + 15) / 16 * 16;
+    }
+
+    void BuildDatCache(const DatWordTable &words, const string &dat_cache_file, const string &md5,
+                       const vector<FileStamp> &stamps, uint64_t content_hash, DatElementFormat format,
+                       DatEngine engine, const WordHeat *heat) {
+        vector<DatMemElem> mem_elem_vec;
+        CacheFileHeader header;
+        // written right after the stamps, so the single words lead
+        string elements_data;
+        AppendBytes(elements_data, single_words_);
+        elements_data.resize(SingleWordsSize(single_words_.size()), '\0');
+        header.single_words_num = single_words_.size();
+        vector<DatCompactElem> compact;
+        vector<double> weights;
+        vector<DatTag> tags;
+
+        if (format == DAT_ELEMENTS_INLINE) {
+            vector<int> values_vec;
+            if (InlineValues(words, values_vec, weights)) {
+                vector<uint64_t> heats;
+                if (heat) {
+                    HeatsOf(words, *heat, heats);
+                }
+
+                BuildUnits(words, values_vec, engine, heats);
+                weights.resize(kWeightIdMask + 1, 0.0); // ids need no bounds check then
+                header.element_format = DAT_ELEMENTS_INLINE;
+                header.weights_num = weights.size();
+                header.tags_num = words.Tags().size();
+                AppendBytes(elements_data, weights);
+                AppendBytes(elements_data, words.Tags());
+            } else {
+                XLOG(WARNING) << "Too many distinct weights or tags for inline DAT values, using compact elements";
+                format = DAT_ELEMENTS_COMPACT;
+            }
+        }
+
+        if (format != DAT_ELEMENTS_INLINE) {
+            BuildDat(words, mem_elem_vec, engine, heat);
+
+            if (format == DAT_ELEMENTS_COMPACT && CompactElements(mem_elem_vec, compact, weights, tags)) {
+                header.element_format = DAT_ELEMENTS_COMPACT;
+                header.weights_num = weights.size();
+                header.tags_num = tags.size();
+                AppendBytes(elements_data, compact);
+                AppendBytes(elements_data, weights);
+                AppendBytes(elements_data, tags);
+            } else {
+                AppendBytes(elements_data, mem_elem_vec);
+            }
+        }
 
-        header.elements_num = mem_elem_vec.size();
-        header.dat_size = dat_.size();
+        header.min_weight = min_weight_;
+        header.freq_sum = freq_sum_;
+        header.user_word_default_weight = user_word_default_weight_;
+        assert(sizeof(header.md5_hex) == md5.size());
+        memcpy(&header.md5_hex[0], md5.c_str(), md5.size());
+        header.stamps_num = stamps.size();
+        header.content_hash = content_hash;
+        header.elements_num = words.Size();
+        header.engine = GetEngine();
+        header.dat_size = header.engine == DAT_ENGINE_BYTES ? dat_.size() : UnitsSize();
+
+        if (dat_cache_file.empty()) {
+            MapImage(header, stamps, elements_data);
+            return;
+        }
 
 #if defined(_WIN32) || defined(_WIN64)
         {
@@ -324,11 +1376,12 @@ class DatTrie {
                 };
 
                 append_write((const char *)&header, sizeof(header));
-                append_write((const char *)&mem_elem_vec[0], sizeof(mem_elem_vec[0]) * mem_elem_vec.size());
-                append_write((const char *)dat_.array(), dat_.total_size());
+                append_write((const char *)stamps.data(), sizeof(FileStamp) * stamps.size());
+                append_write(elements_data.data(), elements_data.size());
+                append_write(UnitsData(), UnitsSize());
 
-                assert(total_bytes ==
-                       (DWORD)(sizeof(header) + mem_elem_vec.size() * sizeof(mem_elem_vec[0]) + dat_.total_size()));
+                assert(total_bytes == (DWORD)(sizeof(header) + stamps.size() * sizeof(FileStamp) +
+                                              elements_data.size() + UnitsSize()));
             }
 
             XLOG(DEBUG) << "Attempting to move temporary file [" << tmp_file << "] to target [" << dat_cache_file << "]";
@@ -362,11 +1415,12 @@ class DatTrie {
             ::fchmod(fd, 0644);
 
             ssize_t write_bytes = ::write(fd, (const char *)&header, sizeof(header));
-            write_bytes += ::write(fd, (const char *)&mem_elem_vec[0], sizeof(mem_elem_vec[0]) * mem_elem_vec.size());
-            write_bytes += ::write(fd, dat_.array(), dat_.total_size());
+            write_bytes += ::write(fd, (const char *)stamps.data(), sizeof(FileStamp) * stamps.size());
+            write_bytes += ::write(fd, elements_data.data(), elements_data.size());
+            write_bytes += ::write(fd, UnitsData(), UnitsSize());
 
-            assert(write_bytes ==
-                   (ssize_t)(sizeof(header) + mem_elem_vec.size() * sizeof(mem_elem_vec[0]) + dat_.total_size()));
+            assert(write_bytes == (ssize_t)(sizeof(header) + stamps.size() * sizeof(FileStamp) +
+                                            elements_data.size() + UnitsSize()));
             ::close(fd);
 
             XLOG(DEBUG) << "Attempting to rename temporary file [" << tmp_filepath << "] to target [" << dat_cache_file << "]";
@@ -382,30 +1436,113 @@ class DatTrie {
     XLOG(DEBUG) << "DAT cache file successfully written to: " << dat_cache_file;
     }
 
+    // A cache without a file, for hosts with no writable cache directory:
+    // the image is copied into a memfd on Linux, else an anonymous mapping,
+    // made read-only and mapped in place of the build state. Processes
+    // forked afterwards share its pages.
+    void MapImage(const CacheFileHeader &header, const vector<FileStamp> &stamps, const string &elements_data) {
+        const size_t stamps_size = sizeof(FileStamp) * stamps.size();
+        const size_t size = sizeof(header) + stamps_size + elements_data.size() + UnitsSize();
+#if defined(_WIN32) || defined(_WIN64)
+        HANDLE hMap = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, DWORD(uint64_t(size) >> 32),
+                                        DWORD(size & 0xffffffff), NULL);
+        char *image = hMap ? static_cast<char *>(MapViewOfFile(hMap, FILE_MAP_WRITE, 0, 0, size)) : NULL;
+        if (!image) {
+            if (hMap) {
+                ::CloseHandle(hMap);
+            }
+            XLOG(ERROR) << "Failed to map in-memory DAT cache. Error code: " << GetLastError();
+            throw std::runtime_error("Failed to map in-memory DAT cache.");
+        }
+#else
+        int fd = -1;
+#    if defined(__linux__) && defined(SYS_memfd_create)
+        fd = static_cast<int>(::syscall(SYS_memfd_create, "jieba_dat", 1U /* MFD_CLOEXEC */));
+        if (fd >= 0 && ::ftruncate(fd, size) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+#    endif
+        void *addr = ::mmap(NULL, size, PROT_READ | PROT_WRITE, fd >= 0 ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS,
+                            fd, 0);
+        if (MAP_FAILED == addr) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            XLOG(ERROR) << "Failed to map in-memory DAT cache. errno: " << errno;
+            throw std::runtime_error("Failed to map in-memory DAT cache.");
+        }
+        char *image = static_cast<char *>(addr);
+#endif
+        char *p = image;
+        memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+        if (stamps_size) {
+            memcpy(p, stamps.data(), stamps_size);
+        }
+        p += stamps_size;
+        memcpy(p, elements_data.data(), elements_data.size());
+        p += elements_data.size();
+        memcpy(p, UnitsData(), UnitsSize());
+
+        Detach();
+#if defined(_WIN32) || defined(_WIN64)
+        DWORD old_protect = 0;
+        ::VirtualProtect(image, size, PAGE_READONLY, &old_protect);
+        mmap_fd_ = hMap;
+#else
+        ::mprotect(image, size, PROT_READ);
+        mmap_fd_ = fd;
+#endif
+        mmap_addr_ = image;
+        mmap_length_ = size;
+        XLOG(DEBUG) << "DAT cache of " << size << " bytes kept in memory";
+    }
+
     DatTrie(const DatTrie &);
     DatTrie &operator=(const DatTrie &);
 
    private:
     JiebaDAT dat_;
+    RuneDoubleArray runes_; // used instead of dat_ unless empty
+    LoudsTrie louds_;       // likewise
+    vector<DatJump> jumps_; // by rune, empty unless BuildJumpTable was called
     const DatMemElem *elements_ptr_ = nullptr;
     size_t elements_num_ = 0;
     double min_weight_ = 0;
+    const FileStamp *stamps_ptr_ = nullptr;
+    size_t stamps_num_ = 0;
+    vector<Rune> single_words_;               // for caches built, see SetSingleWords
+    const Rune *single_words_ptr_ = nullptr;  // of the attached cache
+    size_t single_words_num_ = 0;
+    uint64_t content_hash_ = 0;
+    double freq_sum_ = 0;
+    double user_word_default_weight_ = 0;
+    const DatCompactElem *compact_ptr_ = nullptr; // compact caches, elements_ptr_ is null then
+    const double *weights_ptr_ = nullptr;
+    const DatTag *tags_ptr_ = nullptr;
+    size_t tags_num_ = 0;
+    size_t value_limit_ = 0; // DAT values at or above it are no words
+    vector<DatMemElem> owned_elements_; // InitInMemory only
+    std::shared_ptr<const void> owner_; // InitFromMemory only
 
 #if defined(_WIN32) || defined(_WIN64)
-    HANDLE mmap_fd_;
-    HANDLE file_fd_;
+    HANDLE mmap_fd_ = NULL;
+    HANDLE file_fd_ = NULL;
 #else
     int mmap_fd_ = -1;
 #endif
     size_t mmap_length_ = 0;
     char *mmap_addr_ = nullptr;
+    string cache_file_;
 };
 
-inline string CalcFileListMD5(const string &files_list, size_t &file_size_sum) {
-    limonp::MD5 md5;
-
+// Maps each file of a "|;"-separated list in turn and calls fn(data, len)
+// on its contents. Returns the total size of the files read.
+template <class Fn>
+inline size_t ForEachFileInList(const string &files_list, Fn fn) {
     const auto files = limonp::Split(files_list, "|;");
-    file_size_sum = 0;
+    size_t file_size_sum = 0;
 
     for (auto const &local_path : files) {
 #if defined(_WIN32) || defined(_WIN64)
@@ -436,7 +1573,7 @@ inline string CalcFileListMD5(const string &files_list, size_t &file_size_sum) {
             continue;
         }
 
-        md5.Update((unsigned char *)addr, len);
+        fn((const unsigned char *)addr, (size_t)len);
         file_size_sum += len;
 
         BOOL ret = ::UnmapViewOfFile(addr);
@@ -452,7 +1589,7 @@ inline string CalcFileListMD5(const string &files_list, size_t &file_size_sum) {
             void *addr = ::mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
             assert(MAP_FAILED != addr);
 
-            md5.Update((unsigned char *)addr, len);
+            fn((const unsigned char *)addr, (size_t)len);
             file_size_sum += len;
 
             ::munmap(addr, len);
@@ -461,8 +1598,72 @@ inline string CalcFileListMD5(const string &files_list, size_t &file_size_sum) {
 #endif
     }
 
+    return file_size_sum;
+}
+
+inline string CalcFileListMD5(const string &files_list, size_t &file_size_sum) {
+    limonp::MD5 md5;
+
+    file_size_sum = ForEachFileInList(files_list, [&md5](const unsigned char *data, size_t len) {
+        md5.Update(const_cast<unsigned char *>(data), len);
+    });
+
     md5.Final();
     return string(md5.digestChars);
 }
 
+// Content fingerprint used by fast validation when the stamps differ.
+inline uint64_t CalcFileListFastHash(const string &files_list) {
+    FastHash64 hasher;
+
+    ForEachFileInList(files_list, [&hasher](const unsigned char *data, size_t len) {
+        const uint64_t size = len;
+        hasher.Update(&size, sizeof(size));
+        hasher.Update(data, len);
+    });
+
+    return hasher.Digest();
+}
+
+// Stats every file of the list without reading it. Returns false if one
+// cannot be stat'ed.
+inline bool CalcFileListStamps(const string &files_list, vector<FileStamp> &stamps, size_t &file_size_sum) {
+    const auto files = limonp::Split(files_list, "|;");
+    stamps.clear();
+    file_size_sum = 0;
+
+    for (auto const &local_path : files) {
+        FileStamp stamp;
+        stamp.path_hash = FastHash64::Hash(local_path);
+#if defined(_WIN32) || defined(_WIN64)
+        WIN32_FILE_ATTRIBUTE_DATA attrs;
+        if (!GetFileAttributesEx(local_path.c_str(), GetFileExInfoStandard, &attrs)) {
+            return false;
+        }
+
+        stamp.size = (uint64_t(attrs.nFileSizeHigh) << 32) | attrs.nFileSizeLow;
+        // FILETIME ticks are 100ns; NTFS exposes no stable inode without opening the file
+        stamp.mtime_ns =
+            int64_t((uint64_t(attrs.ftLastWriteTime.dwHighDateTime) << 32) | attrs.ftLastWriteTime.dwLowDateTime) * 100;
+#else
+        struct stat st;
+        if (::stat(local_path.c_str(), &st) != 0) {
+            return false;
+        }
+
+        stamp.size = st.st_size;
+        stamp.inode = st.st_ino;
+#    if defined(__APPLE__)
+        stamp.mtime_ns = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#    else
+        stamp.mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#    endif
+#endif
+        file_size_sum += stamp.size;
+        stamps.push_back(stamp);
+    }
+
+    return true;
+}
+
 }  // namespace cppjieba
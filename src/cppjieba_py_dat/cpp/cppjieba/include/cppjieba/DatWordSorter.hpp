@@ -0,0 +1,354 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "limonp/Logging.hpp"
+
+namespace cppjieba {
+
+using std::string;
+using std::vector;
+
+// A record of a DatWordSorter batch: the word at offset in the batch's
+// text, the tag tag_skip bytes after its end. Tags are cut to 0xffff bytes,
+// caches keep at most 7 of them anyway.
+struct DatWordRecord {
+    size_t offset;
+    double weight;
+    uint32_t word_len;
+    uint16_t tag_skip;
+    uint16_t tag_len;
+};
+
+// External merge sort of the (word, weight, tag) records of a dictionary,
+// into the order DatTrie builds from: words ascending by bytes, equal words
+// by weight descending, then in the order they were added. Records are
+// kept in batches of up to a byte budget; full batches are sorted and
+// spilled to run files next to the cache, removed again on destruction.
+//
+// Run record: uint32_t word_len | uint32_t tag_len | double weight | word | tag
+class DatWordSorter {
+   public:
+    static const size_t kDefaultMemoryBudget = 64 << 20;
+
+    explicit DatWordSorter(const string &run_prefix, size_t memory_budget = kDefaultMemoryBudget)
+        : run_prefix_(run_prefix), memory_budget_(memory_budget), size_(0), runs_num_(0), memory_(0) {}
+
+    ~DatWordSorter() {
+        for (size_t i = 0; i < batches_.size(); ++i) {
+            if (!batches_[i]->run.empty()) {
+                remove(batches_[i]->run.c_str());
+            }
+        }
+    }
+
+    DatWordSorter(const DatWordSorter &) = delete;
+    DatWordSorter &operator=(const DatWordSorter &) = delete;
+
+    void Add(const string &word, double weight, const string &tag) {
+        if (!open_batch_) {
+            open_batch_.reset(new Batch());
+        }
+
+        Batch &batch = *open_batch_;
+        DatWordRecord rec;
+        rec.offset = batch.arena.size();
+        rec.weight = weight;
+        rec.word_len = uint32_t(word.size());
+        rec.tag_skip = 0;
+        rec.tag_len = uint16_t(std::min<size_t>(tag.size(), 0xffff));
+        batch.arena.append(word);
+        batch.arena.append(tag, 0, rec.tag_len);
+        batch.records.push_back(rec);
+        ++size_;
+
+        if (batch.arena.size() + batch.records.size() * sizeof(DatWordRecord) >= memory_budget_) {
+            SealOpenBatch();
+        }
+    }
+
+    // Adds the records of text, which must outlive Merge, split into chunks
+    // at bounds. parse(chunk, begin, end, records) fills records with
+    // offsets relative to text; chunks are parsed and sorted on up to
+    // thread_num threads.
+    template <class P>
+    void AddChunks(const char *text, const vector<size_t> &bounds, size_t thread_num, P parse) {
+        SealOpenBatch();
+
+        const size_t chunk_num = bounds.size() - 1;
+        const size_t first = batches_.size();
+        for (size_t c = 0; c < chunk_num; ++c) {
+            batches_.emplace_back(new Batch());
+            batches_.back()->text = text;
+        }
+
+        std::atomic<size_t> next_chunk(0);
+        vector<std::exception_ptr> errors(chunk_num);
+        auto work = [&]() {
+            for (size_t c = next_chunk++; c < chunk_num; c = next_chunk++) {
+                try {
+                    Batch &batch = *batches_[first + c];
+                    parse(c, text + bounds[c], text + bounds[c + 1], batch.records);
+                    SortBatch(batch);
+
+                    const size_t bytes = batch.records.size() * sizeof(DatWordRecord);
+                    if (memory_.fetch_add(bytes) + bytes > memory_budget_) {
+                        Spill(batch, first + c);
+                        memory_ -= bytes;
+                    }
+                } catch (...) {
+                    errors[c] = std::current_exception();
+                }
+            }
+        };
+
+        thread_num = std::max<size_t>(1, std::min(thread_num, chunk_num));
+        vector<std::thread> workers;
+        workers.reserve(thread_num - 1);
+        for (size_t t = 1; t < thread_num; ++t) {
+            workers.emplace_back(work);
+        }
+        work();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+
+        for (size_t c = 0; c < chunk_num; ++c) {
+            if (errors[c]) {
+                std::rethrow_exception(errors[c]);
+            }
+            size_ += batches_[first + c]->size;
+        }
+    }
+
+    // Offsets in [0, size) that split text after a newline into about
+    // chunk_num chunks
+    static vector<size_t> SplitLines(const char *text, size_t size, size_t chunk_num) {
+        vector<size_t> bounds(1, 0);
+        const size_t chunk_bytes = std::max<size_t>(1, size / std::max<size_t>(1, chunk_num));
+        while (bounds.back() + chunk_bytes < size) {
+            const char *nl = static_cast<const char *>(
+                memchr(text + bounds.back() + chunk_bytes, '\n', size - bounds.back() - chunk_bytes));
+            if (!nl || size_t(nl - text) + 1 == size) {
+                break;
+            }
+            bounds.push_back(nl - text + 1);
+        }
+        bounds.push_back(size);
+        return bounds;
+    }
+
+    size_t Size() const { return size_; }
+
+    size_t RunsNum() const { return runs_num_; }
+
+    // Calls f(word, word_len, weight, tag, tag_len) for every record in order
+    template <class F>
+    void Merge(F f) {
+        SealOpenBatch();
+
+        vector<Source> sources(batches_.size());
+        for (size_t i = 0; i < batches_.size(); ++i) {
+            const Batch &batch = *batches_[i];
+            if (batch.run.empty()) {
+                sources[i].batch = &batch;
+                continue;
+            }
+
+            sources[i].ifs.open(batch.run.c_str(), std::ios::binary);
+            if (!sources[i].ifs.is_open()) {
+                XLOG(ERROR) << "Failed to open dictionary sort run: " << batch.run;
+                throw std::runtime_error("Failed to open dictionary sort run.");
+            }
+        }
+
+        SourceGreater greater(sources);
+        std::priority_queue<size_t, vector<size_t>, SourceGreater> heap(greater);
+        for (size_t i = 0; i < sources.size(); ++i) {
+            if (Next(sources[i])) {
+                heap.push(i);
+            }
+        }
+
+        while (!heap.empty()) {
+            const size_t i = heap.top();
+            heap.pop();
+            const Source &src = sources[i];
+            f(src.word, src.word_len, src.weight, src.tag, src.tag_len);
+            if (Next(sources[i])) {
+                heap.push(i);
+            }
+        }
+    }
+
+   private:
+    // Records over arena, or over external text from AddChunks; only run
+    // once spilled
+    struct Batch {
+        const char *text = NULL;
+        string arena;
+        vector<DatWordRecord> records;
+        size_t size = 0;
+        string run;
+
+        const char *Text() const { return text ? text : arena.data(); }
+    };
+
+    // A batch with its current record
+    struct Source {
+        std::ifstream ifs;
+        const Batch *batch = NULL;
+        size_t next = 0;
+        string word_buf;
+        string tag_buf;
+        const char *word = NULL;
+        size_t word_len = 0;
+        const char *tag = NULL;
+        size_t tag_len = 0;
+        double weight = 0;
+    };
+
+    static int CompareWords(const char *a, size_t a_len, const char *b, size_t b_len) {
+        const int c = memcmp(a, b, std::min(a_len, b_len));
+        if (c != 0) {
+            return c;
+        }
+        return a_len < b_len ? -1 : (a_len > b_len ? 1 : 0);
+    }
+
+    // Heap order; ties go to the earlier batch, so equal records keep the
+    // order they were added in
+    struct SourceGreater {
+        explicit SourceGreater(const vector<Source> &s) : sources(&s) {}
+
+        bool operator()(size_t a, size_t b) const {
+            const Source &x = (*sources)[a];
+            const Source &y = (*sources)[b];
+            const int c = CompareWords(x.word, x.word_len, y.word, y.word_len);
+            if (c != 0) {
+                return c > 0;
+            }
+            if (x.weight != y.weight) {
+                return x.weight < y.weight;
+            }
+            return a > b;
+        }
+
+        const vector<Source> *sources;
+    };
+
+    static bool Next(Source &src) {
+        if (src.batch) {
+            if (src.next == src.batch->records.size()) {
+                return false;
+            }
+            const DatWordRecord &rec = src.batch->records[src.next++];
+            src.word = src.batch->Text() + rec.offset;
+            src.word_len = rec.word_len;
+            src.tag = src.word + rec.word_len + rec.tag_skip;
+            src.tag_len = rec.tag_len;
+            src.weight = rec.weight;
+            return true;
+        }
+
+        uint32_t lens[2];
+        if (!src.ifs.read(reinterpret_cast<char *>(lens), sizeof(lens))) {
+            return false;
+        }
+        src.word_buf.resize(lens[0]);
+        src.tag_buf.resize(lens[1]);
+        src.ifs.read(reinterpret_cast<char *>(&src.weight), sizeof(src.weight));
+        src.ifs.read(&src.word_buf[0], lens[0]);
+        src.ifs.read(&src.tag_buf[0], lens[1]);
+        if (!src.ifs) {
+            throw std::runtime_error("Truncated dictionary sort run.");
+        }
+        src.word = src.word_buf.data();
+        src.word_len = lens[0];
+        src.tag = src.tag_buf.data();
+        src.tag_len = lens[1];
+        return true;
+    }
+
+    static void SortBatch(Batch &batch) {
+        const char *text = batch.Text();
+        std::stable_sort(batch.records.begin(), batch.records.end(),
+                         [text](const DatWordRecord &a, const DatWordRecord &b) {
+                             const int c =
+                                 CompareWords(text + a.offset, a.word_len, text + b.offset, b.word_len);
+                             if (c != 0) {
+                                 return c < 0;
+                             }
+                             return a.weight > b.weight;
+                         });
+        batch.size = batch.records.size();
+    }
+
+    // Sorts the batch Add is filling and spills it if over the budget
+    void SealOpenBatch() {
+        if (!open_batch_) {
+            return;
+        }
+
+        Batch &batch = *open_batch_;
+        SortBatch(batch);
+        const size_t bytes = batch.arena.size() + batch.records.size() * sizeof(DatWordRecord);
+        if (bytes >= memory_budget_) {
+            Spill(batch, batches_.size());
+        } else {
+            memory_ += bytes;
+        }
+        batches_.push_back(std::move(open_batch_));
+    }
+
+    void Spill(Batch &batch, size_t index) {
+        const string path = run_prefix_ + ".run" + std::to_string(index);
+        std::ofstream ofs(path.c_str(), std::ios::binary | std::ios::trunc);
+        if (!ofs.is_open()) {
+            XLOG(ERROR) << "Failed to create dictionary sort run: " << path;
+            throw std::runtime_error("Failed to create dictionary sort run.");
+        }
+        batch.run = path;
+
+        const char *text = batch.Text();
+        for (size_t i = 0; i < batch.records.size(); ++i) {
+            const DatWordRecord &rec = batch.records[i];
+            const uint32_t lens[2] = {rec.word_len, rec.tag_len};
+            ofs.write(reinterpret_cast<const char *>(lens), sizeof(lens));
+            ofs.write(reinterpret_cast<const char *>(&rec.weight), sizeof(rec.weight));
+            ofs.write(text + rec.offset, rec.word_len);
+            ofs.write(text + rec.offset + rec.word_len + rec.tag_skip, rec.tag_len);
+        }
+        if (!ofs.flush()) {
+            XLOG(ERROR) << "Failed to write dictionary sort run: " << path;
+            throw std::runtime_error("Failed to write dictionary sort run.");
+        }
+
+        XLOG(DEBUG) << "Spilled " << batch.records.size() << " dictionary records to " << path;
+        string().swap(batch.arena);
+        vector<DatWordRecord>().swap(batch.records);
+        ++runs_num_;
+    }
+
+    string run_prefix_;
+    size_t memory_budget_;
+    size_t size_;
+    std::atomic<size_t> runs_num_;
+    std::atomic<size_t> memory_; // records and arenas of the unspilled batches
+    std::unique_ptr<Batch> open_batch_;
+    vector<std::unique_ptr<Batch> > batches_;
+};
+
+} // namespace cppjieba
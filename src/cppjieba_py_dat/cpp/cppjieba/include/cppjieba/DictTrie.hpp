@@ -2,7 +2,15 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cmath>
 #include <fstream> // for std::ifstream check_user_file
+#include <sstream>
 #include <stdexcept> // for std::runtime_error, std::invalid_argument
 #include "limonp/Logging.hpp"
 #include "limonp/StringUtil.hpp" // for Split
@@ -31,6 +39,11 @@
 #include "limonp/Logging.hpp"
 #include "Unicode.hpp"
 #include "DatTrie.hpp"
+#include "CacheBuildLock.hpp"
+#include "DatWordSorter.hpp"
+#include "MappedFile.hpp"
+#include "ModelContents.hpp"
+#include "Rcu.hpp"
 
 namespace cppjieba {
 
@@ -40,6 +53,17 @@ const double MIN_DOUBLE = -3.14e+100;
 const double MAX_DOUBLE = 3.14e+100;
 const size_t DICT_COLUMN_NUM = 3;
 const char* const UNKNOWN_TAG = "";
+const size_t DEFAULT_OVERLAY_COMPACT_THRESHOLD = 4096;
+// Runtime words since the overlay trie was last rebuilt are kept in a trie of
+// their own until there are more than the square root of the overlay size,
+// and no fewer than this many.
+const size_t MIN_RECENT_OVERLAY_WORDS = 32;
+// Layers replaced by insertions are freed this many at a time.
+const size_t RETIRED_LAYERS_BATCH = 16;
+// The main dictionary is parsed in chunks of this many bytes at most, no
+// smaller than the minimum unless that leaves one thread idle.
+const size_t MAX_DICT_PARSE_CHUNK_BYTES = 4 << 20;
+const size_t MIN_DICT_PARSE_CHUNK_BYTES = 256 << 10;
 
 class DictTrie {
 public:
@@ -49,37 +73,377 @@ public:
         WordWeightMax,
     }; // enum UserWordWeightOption
 
+    // How an existing DAT cache is checked against the dictionaries.
+    enum CacheValidation {
+        ValidateStrict, // MD5 of every dictionary on each start
+        ValidateFast,   // (path, size, mtime, inode) manifest; content hash only when it differs
+        ValidateReadOnly, // caches named as with ValidateFast, attached unchecked; never written or rebuilt
+    }; // enum CacheValidation
+
     DictTrie(const string& dict_path, const string& user_dict_paths = "", const string & dat_cache_path = "",
-             UserWordWeightOption user_word_weight_opt = WordWeightMedian) {
-        Init(dict_path, user_dict_paths, dat_cache_path, user_word_weight_opt);
+             UserWordWeightOption user_word_weight_opt = WordWeightMedian,
+             CacheValidation cache_validation = ValidateFast,
+             const MmapOptions& mmap_options = MmapOptions(),
+             DatElementFormat element_format = DAT_ELEMENTS_WIDE,
+             DatEngine engine = DAT_ENGINE_BYTES,
+             bool profiled_layout = false) {
+        mmap_options_ = mmap_options;
+        element_format_ = element_format;
+        engine_ = engine;
+        profiled_layout_ = profiled_layout;
+        Init(dict_path, user_dict_paths, dat_cache_path, user_word_weight_opt, cache_validation);
+    }
+
+    // Dictionary and user dictionary given by contents, built in memory, see
+    // ModelContents. Reload() rebuilds the user layer from them, unless
+    // ReloadUserDict names files.
+    explicit DictTrie(const std::shared_ptr<const ModelContents>& contents,
+                      UserWordWeightOption user_word_weight_opt = WordWeightMedian,
+                      const MmapOptions& mmap_options = MmapOptions(),
+                      DatElementFormat element_format = DAT_ELEMENTS_WIDE,
+                      DatEngine engine = DAT_ENGINE_BYTES) {
+        contents_ = contents;
+        user_word_weight_opt_ = user_word_weight_opt;
+        mmap_options_ = mmap_options;
+        element_format_ = element_format;
+        engine_ = engine;
+
+        LoadedDict dict = LoadDict("", "");
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        Adopt(dict);
     }
 
-    ~DictTrie() {}
+    // Dictionary and user layer from a bundle written by Jieba::SaveBundle.
+    // Reload() re-opens the bundle file.
+    explicit DictTrie(const std::shared_ptr<const ModelBundle>& bundle) {
+        dict_path_ = bundle->Path();
+        from_bundle_ = true;
+        mmap_options_ = bundle->GetMmapOptions();
+        user_word_weight_opt_ = UserWordWeightOption(bundle->Meta().user_word_weight_opt);
 
-    const DatMemElem* Find(const string & word) const {
-        return dat_.Find(word);
+        LoadedDict dict = LoadBundleDict(bundle, "");
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        Adopt(dict);
+    }
+
+    ~DictTrie() {
+        WaitForReload();
+        WaitForCompaction();
+        for (size_t i = 0; i < retired_.size(); i++) {
+            delete retired_[i];
+        }
+        delete layers_.load();
+    }
+
+    // Keeps the current layers alive across several calls, e.g. so a DAG and
+    // the lookups made while cutting by it see the same dictionary. Readers
+    // never block.
+    RcuDomain::ReadGuard Pin() const {
+        return rcu_.Read();
+    }
+
+    // elem, if given, receives a copy of the entry
+    bool Find(const string & word, DatMemElem* elem = nullptr) const {
+        RcuDomain::ReadGuard guard(rcu_);
+        const DictLayers* layers = layers_.load(std::memory_order_acquire);
+
+        if (layers->recent && layers->recent->Find(word, elem)) {
+            return true;
+        }
+
+        if (layers->overlay && layers->overlay->Find(word, elem)) {
+            return true;
+        }
+
+        if (layers->user && layers->user->Find(word, elem)) {
+            return true;
+        }
+
+        return layers->base->Find(word, elem);
     }
 
     void Find(RuneStrArray::const_iterator begin,
               RuneStrArray::const_iterator end,
               vector<struct DatDag>&res,
               size_t max_word_len = MAX_WORD_LENGTH) const {
-        dat_.Find(begin, end, res, max_word_len);
+        string text;
+        Find(begin, end, res, max_word_len, text);
+    }
+
+    // text is scratch space for the UTF-8 form of the range
+    template <bool kBoundedLen = true>
+    void Find(RuneStrArray::const_iterator begin,
+              RuneStrArray::const_iterator end,
+              vector<struct DatDag>&res,
+              size_t max_word_len,
+              string& text) const {
+        RcuDomain::ReadGuard guard(rcu_);
+        const DictLayers* layers = layers_.load(std::memory_order_acquire);
+        layers->base->template Find<kBoundedLen>(begin, end, res, max_word_len, text);
+
+        if (layers->user) {
+            layers->user->template MergeFind<kBoundedLen>(begin, end, res, max_word_len, text);
+        }
+
+        if (layers->overlay) {
+            layers->overlay->template MergeFind<kBoundedLen>(begin, end, res, max_word_len, text);
+        }
+
+        if (layers->recent) {
+            layers->recent->template MergeFind<kBoundedLen>(begin, end, res, max_word_len, text);
+        }
     }
 
     bool IsUserDictSingleChineseWord(const Rune& word) const {
-        return IsIn(user_dict_single_chinese_word_, word);
+        RcuDomain::ReadGuard guard(rcu_);
+        return IsIn(*layers_.load(std::memory_order_acquire)->user_single_words, word);
     }
 
     double GetMinWeight() const {
-        return dat_.GetMinWeight();
+        RcuDomain::ReadGuard guard(rcu_);
+        return layers_.load(std::memory_order_acquire)->base->GetMinWeight();
     }
 
     size_t GetTotalDictSize() const {
-        return total_dict_size_;
+        RcuDomain::ReadGuard guard(rcu_);
+        return layers_.load(std::memory_order_acquire)->total_dict_size;
+    }
+
+    // The current main dictionary and user layer; the user layer is null
+    // without user words.
+    std::shared_ptr<const DatTrie> GetBaseLayer() const {
+        RcuDomain::ReadGuard guard(rcu_);
+        return layers_.load(std::memory_order_acquire)->base;
+    }
+
+    std::shared_ptr<const DatTrie> GetUserLayer() const {
+        RcuDomain::ReadGuard guard(rcu_);
+        return layers_.load(std::memory_order_acquire)->user;
+    }
+
+    // The user layer's cache file, written even when the base takes every
+    // user word and the layer is left out; empty without one.
+    string GetUserCacheFile() const {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        return user_cache_file_;
+    }
+
+    // Adds or replaces a word at runtime. It goes into an in-memory overlay
+    // that lookups consult before the cache file; once the overlay holds
+    // SetOverlayCompactThreshold() words, a background thread rebuilds the
+    // user layer in memory with them. That layer is private to this
+    // instance; no cache file is written and GetUserCacheFile() still names
+    // the one of the user dictionaries.
+    bool InsertUserWord(const string& word, double weight, const string& tag = UNKNOWN_TAG) {
+        return Insert(word, tag, [weight](double& w) {
+            w = weight;
+            return true;
+        });
     }
 
-    void InserUserDictNode(const string& line, bool saveNodeInfo = true) {
+    // jieba 的用户词权重: 未给词频时用 user_word_weight_opt 选出的默认权重
+    bool InsertUserWord(const string& word, const string& tag = UNKNOWN_TAG) {
+        return Insert(word, tag, [this](double& w) {
+            w = user_word_default_weight_;
+            return true;
+        });
+    }
+
+    bool InsertUserWord(const string& word, int freq, const string& tag = UNKNOWN_TAG) {
+        return Insert(word, tag, [this, freq](double& w) {
+            if (freq <= 0 || freq_sum_ <= 0.0) {
+                return false;
+            }
+            w = log(1.0 * freq / freq_sum_);
+            return true;
+        });
+    }
+
+    // 0 disables compaction; the overlay then grows without bound.
+    void SetOverlayCompactThreshold(size_t threshold) {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        compact_threshold_ = threshold;
+    }
+
+    size_t GetOverlaySize() const {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        return overlay_words_.size();
+    }
+
+    // Blocks until a running compaction has been published.
+    void WaitForCompaction() {
+        std::thread compact_thread;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            compact_thread.swap(compact_thread_);
+        }
+
+        if (compact_thread.joinable()) {
+            compact_thread.join();
+        }
+    }
+
+    // Re-reads the dictionaries, attaching or rebuilding the base cache and
+    // rebuilding the user layer, and swaps them in. Lookups keep using the
+    // old ones until then and they are freed once lookups drain; words from
+    // InsertUserWord are kept.
+    // With async the work runs on a background thread and the return value
+    // only says whether it started. One reload runs at a time.
+    bool Reload(bool async = false) {
+        return StartReload(std::shared_ptr<string>(), async);
+    }
+
+    // Same, switching to other user dictionaries.
+    bool ReloadUserDict(const string& user_dict_paths, bool async = false) {
+        return StartReload(std::make_shared<string>(user_dict_paths), async);
+    }
+
+    void WaitForReload() {
+        std::thread reload_thread;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            reload_thread.swap(reload_thread_);
+        }
+
+        if (reload_thread.joinable()) {
+            reload_thread.join();
+        }
+    }
+
+    bool IsReloading() const {
+        return reloading_.load();
+    }
+
+    // 0 for the dictionaries loaded at construction, +1 per successful reload
+    size_t GetGeneration() const {
+        return generation_.load();
+    }
+
+    // wall time of the last finished reload
+    uint64_t GetLastReloadMicros() const {
+        return last_reload_us_.load();
+    }
+
+    bool LastReloadSucceeded() const {
+        return last_reload_ok_.load();
+    }
+
+    // Pages of the base and user layer resident in memory, e.g. to check
+    // the effect of MmapOptions after attaching.
+    Residency GetResidency() const {
+        RcuDomain::ReadGuard guard(rcu_);
+        const DictLayers* layers = layers_.load(std::memory_order_acquire);
+        Residency residency;
+        layers->base->AddResidency(residency);
+
+        if (layers->user) {
+            layers->user->AddResidency(residency);
+        }
+
+        return residency;
+    }
+
+    // Adds the base and user layer to writer and fills in the dictionary
+    // fields of meta. Words from InsertUserWord are not included.
+    void WriteBundleSections(BundleWriter& writer, BundleMeta& meta) const {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        const DictLayers* layers = layers_.load(std::memory_order_relaxed);
+        layers->base->AddToBundle(writer, BUNDLE_DICT_ELEMENTS, BUNDLE_DICT_UNITS, BUNDLE_DICT_WEIGHTS,
+                                  BUNDLE_DICT_TAGS, BUNDLE_DICT_RUNE_UNITS, BUNDLE_DICT_LOUDS_UNITS);
+
+        if (layers->user) {
+            layers->user->AddToBundle(writer, BUNDLE_USER_ELEMENTS, BUNDLE_USER_UNITS);
+        }
+
+        vector<Rune> single_words(dict_single_words_->begin(), dict_single_words_->end());
+        std::sort(single_words.begin(), single_words.end());
+
+        if (!single_words.empty()) {
+            writer.Add(BUNDLE_USER_SINGLE_WORDS, single_words.data(), sizeof(Rune) * single_words.size());
+        }
+
+        meta.min_weight = layers->base->GetMinWeight();
+        meta.freq_sum = layers->base->GetFreqSum();
+        meta.user_word_default_weight = layers->base->GetUserWordDefaultWeight();
+        meta.total_dict_size = layers->total_dict_size;
+        meta.dict_words_num = layers->base->GetElementsNum();
+        meta.user_word_weight_opt = user_word_weight_opt_;
+    }
+
+    // Offline layout tuning: counts how often each word of the main
+    // dictionary is matched in the lines of the sample corpus files
+    // ("|;"-separated) and writes a cache of it with the hot words first,
+    // elements and, for the rune engine, trie nodes, so they share a few
+    // pages. DictTries constructed with profiled_layout use it instead of the
+    // normal cache for as long as the dictionary is unchanged. Returns its path.
+    string SaveProfiledLayout(const string& corpus_paths) const {
+        if (from_bundle_ || contents_) {
+            throw std::runtime_error("Profiled layouts are built from dictionary files, not from a bundle");
+        }
+
+        WordHeat heat;
+        {
+            RcuDomain::ReadGuard guard(rcu_);
+            ProfileWords(*layers_.load(std::memory_order_acquire)->base, corpus_paths, heat);
+        }
+
+        size_t file_size_sum = 0;
+        string md5;
+        vector<FileStamp> stamps;
+        FingerprintDict(dict_path_, file_size_sum, md5, stamps);
+
+        const string profiled_path = CacheFilePath(BaseCacheName(md5) + "_p.dat");
+        if (profiled_path.empty()) {
+            throw std::runtime_error("Valid DAT cache path could not be determined.");
+        }
+
+        DatTrie profiled;
+        BuildBase(profiled, dict_path_, profiled_path, md5, stamps, 0, &heat);
+        XLOG(INFO) << "Wrote profiled DAT cache of " << heat.size() << " hot words: " << profiled_path;
+
+        // so the next profiled_layout instance maps the new file
+        SharedBases().Erase(profiled_path);
+        return profiled_path;
+    }
+
+    // Adds one to heat per match of a word of base in the lines of the files
+    static void ProfileWords(const DatTrie& base, const string& corpus_paths, WordHeat& heat) {
+        const vector<string> files = limonp::Split(corpus_paths, "|;");
+        RuneStrArray runes;
+        vector<DatDag> dags;
+        string text;
+        string line;
+
+        for (size_t f = 0; f < files.size(); f++) {
+            ifstream ifs(files[f].c_str());
+            if (!ifs.is_open()) {
+                throw std::runtime_error("Cannot read corpus " + files[f]);
+            }
+
+            while (getline(ifs, line)) {
+                if (!DecodeRunesInString(line, runes) || runes.empty()) {
+                    continue;
+                }
+
+                base.Find(runes.begin(), runes.end(), dags, MAX_WORD_LENGTH, text);
+
+                for (size_t i = 0; i < dags.size(); i++) {
+                    for (size_t k = 0; k < dags[i].nexts.size(); k++) {
+                        if (dags[i].nexts[k].weight == DAG_NO_WORD) {
+                            continue;
+                        }
+
+                        const RuneInfo& last = runes[dags[i].nexts[k].end - 1];
+                        heat[line.substr(runes[i].offset, last.offset + last.len - runes[i].offset)]++;
+                    }
+                }
+            }
+        }
+    }
+
+    void InserUserDictNode(const string& line, vector<DatElement>* node_infos,
+                           unordered_set<Rune>& user_single_words,
+                           double freq_sum, double user_word_default_weight) const {
         vector<string> buf;
         DatElement node_info;
         Split(line, buf, " ");
@@ -89,62 +453,143 @@ public:
         }
 
         node_info.word = buf[0];
-        node_info.weight = user_word_default_weight_;
+        node_info.weight = user_word_default_weight;
         node_info.tag = UNKNOWN_TAG;
 
         if (buf.size() == 2) {
             node_info.tag = buf[1];
         } else if (buf.size() == 3) {
-            if (freq_sum_ > 0.0) {
+            if (freq_sum > 0.0) {
                 const int freq = atoi(buf[1].c_str());
-                node_info.weight = log(1.0 * freq / freq_sum_);
+                node_info.weight = log(1.0 * freq / freq_sum);
                 node_info.tag = buf[2];
             }
         }
 
-        if (saveNodeInfo) {
-            static_node_infos_.push_back(node_info);
+        if (node_infos) {
+            node_infos->push_back(node_info);
         }
 
         if (Utf8CharNum(node_info.word) == 1) {
             RuneArray word;
 
             if (DecodeRunesInString(node_info.word, word)) {
-                user_dict_single_chinese_word_.insert(word[0]);
+                user_single_words.insert(word[0]);
             } else {
                 XLOG(ERROR) << "Decode " << node_info.word << " failed.";
             }
         }
     }
 
-    void LoadUserDict(const string& filePaths, bool saveNodeInfo = true) {
+    // node_infos may be null when only the single-character words are wanted
+    void LoadUserDict(const string& filePaths, vector<DatElement>* node_infos,
+                      unordered_set<Rune>& user_single_words,
+                      double freq_sum, double user_word_default_weight) const {
         vector<string> files = limonp::Split(filePaths, "|;");
 
         for (size_t i = 0; i < files.size(); i++) {
             ifstream ifs(files[i].c_str());
             XCHECK(ifs.is_open()) << "open " << files[i] << " failed";
-            string line;
+            LoadUserDict(ifs, node_infos, user_single_words, freq_sum, user_word_default_weight);
+        }
+    }
 
-            for (; getline(ifs, line);) {
-                if (line.size() == 0) {
-                    continue;
-                }
+    void LoadUserDict(istream& is, vector<DatElement>* node_infos, unordered_set<Rune>& user_single_words,
+                      double freq_sum, double user_word_default_weight) const {
+        string line;
 
-                InserUserDictNode(line, saveNodeInfo);
+        for (; getline(is, line);) {
+            if (line.size() == 0) {
+                continue;
             }
+
+            InserUserDictNode(line, node_infos, user_single_words, freq_sum, user_word_default_weight);
         }
     }
 
 
 private:
+    // The InsertUserWord overloads. weight sets the word's weight, or returns
+    // false to reject it; it runs under write_mutex_, as the dictionary
+    // statistics it may read change on reload.
+    template <class Weight>
+    bool Insert(const string& word, const string& tag, Weight weight) {
+        RuneArray runes;
+
+        if (word.empty() || !DecodeRunesInString(word, runes)) {
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            DatElement node_info;
+
+            if (!weight(node_info.weight)) {
+                return false;
+            }
+
+            node_info.word = word;
+            node_info.tag = tag;
+            overlay_words_[word] = node_info;
+            recent_words_[word] = node_info;
+            inserted_words_[word] = node_info;
+
+            const DictLayers* layers = layers_.load(std::memory_order_relaxed);
+            std::shared_ptr<const unordered_set<Rune> > single_words = layers->user_single_words;
+
+            if (runes.size() == 1 && !IsIn(*single_words, runes[0])) {
+                unordered_set<Rune>* words = new unordered_set<Rune>(*single_words);
+                words->insert(runes[0]);
+                single_words.reset(words);
+            }
+
+            PublishOverlay(layers->base, layers->user, single_words, layers->total_dict_size, false);
+            MaybeStartCompaction();
+        }
+
+        ReclaimLayers(RETIRED_LAYERS_BATCH);
+        return true;
+    }
+
+    // Everything LoadDict produces, published by Adopt.
+    struct LoadedDict {
+        std::shared_ptr<DatTrie> base;
+        std::shared_ptr<DatTrie> user;
+        std::shared_ptr<unordered_set<Rune> > user_single_words;
+        size_t total_dict_size = 0;
+        string user_cache_file;
+    };
+
     void Init(const string& dict_path, const string& user_dict_paths, const string& dat_cache_dir,
-              UserWordWeightOption user_word_weight_opt) {
+              UserWordWeightOption user_word_weight_opt, CacheValidation cache_validation) {
         if (dict_path.empty()) {
              XLOG(ERROR) << "Main dictionary path cannot be empty.";
              throw std::invalid_argument("Main dictionary path cannot be empty.");
         }
 
-        string dict_files = dict_path;
+        dict_path_ = dict_path;
+        user_dict_paths_ = user_dict_paths;
+        dat_cache_dir_ = dat_cache_dir;
+        user_word_weight_opt_ = user_word_weight_opt;
+        cache_validation_ = cache_validation;
+
+        LoadedDict dict = LoadDict(dict_path, user_dict_paths);
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        Adopt(dict);
+    }
+
+    // Loads the base and builds the user layer for the given dictionaries
+    // without touching the published state, so it can run next to readers.
+    LoadedDict LoadDict(const string& dict_path, const string& user_dict_paths) const {
+        if (contents_) {
+            return LoadContentsDict(user_dict_paths);
+        }
+
+        LoadedDict dict;
+        string base_key;
+        dict.base = AcquireBase(dict_path, dict.total_dict_size, base_key);
+        dict.user_single_words = std::make_shared<unordered_set<Rune> >();
+
         if (!user_dict_paths.empty()) {
             vector<string> user_files = limonp::Split(user_dict_paths, "|;");
             for(const auto& user_file : user_files) {
@@ -153,20 +598,183 @@ private:
                     XLOG(WARNING) << "User dictionary file not found or not readable: " << user_file;
                 }
             }
-            dict_files += ";" + user_dict_paths;
+
+            vector<FileStamp> user_stamps;
+            size_t user_size_sum = 0;
+            CalcFileListStamps(user_dict_paths, user_stamps, user_size_sum);
+            dict.total_dict_size += user_size_sum;
         }
 
-        size_t file_size_sum = 0;
-        XLOG(DEBUG) << "Calculating MD5 for dictionary files: " << dict_files;
-        const string md5 = CalcFileListMD5(dict_files, file_size_sum);
-        if (md5.empty() || file_size_sum == 0) {
-            XLOG(ERROR) << "Failed to calculate MD5 or total file size is zero for dictionaries: " << dict_files;
-            throw std::runtime_error("Failed to process dictionary files for MD5 calculation.");
+        dict.user = LoadUserLayer(*dict.base, base_key, user_dict_paths, *dict.user_single_words);
+        if (dict.user) {
+            dict.user_cache_file = dict.user->GetCacheFile();
+            if (dict.user->GetElementsNum() == 0) {
+                dict.user.reset(); // only the file stands for it, lookups skip the layer
+            }
+        }
+
+        // before publishing, so the first cuts find the pages in place
+        dict.base->AdviseMapping(mmap_options_);
+        if (dict.user) {
+            dict.user->AdviseMapping(mmap_options_);
+        }
+
+        return dict;
+    }
+
+    // The base built from contents_ into memory, and the user layer from
+    // user_dict_paths, or contents_ if there are none.
+    LoadedDict LoadContentsDict(const string& user_dict_paths) const {
+        LoadedDict dict;
+        dict.base = std::make_shared<DatTrie>();
+        dict.user_single_words = std::make_shared<unordered_set<Rune> >();
+        dict.total_dict_size = contents_->dict.size();
+
+        if (user_dict_paths.empty()) {
+            dict.total_dict_size += contents_->user_dict.size();
+        } else {
+            vector<FileStamp> user_stamps;
+            size_t user_size_sum = 0;
+            CalcFileListStamps(user_dict_paths, user_stamps, user_size_sum);
+            dict.total_dict_size += user_size_sum;
+        }
+
+        BuildBase(*dict.base, "", "", string(32, '0'), vector<FileStamp>(), 0, NULL); // the md5 names no file
+        dict.user = BuildUserLayer(*dict.base, user_dict_paths, std::map<string, DatElement>(),
+                                   *dict.user_single_words);
+
+        dict.base->AdviseMapping(mmap_options_);
+        return dict;
+    }
+
+    // The base and, unless other user dictionaries are given, the user layer
+    // stored in bundle.
+    LoadedDict LoadBundleDict(const std::shared_ptr<const ModelBundle>& bundle, const string& user_dict_paths) const {
+        const BundleMeta& meta = bundle->Meta();
+        LoadedDict dict;
+        dict.base = std::make_shared<DatTrie>();
+        dict.user_single_words = std::make_shared<unordered_set<Rune> >();
+        dict.total_dict_size = meta.total_dict_size;
+
+        DatEngine engine = DAT_ENGINE_BYTES;
+        uint32_t units_id = BUNDLE_DICT_UNITS;
+        if (bundle->Section(BUNDLE_DICT_RUNE_UNITS)) {
+            engine = DAT_ENGINE_RUNES;
+            units_id = BUNDLE_DICT_RUNE_UNITS;
+        } else if (bundle->Section(BUNDLE_DICT_LOUDS_UNITS)) {
+            engine = DAT_ENGINE_LOUDS;
+            units_id = BUNDLE_DICT_LOUDS_UNITS;
+        }
+        const bool found = bundle->Section(BUNDLE_DICT_WEIGHTS)
+                               ? dict.base->InitFromBundle(bundle, units_id, BUNDLE_DICT_WEIGHTS, BUNDLE_DICT_TAGS,
+                                                           meta.dict_words_num, engine)
+                               : dict.base->InitFromBundle(bundle, BUNDLE_DICT_ELEMENTS, units_id, engine);
+
+        if (!found) {
+            throw std::runtime_error("Model bundle " + bundle->Path() + " has no dictionary");
+        }
+
+        dict.base->SetMinWeight(meta.min_weight);
+        dict.base->SetWordWeightStats(meta.freq_sum, meta.user_word_default_weight);
+        dict.base->BuildJumpTable();
+
+        if (!user_dict_paths.empty()) {
+            dict.user = BuildUserLayer(*dict.base, user_dict_paths, std::map<string, DatElement>(),
+                                       *dict.user_single_words);
+            return dict;
+        }
+
+        dict.user = std::make_shared<DatTrie>();
+        if (!dict.user->InitFromBundle(bundle, BUNDLE_USER_ELEMENTS, BUNDLE_USER_UNITS)) {
+            dict.user.reset();
+        }
+
+        size_t size = 0;
+        const Rune* single_words = reinterpret_cast<const Rune*>(bundle->Section(BUNDLE_USER_SINGLE_WORDS, &size));
+        if (single_words) {
+            dict.user_single_words->insert(single_words, single_words + size / sizeof(Rune));
+        }
+
+        return dict;
+    }
+
+    // Bases mapped by this process by cache path, so that instances over the
+    // same main dictionary (one per tenant, say) share a single mapping.
+    // mutex only guards the maps; a base is attached or built under the
+    // mutex of its path, so instances over other dictionaries go ahead and
+    // those over the same one wait for it and share it.
+    struct BaseRegistry {
+        std::mutex mutex;
+        std::map<string, std::weak_ptr<DatTrie> > bases;
+        std::map<string, std::weak_ptr<std::mutex> > loading;
+
+        std::shared_ptr<DatTrie> Find(const string& path) {
+            std::lock_guard<std::mutex> lock(mutex);
+            const auto it = bases.find(path);
+            return it == bases.end() ? std::shared_ptr<DatTrie>() : it->second.lock();
+        }
+
+        void Insert(const string& path, const std::shared_ptr<DatTrie>& base) {
+            std::lock_guard<std::mutex> lock(mutex);
+            bases[path] = base;
+        }
+
+        void Erase(const string& path) {
+            std::lock_guard<std::mutex> lock(mutex);
+            bases.erase(path);
+        }
+
+        std::shared_ptr<std::mutex> PathMutex(const string& path) {
+            std::lock_guard<std::mutex> lock(mutex);
+            EraseExpired(bases);
+            EraseExpired(loading);
+
+            std::shared_ptr<std::mutex> path_mutex = loading[path].lock();
+            if (!path_mutex) {
+                path_mutex = std::make_shared<std::mutex>();
+                loading[path] = path_mutex;
+            }
+            return path_mutex;
+        }
+
+        template <class T>
+        static void EraseExpired(std::map<string, std::weak_ptr<T> >& entries) {
+            for (auto it = entries.begin(); it != entries.end();) {
+                if (it->second.expired()) {
+                    it = entries.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    };
+
+    static BaseRegistry& SharedBases() {
+        static BaseRegistry registry;
+        return registry;
+    }
+
+    // Keeps caches of different element formats and engines apart.
+    static string CacheFormatSuffix(DatElementFormat format, DatEngine engine) {
+        string suffix;
+        if (format == DAT_ELEMENTS_COMPACT) {
+            suffix = "_c";
+        } else if (format == DAT_ELEMENTS_INLINE) {
+            suffix = "_i";
         }
-        XLOG(DEBUG) << "Calculated MD5: " << md5 << ", Total size: " << file_size_sum;
 
+        if (engine == DAT_ENGINE_RUNES) {
+            return suffix + "_r";
+        }
+
+        return engine == DAT_ENGINE_LOUDS ? suffix + "_l" : suffix;
+    }
 
-        // --- 使用平台特定 API 构建完整的目标 DAT 文件路径 ---
+    // Full path of a cache file in dat_cache_dir_, creating the directory if
+    // needed (except with ValidateReadOnly); empty if there is no usable
+    // cache directory.
+    string CacheFilePath(const string& file_name) const {
+        const string& dat_cache_dir = dat_cache_dir_;
         string dat_file_path; // 最终的 .dat 文件路径
         if (!dat_cache_dir.empty()) {
             bool cache_dir_exists = false;
@@ -186,7 +794,7 @@ private:
                 }
             #endif
 
-            if (!cache_dir_exists) {
+            if (!cache_dir_exists && cache_validation_ != ValidateReadOnly) {
                 XLOG(DEBUG) << "Cache directory does not exist, attempting to create: " << dat_cache_dir;
                 // 尝试创建目录 (Windows 的 _mkdir 需要逐级创建，这里简化处理，假设父目录存在)
                 // 更健壮的方式是循环创建父目录
@@ -206,7 +814,6 @@ private:
             }
 
             if (cache_dir_is_dir) {
-                string file_name = "jieba_" + md5 + "_" + to_string(user_word_weight_opt) + ".dat";
                 #if defined(_WIN32) || defined(_WIN64)
                     char full_path[MAX_PATH];
                     if (PathCombineA(full_path, dat_cache_dir.c_str(), file_name.c_str())) {
@@ -230,130 +837,728 @@ private:
             }
         }
 
+        return dat_file_path;
+    }
+
+    // Identity of the main dictionary for its cache: with ValidateFast (and
+    // ValidateReadOnly) the MD5 of the paths plus the files' stamps, else the
+    // MD5 of their contents.
+    void FingerprintDict(const string& dict_files, size_t& file_size_sum, string& md5,
+                         vector<FileStamp>& stamps) const {
+        file_size_sum = 0;
+        stamps.clear();
+
+        if (cache_validation_ != ValidateStrict && CalcFileListStamps(dict_files, stamps, file_size_sum)) {
+            // fast 模式下缓存按词典路径命名，由 manifest 判断内容是否变化
+            limonp::md5String(dict_files.c_str(), md5);
+        } else {
+            XLOG(DEBUG) << "Calculating MD5 for dictionary files: " << dict_files;
+            stamps.clear();
+            md5 = CalcFileListMD5(dict_files, file_size_sum);
+        }
+
+        if (md5.empty() || file_size_sum == 0) {
+            XLOG(ERROR) << "Failed to calculate MD5 or total file size is zero for dictionaries: " << dict_files;
+            throw std::runtime_error("Failed to process dictionary files for MD5 calculation.");
+        }
+        XLOG(DEBUG) << "Calculated MD5: " << md5 << ", Total size: " << file_size_sum;
+    }
+
+    // Cache file name of the main dictionary without ".dat"; a profiled
+    // layout of it adds "_p".
+    string BaseCacheName(const string& md5) const {
+        return "jieba_" + md5 + "_" + to_string(user_word_weight_opt_) + CacheFormatSuffix(element_format_, engine_);
+    }
+
+    // The DAT of the main dictionary alone: shared if this process already
+    // maps a current one, else attached from or built into its cache file.
+    // base_key identifies its contents, for caches derived from it.
+    std::shared_ptr<DatTrie> AcquireBase(const string& dict_path, size_t& file_size_sum, string& base_key) const {
+        const string& dict_files = dict_path;
+        string md5;
+        vector<FileStamp> stamps;
+        uint64_t content_hash = 0;
+        FingerprintDict(dict_files, file_size_sum, md5, stamps);
+
+        const string dat_file_path = CacheFilePath(BaseCacheName(md5) + ".dat");
+
         if (dat_file_path.empty()) {
-             XLOG(WARNING) << "DAT cache path is invalid or empty, DAT caching disabled.";
-             // !!! 重要: 如果你的实现必须依赖 DAT 缓存文件才能工作，这里应该抛出异常 !!!
-             // throw std::runtime_error("Failed to determine a valid DAT cache file path.");
-             // 如果可以无缓存运行（每次重新解析文本词典），则需要添加相应逻辑。
-             // 假设当前版本必须使用 DAT 文件：
-             throw std::runtime_error("Valid DAT cache path could not be determined.");
+            if (cache_validation_ == ValidateReadOnly) {
+                throw std::runtime_error("Valid DAT cache path could not be determined.");
+            }
+
+            // e.g. a read-only root file system: the cache lives in memory
+            // of this instance only and is rebuilt on every start
+            XLOG(WARNING) << "DAT cache path is invalid or empty, building the DAT in memory.";
+            std::shared_ptr<DatTrie> base = std::make_shared<DatTrie>();
+            BuildBase(*base, dict_path, "", md5, stamps, content_hash, NULL);
+            base_key = md5 + "_" + to_string(base->GetContentHash());
+            return base;
         }
         // --- 路径构建结束 ---
 
 
-        if (dat_.InitAttachDat(dat_file_path, md5)) {
+        BaseRegistry& registry = SharedBases();
+
+        if (profiled_layout_) {
+            // never rebuilt here, there is no corpus to profile
+            const string profiled_path = CacheFilePath(BaseCacheName(md5) + "_p.dat");
+            const std::shared_ptr<std::mutex> path_mutex = registry.PathMutex(profiled_path);
+            std::lock_guard<std::mutex> path_lock(*path_mutex);
+            std::shared_ptr<DatTrie> profiled = registry.Find(profiled_path);
+
+            if (!profiled) {
+                profiled = std::make_shared<DatTrie>();
+                if (profiled->InitAttachDat(profiled_path, md5)) {
+                    profiled->BuildJumpTable();
+                } else {
+                    profiled.reset();
+                }
+            }
+
+            if (profiled && IsCacheCurrent(*profiled, dict_files, profiled_path, stamps, content_hash)) {
+                XLOG(DEBUG) << "Using profiled DAT cache file: " << profiled_path;
+                registry.Insert(profiled_path, profiled);
+                base_key = md5 + "_" + to_string(profiled->GetContentHash());
+                return profiled;
+            }
+
+            XLOG(WARNING) << "No current profiled DAT cache, see SaveProfiledLayout: " << profiled_path;
+        }
+
+        const std::shared_ptr<std::mutex> path_mutex = registry.PathMutex(dat_file_path);
+        std::lock_guard<std::mutex> path_lock(*path_mutex);
+        std::shared_ptr<DatTrie> shared = registry.Find(dat_file_path);
+
+        if (shared && IsCacheCurrent(*shared, dict_files, dat_file_path, stamps, content_hash)) {
+            XLOG(DEBUG) << "Sharing mapped DAT cache file: " << dat_file_path;
+            base_key = md5 + "_" + to_string(shared->GetContentHash());
+            return shared;
+        }
+
+        std::shared_ptr<DatTrie> base_ptr = std::make_shared<DatTrie>();
+        DatTrie& base = *base_ptr;
+        auto attach = [&]() {
+            if (!base.InitAttachDat(dat_file_path, md5) ||
+                !IsCacheCurrent(base, dict_files, dat_file_path, stamps, content_hash)) {
+                return false;
+            }
             XLOG(DEBUG) << "Successfully attached DAT cache file: " << dat_file_path;
-            LoadUserDict(user_dict_paths, false);
-            total_dict_size_ = file_size_sum;
-            return; // 初始化成功
+            base.BuildJumpTable();
+            registry.Insert(dat_file_path, base_ptr);
+            base_key = md5 + "_" + to_string(base.GetContentHash());
+            return true;
+        };
+
+        if (attach()) {
+            return base_ptr; // 初始化成功
         }
 
-        XLOG(DEBUG) << "DAT cache file not found or invalid, rebuilding: " << dat_file_path;
+        if (cache_validation_ == ValidateReadOnly) {
+            XLOG(ERROR) << "No DAT cache to attach in read-only mode: " << dat_file_path;
+            throw std::runtime_error("No DAT cache " + dat_file_path +
+                                     ", compile it with python -m cppjieba_py_dat.compile or jieba_compile.");
+        }
+
+        // another process may be building it already, then we attach its file
+        CacheBuildLock build_lock(dat_file_path);
+        if (build_lock.Waited() && attach()) {
+            return base_ptr;
+        }
 
-        static_node_infos_.clear();
-        user_dict_single_chinese_word_.clear();
+        XLOG(DEBUG) << "DAT cache file not found or invalid, rebuilding: " << dat_file_path;
+        BuildBase(base, dict_path, dat_file_path, md5, stamps, content_hash, NULL);
+        registry.Insert(dat_file_path, base_ptr); // instances still on the old one keep it alive
+        base_key = md5 + "_" + to_string(base.GetContentHash());
+        return base_ptr;
+    }
 
-        LoadDefaultDict(dict_path);
-        if (static_node_infos_.empty()) {
+    // Parses the main dictionary into base and its cache file, or into memory
+    // without dat_file_path
+    void BuildBase(DatTrie& base, const string& dict_path, const string& dat_file_path, const string& md5,
+                   const vector<FileStamp>& stamps, uint64_t content_hash, const WordHeat* heat) const {
+        // runs of a concurrent build of the same cache must not collide;
+        // without a cache file there is nowhere to spill them
+        MappedFile dict_file;
+        DatWordSorter sorter(dat_file_path + ".sort" +
+                                 to_string(std::chrono::steady_clock::now().time_since_epoch().count()),
+                             dat_file_path.empty() ? SIZE_MAX : DatWordSorter::kDefaultMemoryBudget);
+        vector<double> freqs;
+        if (contents_) {
+            ParseDefaultDict(contents_->dict.data(), contents_->dict.size(), sorter, freqs);
+        } else {
+            LoadDefaultDict(dict_path, dict_file, sorter, freqs);
+        }
+        if (freqs.empty()) {
              XLOG(ERROR) << "Failed to load default dictionary: " << dict_path;
              throw std::runtime_error("Failed to load default dictionary.");
         }
 
-        freq_sum_ = CalcFreqSum(static_node_infos_);
-        CalculateWeight(static_node_infos_, freq_sum_);
+        double freq_sum = 0.0;
+        for (size_t i = 0; i < freqs.size(); i++) {
+            freq_sum += freqs[i];
+        }
         double min_weight = 0;
-        SetStaticWordWeights(user_word_weight_opt, min_weight);
-        dat_.SetMinWeight(min_weight);
+        double user_word_default_weight = 0;
+        CalcStaticWordWeights(freqs, freq_sum, user_word_weight_opt_, min_weight, user_word_default_weight);
+        vector<double>().swap(freqs);
+        base.SetMinWeight(min_weight);
+        base.SetWordWeightStats(freq_sum, user_word_default_weight);
 
-        if (!user_dict_paths.empty()) {
-            LoadUserDict(user_dict_paths, true);
+        DatWordTable words;
+        sorter.Merge([&words, freq_sum](const char* word, size_t len, double freq, const char* tag, size_t tag_len) {
+            assert(freq > 0.0);
+            words.Append(word, len, log(freq / freq_sum), tag, tag_len);
+        });
+
+        if (!stamps.empty() && content_hash == 0) {
+            content_hash = CalcFileListFastHash(dict_path);
         }
 
-        bool build_ret = dat_.InitBuildDat(static_node_infos_, dat_file_path, md5);
+        bool build_ret =
+            base.InitBuildDat(words, dat_file_path, md5, stamps, content_hash, element_format_, engine_, heat);
 
         if (!build_ret) {
              XLOG(ERROR) << "Failed to build and attach DAT cache after building: " << dat_file_path;
              throw std::runtime_error("Failed to initialize DictTrie with DAT cache after building.");
         }
         XLOG(DEBUG) << "Successfully built and attached DAT cache: " << dat_file_path;
+        base.BuildJumpTable();
+    }
+
+    // The user layer compiled into its own small cache, named after the user
+    // dictionaries and the base it was filtered and weighed against, so a
+    // user dictionary edit only rebuilds this file. Falls back to an
+    // in-memory layer without a cache directory. The cache is written even
+    // when the base takes every user word, as an empty layer, so read-only
+    // instances find it. It stores the one-character user words too, so
+    // attaching it reads no user dictionary.
+    std::shared_ptr<DatTrie> LoadUserLayer(const DatTrie& base, const string& base_key,
+                                           const string& user_dict_paths,
+                                           unordered_set<Rune>& user_single_words) const {
+        if (user_dict_paths.empty()) {
+            return std::shared_ptr<DatTrie>();
+        }
+
+        string md5;
+        size_t file_size_sum = 0;
+        vector<FileStamp> stamps;
+        uint64_t content_hash = 0;
+
+        if (cache_validation_ != ValidateStrict && CalcFileListStamps(user_dict_paths, stamps, file_size_sum)) {
+            limonp::md5String((user_dict_paths + "|" + base_key).c_str(), md5);
+        } else {
+            stamps.clear();
+            limonp::md5String((CalcFileListMD5(user_dict_paths, file_size_sum) + "|" + base_key).c_str(), md5);
+        }
+
+        const string dat_file_path =
+            CacheFilePath("jieba_user_" + md5 + "_" + to_string(user_word_weight_opt_) + ".dat");
 
-        total_dict_size_ = file_size_sum;
-        vector<DatElement>().swap(static_node_infos_);
+        if (dat_file_path.empty()) {
+            return BuildUserLayer(base, user_dict_paths, std::map<string, DatElement>(), user_single_words);
+        }
+
+        std::shared_ptr<DatTrie> user = std::make_shared<DatTrie>();
+        auto attach = [&]() {
+            if (!user->InitAttachDat(dat_file_path, md5) ||
+                !IsCacheCurrent(*user, user_dict_paths, dat_file_path, stamps, content_hash)) {
+                return false;
+            }
+            XLOG(DEBUG) << "Successfully attached user DAT cache file: " << dat_file_path;
+            user->GetSingleWords(user_single_words);
+            return true;
+        };
+
+        if (attach()) {
+            return user;
+        }
+
+        if (cache_validation_ == ValidateReadOnly) {
+            XLOG(ERROR) << "No user DAT cache to attach in read-only mode: " << dat_file_path;
+            throw std::runtime_error("No user DAT cache " + dat_file_path +
+                                     ", compile it with python -m cppjieba_py_dat.compile or jieba_compile.");
+        }
+
+        CacheBuildLock build_lock(dat_file_path);
+        if (build_lock.Waited() && attach()) {
+            return user;
+        }
+
+        vector<DatElement> node_infos;
+        UserLayerElements(base, user_dict_paths, std::map<string, DatElement>(), node_infos, user_single_words);
+
+        if (!stamps.empty() && content_hash == 0) {
+            content_hash = CalcFileListFastHash(user_dict_paths);
+        }
+
+        user->SetMinWeight(base.GetMinWeight());
+        user->SetWordWeightStats(base.GetFreqSum(), base.GetUserWordDefaultWeight());
+        user->SetSingleWords(user_single_words);
+
+        if (!user->InitBuildDat(node_infos, dat_file_path, md5, stamps, content_hash)) {
+            XLOG(ERROR) << "Failed to build and attach user DAT cache: " << dat_file_path;
+            throw std::runtime_error("Failed to build user DAT cache.");
+        }
+
+        XLOG(DEBUG) << "Successfully built user DAT cache: " << dat_file_path;
+        return user;
     }
 
-    void LoadDefaultDict(const string& filePath) {
-        ifstream ifs(filePath.c_str());
-        XCHECK(ifs.is_open()) << "open " << filePath << " failed.";
-        string line;
-        vector<string> buf;
+    // The per-instance layer over base: the user dictionaries, then words
+    // that replace whatever the dictionaries say. As with one combined build,
+    // a user word the base has with a higher weight is left to the base.
+    void UserLayerElements(const DatTrie& base, const string& user_dict_paths,
+                           const std::map<string, DatElement>& words, vector<DatElement>& node_infos,
+                           unordered_set<Rune>& user_single_words) const {
+        if (!user_dict_paths.empty()) {
+            LoadUserDict(user_dict_paths, &node_infos, user_single_words, base.GetFreqSum(),
+                         base.GetUserWordDefaultWeight());
+        } else if (contents_) {
+            std::istringstream is(contents_->user_dict);
+            LoadUserDict(is, &node_infos, user_single_words, base.GetFreqSum(), base.GetUserWordDefaultWeight());
+        }
 
-        for (; getline(ifs, line);) {
-            Split(line, buf, " ");
-            XCHECK(buf.size() == DICT_COLUMN_NUM) << "split result illegal, line:" << line;
-            DatElement node_info;
-            node_info.word = buf[0];
-            node_info.weight = atof(buf[1].c_str());
-            node_info.tag = buf[2];
-            static_node_infos_.push_back(node_info);
+        size_t kept = 0;
+        for (size_t i = 0; i < node_infos.size(); i++) {
+            DatMemElem elem;
+            const bool in_base = base.Find(node_infos[i].word, &elem);
+
+            if (words.find(node_infos[i].word) == words.end() && !(in_base && elem.weight > node_infos[i].weight)) {
+                node_infos[kept++] = node_infos[i];
+            }
+        }
+        node_infos.resize(kept);
+
+        for (const auto& kv : words) {
+            node_infos.push_back(kv.second);
+        }
+    }
+
+    // In memory, for layers with runtime words folded in.
+    std::shared_ptr<DatTrie> BuildUserLayer(const DatTrie& base, const string& user_dict_paths,
+                                            const std::map<string, DatElement>& words,
+                                            unordered_set<Rune>& user_single_words) const {
+        vector<DatElement> node_infos;
+        UserLayerElements(base, user_dict_paths, words, node_infos, user_single_words);
+
+        if (node_infos.empty()) {
+            return std::shared_ptr<DatTrie>();
+        }
+
+        std::shared_ptr<DatTrie> user = std::make_shared<DatTrie>();
+        user->InitInMemory(node_infos);
+        return user;
+    }
+
+    // Makes a loaded dictionary current, with the runtime insertions back in
+    // the overlay on top of it. Called with write_mutex_ held.
+    void Adopt(const LoadedDict& dict) {
+        user_cache_file_ = dict.user_cache_file;
+        freq_sum_ = dict.base->GetFreqSum();
+        user_word_default_weight_ = dict.base->GetUserWordDefaultWeight();
+        overlay_words_ = inserted_words_;
+        dict_single_words_ = dict.user_single_words;
+        std::shared_ptr<unordered_set<Rune> > single_words =
+            std::make_shared<unordered_set<Rune> >(*dict.user_single_words);
+
+        for (const auto& kv : inserted_words_) {
+            RuneArray runes;
+
+            if (DecodeRunesInString(kv.first, runes) && runes.size() == 1) {
+                single_words->insert(runes[0]);
+            }
+        }
+
+        PublishOverlay(dict.base, dict.user, single_words, dict.total_dict_size, true);
+        MaybeStartCompaction();
+    }
+
+    bool StartReload(const std::shared_ptr<string>& user_dict_paths, bool async) {
+        bool expected = false;
+
+        if (!reloading_.compare_exchange_strong(expected, true)) {
+            return false;
+        }
+
+        if (!async) {
+            return DoReload(user_dict_paths);
+        }
+
+        std::lock_guard<std::mutex> lock(write_mutex_);
+
+        if (reload_thread_.joinable()) {
+            reload_thread_.join(); // finished already, reloading_ was false
         }
+
+        reload_thread_ = std::thread(&DictTrie::DoReload, this, user_dict_paths);
+        return true;
+    }
+
+    bool DoReload(std::shared_ptr<string> user_dict_paths) {
+        const auto start = std::chrono::steady_clock::now();
+        bool ok = false;
+
+        try {
+            std::lock_guard<std::mutex> rebuild(rebuild_mutex_);
+            const string paths = user_dict_paths ? *user_dict_paths : user_dict_paths_;
+
+            // LoadDefaultDict / LoadUserDict abort on unreadable files; a
+            // reload must fail without taking the process down.
+            vector<string> files = limonp::Split(paths, "|;");
+            if (!contents_) {
+                files.push_back(dict_path_);
+            }
+
+            for (const auto& file : files) {
+                if (!std::ifstream(file.c_str()).good()) {
+                    throw std::runtime_error("cannot read dictionary " + file);
+                }
+            }
+
+            LoadedDict dict = from_bundle_ ? LoadBundleDict(ModelBundle::Open(dict_path_, mmap_options_), paths)
+                                           : LoadDict(dict_path_, paths);
+            {
+                std::lock_guard<std::mutex> lock(write_mutex_);
+                user_dict_paths_ = paths;
+                Adopt(dict);
+            }
+            ReclaimLayers();
+            ok = true;
+        } catch (const std::exception& e) {
+            XLOG(ERROR) << "Dictionary reload failed: " << e.what();
+        }
+
+        last_reload_us_ = std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - start).count();
+        last_reload_ok_ = ok;
+
+        if (ok) {
+            generation_++;
+        }
+
+        reloading_ = false;
+        return ok;
+    }
+
+    // Only called on an attached cache. Without stamps (strict mode) the name
+    // already is the MD5 of the contents; otherwise the manifest must match,
+    // or else the contents must hash to what the cache was built from.
+    // Read-only caches are taken as they are.
+    bool IsCacheCurrent(const DatTrie& dat, const string& dict_files, const string& dat_file_path,
+                        const vector<FileStamp>& stamps, uint64_t& content_hash) const {
+        if (cache_validation_ == ValidateReadOnly || stamps.empty() || dat.MatchStamps(stamps)) {
+            return true;
+        }
+
+        content_hash = CalcFileListFastHash(dict_files);
+
+        if (content_hash != dat.GetContentHash()) {
+            return false;
+        }
+
+        XLOG(DEBUG) << "Dictionary metadata changed but contents did not, refreshing manifest: " << dat_file_path;
+        dat.RefreshStamps(dat_file_path, stamps);
+        return true;
+    }
+
+    // Publishes base and user with the runtime words on top of them. Those
+    // are split in two tries: the overlay of overlay_words_, rebuilt only
+    // with rebuild or once recent_words_ outgrows its limit, and a small one
+    // of recent_words_, the words inserted since, rebuilt on each insertion.
+    // The layers replaced wait in retired_ for ReclaimLayers. Called with
+    // write_mutex_ held.
+    void PublishOverlay(const std::shared_ptr<DatTrie>& base, const std::shared_ptr<DatTrie>& user,
+                        const std::shared_ptr<const unordered_set<Rune> >& user_single_words,
+                        size_t total_dict_size, bool rebuild) {
+        const DictLayers* current = layers_.load(std::memory_order_relaxed);
+        std::shared_ptr<DatTrie> overlay = current ? current->overlay : std::shared_ptr<DatTrie>();
+        const size_t recent_limit =
+            std::max(MIN_RECENT_OVERLAY_WORDS, size_t(std::sqrt(double(overlay_words_.size()))));
+
+        if (rebuild || !current || recent_words_.size() > recent_limit) {
+            overlay = TrieOf(overlay_words_);
+            recent_words_.clear();
+        }
+
+        const DictLayers* old = layers_.exchange(
+            new DictLayers(base, user, overlay, TrieOf(recent_words_), user_single_words, total_dict_size),
+            std::memory_order_acq_rel);
+
+        if (old) {
+            retired_.push_back(old);
+        }
+    }
+
+    static std::shared_ptr<DatTrie> TrieOf(const std::map<string, DatElement>& words) {
+        if (words.empty()) {
+            return std::shared_ptr<DatTrie>();
+        }
+
+        vector<DatElement> node_infos;
+        node_infos.reserve(words.size());
+
+        for (const auto& kv : words) {
+            node_infos.push_back(kv.second);
+        }
+
+        std::shared_ptr<DatTrie> trie = std::make_shared<DatTrie>();
+        trie->InitInMemory(node_infos);
+        return trie;
+    }
+
+    // Frees the retired layers once no lookup can reach them any more, if
+    // at least min_retired are waiting. Called without write_mutex_, so that
+    // writers never wait for lookups to drain; reclaim_mutex_ serializes the
+    // grace periods as RcuDomain requires.
+    void ReclaimLayers(size_t min_retired = 1) {
+        std::lock_guard<std::mutex> reclaim(reclaim_mutex_);
+        vector<const DictLayers*> retired;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            if (retired_.size() < min_retired) {
+                return;
+            }
+            retired.swap(retired_);
+        }
+
+        rcu_.Synchronize();
+
+        for (size_t i = 0; i < retired.size(); i++) {
+            delete retired[i];
+        }
+    }
+
+    // Called with write_mutex_ held.
+    void MaybeStartCompaction() {
+        if (compact_threshold_ == 0 || overlay_words_.size() < compact_threshold_ || compacting_) {
+            return;
+        }
+
+        if (from_bundle_ && user_dict_paths_.empty()) {
+            return; // the bundle's user layer cannot be rebuilt, the overlay stays on top of it
+        }
+
+        if (compact_thread_.joinable()) {
+            compact_thread_.join(); // finished already, compacting_ is false
+        }
+
+        // every runtime word, the user layer it replaces may hold those of an
+        // earlier compaction
+        compacting_ = true;
+        compact_thread_ = std::thread(&DictTrie::Compact, this, inserted_words_);
+    }
+
+    // Rebuilds the user layer with a snapshot of every runtime word folded
+    // in and swaps it in. Words inserted meanwhile stay in the overlay.
+    // Serialized with reloads, so the layer it replaces is always the one it
+    // rebuilt.
+    void Compact(std::map<string, DatElement> words) {
+        std::lock_guard<std::mutex> rebuild(rebuild_mutex_);
+        std::shared_ptr<DatTrie> base;
+        std::shared_ptr<DatTrie> user;
+
+        {
+            RcuDomain::ReadGuard guard(rcu_);
+            base = layers_.load(std::memory_order_acquire)->base;
+        }
+
+        try {
+            unordered_set<Rune> user_single_words;
+            user = BuildUserLayer(*base, user_dict_paths_, words, user_single_words);
+            XLOG(DEBUG) << "Compacted " << words.size() << " runtime words into the user layer";
+        } catch (const std::exception& e) {
+            XLOG(ERROR) << "Overlay compaction failed: " << e.what();
+            base.reset();
+        }
+
+        if (base) {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+
+            for (auto it = overlay_words_.begin(); it != overlay_words_.end();) {
+                const auto snapshot = words.find(it->first);
+
+                if (snapshot != words.end() && snapshot->second.weight == it->second.weight &&
+                    snapshot->second.tag == it->second.tag) {
+                    it = overlay_words_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+
+            const DictLayers* layers = layers_.load(std::memory_order_relaxed);
+            PublishOverlay(base, user, layers->user_single_words, layers->total_dict_size, true);
+        }
+
+        ReclaimLayers();
+        // last, MaybeStartCompaction joins this thread under write_mutex_
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        compacting_ = false;
     }
 
-    static bool WeightCompare(const DatElement& lhs, const DatElement& rhs) {
-        return lhs.weight < rhs.weight;
+    // Maps the file and parses it, see ParseDefaultDict; the mapping must
+    // outlive the sorter's Merge.
+    void LoadDefaultDict(const string& filePath, MappedFile& file, DatWordSorter& sorter,
+                         vector<double>& freqs) const {
+        if (!file.Open(filePath)) {
+            ifstream ifs(filePath.c_str());
+            XCHECK(ifs.is_open()) << "open " << filePath << " failed.";
+            return; // empty
+        }
+
+        ParseDefaultDict(file.Data(), file.Size(), sorter, freqs);
     }
 
-    void SetStaticWordWeights(UserWordWeightOption option, double & min_weight) {
-        XCHECK(!static_node_infos_.empty());
-        vector<DatElement> x = static_node_infos_;
-        sort(x.begin(), x.end(), WeightCompare);
-        if(x.empty()){
+    // Parses text into sorter in line-aligned chunks, one per thread at a
+    // time, the records pointing into text. The raw frequencies go into
+    // freqs in text order.
+    static void ParseDefaultDict(const char* text, size_t size, DatWordSorter& sorter, vector<double>& freqs) {
+        if (size == 0) {
             return;
         }
-        min_weight = x[0].weight;
-        const double max_weight_ = x[x.size() - 1].weight;
-        const double median_weight_ = x[x.size() / 2].weight;
+
+        const size_t hardware_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+        const size_t thread_num = std::max<size_t>(1, std::min(hardware_threads, size / MIN_DICT_PARSE_CHUNK_BYTES));
+        const size_t chunk_num = std::max(thread_num, size / MAX_DICT_PARSE_CHUNK_BYTES + 1);
+        const vector<size_t> bounds = DatWordSorter::SplitLines(text, size, chunk_num);
+
+        vector<vector<double> > chunk_freqs(bounds.size() - 1);
+        sorter.AddChunks(text, bounds, thread_num,
+                         [text, &chunk_freqs](size_t c, const char* begin, const char* end, vector<DatWordRecord>& records) {
+            for (const char* line = begin; line < end;) {
+                const char* nl = static_cast<const char*>(memchr(line, '\n', end - line));
+                const char* line_end = nl ? nl : end;
+                records.push_back(ParseDictLine(text, line, line_end));
+                chunk_freqs[c].push_back(records.back().weight);
+                line = line_end + 1;
+            }
+        });
+
+        for (size_t c = 0; c < chunk_freqs.size(); c++) {
+            freqs.insert(freqs.end(), chunk_freqs[c].begin(), chunk_freqs[c].end());
+        }
+    }
+
+    // "word freq tag", split on every space like Split(line, buf, " ")
+    static DatWordRecord ParseDictLine(const char* text, const char* line, const char* line_end) {
+        const char* fields[DICT_COLUMN_NUM];
+        size_t lens[DICT_COLUMN_NUM];
+        size_t n = 0;
+
+        for (const char* p = line; p < line_end; n++) {
+            const char* sp = static_cast<const char*>(memchr(p, ' ', line_end - p));
+            const char* field_end = sp ? sp : line_end;
+            if (n < DICT_COLUMN_NUM) {
+                fields[n] = p;
+                lens[n] = field_end - p;
+            }
+            if (!sp) {
+                n++;
+                break;
+            }
+            p = sp + 1;
+        }
+
+        // thrown rather than checked, so that a reload of a broken dictionary
+        // fails instead of aborting; AddChunks passes it on from the workers
+        if (n != DICT_COLUMN_NUM || fields[2] - fields[0] - lens[0] > 0xffff) {
+            XLOG(ERROR) << "split result illegal, line:" << string(line, line_end);
+            throw std::runtime_error("Malformed dictionary line: " + string(line, line_end));
+        }
+        DatWordRecord rec;
+        rec.offset = fields[0] - text;
+        // the field is followed by a space, where strtod stops like atof on a copy
+        rec.weight = lens[1] ? strtod(fields[1], NULL) : 0.0;
+        rec.word_len = uint32_t(lens[0]);
+        rec.tag_skip = uint16_t(fields[2] - fields[0] - lens[0]);
+        rec.tag_len = uint16_t(std::min<size_t>(lens[2], 0xffff));
+        return rec;
+    }
+
+    // Weights are monotone in the frequencies, so the order statistics are
+    // taken on those, with nth_element, and only the three results logged.
+    static void CalcStaticWordWeights(vector<double>& freqs, double freq_sum, UserWordWeightOption option,
+                                      double & min_weight, double & user_word_default_weight) {
+        if (freqs.empty()) {
+            throw std::runtime_error("Dictionary has no words.");
+        }
+        min_weight = log(*std::min_element(freqs.begin(), freqs.end()) / freq_sum);
+        const double max_weight_ = log(*std::max_element(freqs.begin(), freqs.end()) / freq_sum);
+        std::nth_element(freqs.begin(), freqs.begin() + freqs.size() / 2, freqs.end());
+        const double median_weight_ = log(freqs[freqs.size() / 2] / freq_sum);
 
         switch (option) {
             case WordWeightMin:
-                user_word_default_weight_ = min_weight;
+                user_word_default_weight = min_weight;
                 break;
 
             case WordWeightMedian:
-                user_word_default_weight_ = median_weight_;
+                user_word_default_weight = median_weight_;
                 break;
 
             default:
-                user_word_default_weight_ = max_weight_;
+                user_word_default_weight = max_weight_;
                 break;
         }
     }
 
-    double CalcFreqSum(const vector<DatElement>& node_infos) const {
-        double sum = 0.0;
-
-        for (size_t i = 0; i < node_infos.size(); i++) {
-            sum += node_infos[i].weight;
+private:
+    // What readers see: replaced as a whole under RCU, never modified once published.
+    struct DictLayers {
+        DictLayers(const std::shared_ptr<DatTrie>& b, const std::shared_ptr<DatTrie>& u,
+                   const std::shared_ptr<DatTrie>& o, const std::shared_ptr<DatTrie>& r,
+                   const std::shared_ptr<const unordered_set<Rune> >& s, size_t total)
+            : base(b), user(u), overlay(o), recent(r), user_single_words(s), total_dict_size(total) {
         }
 
-        return sum;
-    }
+        // lookups merge them in this order, later layers winning
+        std::shared_ptr<DatTrie> base;    // main dictionary, shared between instances
+        std::shared_ptr<DatTrie> user;    // user dictionaries (plus compacted insertions), may be null
+        std::shared_ptr<DatTrie> overlay; // runtime insertions, may be null
+        std::shared_ptr<DatTrie> recent;  // those since the overlay was built, may be null
+        std::shared_ptr<const unordered_set<Rune> > user_single_words;
+        size_t total_dict_size;
+    };
 
-    void CalculateWeight(vector<DatElement>& node_infos, double sum) const {
-        for (size_t i = 0; i < node_infos.size(); i++) {
-            DatElement& node_info = node_infos[i];
-            assert(node_info.weight > 0.0);
-            node_info.weight = log(double(node_info.weight) / sum);
-        }
-    }
+    // fixed at construction
+    string dict_path_; // the bundle's path with from_bundle_, empty with contents_
+    bool from_bundle_ = false;
+    std::shared_ptr<const ModelContents> contents_; // dictionaries given by contents
+    string dat_cache_dir_;
+    UserWordWeightOption user_word_weight_opt_ = WordWeightMedian;
+    CacheValidation cache_validation_ = ValidateFast;
+    MmapOptions mmap_options_;
+    DatElementFormat element_format_ = DAT_ELEMENTS_WIDE; // of the base cache, user layers stay wide
+    DatEngine engine_ = DAT_ENGINE_BYTES;                 // likewise
+    bool profiled_layout_ = false;                        // prefer the SaveProfiledLayout cache
 
-private:
-    vector<DatElement> static_node_infos_;
-    size_t total_dict_size_ = 0;
-    DatTrie dat_;
+    RcuDomain rcu_;
+    std::atomic<const DictLayers*> layers_{nullptr};
+
+    // Writer side. rebuild_mutex_ serializes reloads and compaction (taken
+    // first); write_mutex_ guards everything below and every publication.
+    // reclaim_mutex_ is taken before write_mutex_, by ReclaimLayers only.
+    std::mutex rebuild_mutex_;
+    std::mutex reclaim_mutex_;
+    mutable std::mutex write_mutex_;
+    string user_dict_paths_;
+    double freq_sum_ = 0;
+    double user_word_default_weight_ = 0;
+    std::map<string, DatElement> inserted_words_; // every InsertUserWord, re-applied on reload
+    std::map<string, DatElement> overlay_words_;  // those not compacted into the user layer yet
+    std::map<string, DatElement> recent_words_;   // those not in the overlay trie yet
+    vector<const DictLayers*> retired_;           // replaced, freed by ReclaimLayers
+    std::shared_ptr<const unordered_set<Rune> > dict_single_words_; // from the user dictionaries only
+    string user_cache_file_;
+    size_t compact_threshold_ = DEFAULT_OVERLAY_COMPACT_THRESHOLD;
+    bool compacting_ = false;
+    std::thread compact_thread_;
+    std::thread reload_thread_;
 
-    double freq_sum_;
-    double user_word_default_weight_;
-    unordered_set<Rune> user_dict_single_chinese_word_;
+    std::atomic<bool> reloading_{false};
+    std::atomic<bool> last_reload_ok_{true};
+    std::atomic<size_t> generation_{0};
+    std::atomic<uint64_t> last_reload_us_{0};
 };
 }
 
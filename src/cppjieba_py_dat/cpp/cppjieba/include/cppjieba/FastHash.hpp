@@ -0,0 +1,153 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+namespace cppjieba {
+
+// Streaming XXH64. Non-cryptographic, several GB/s; used to fingerprint
+// dictionary contents where MD5 would dominate startup time.
+class FastHash64 {
+public:
+    explicit FastHash64(uint64_t seed = 0) {
+        Reset(seed);
+    }
+
+    void Reset(uint64_t seed = 0) {
+        seed_ = seed;
+        v_[0] = seed + P1 + P2;
+        v_[1] = seed + P2;
+        v_[2] = seed;
+        v_[3] = seed - P1;
+        total_len_ = 0;
+        mem_size_ = 0;
+    }
+
+    void Update(const void* data, size_t len) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        const unsigned char* const end = p + len;
+        total_len_ += len;
+
+        if (mem_size_ + len < sizeof(mem_)) {
+            memcpy(mem_ + mem_size_, p, len);
+            mem_size_ += len;
+            return;
+        }
+
+        if (mem_size_ > 0) {
+            const size_t fill = sizeof(mem_) - mem_size_;
+            memcpy(mem_ + mem_size_, p, fill);
+            Consume(mem_);
+            p += fill;
+            mem_size_ = 0;
+        }
+
+        for (; p + sizeof(mem_) <= end; p += sizeof(mem_)) {
+            Consume(p);
+        }
+
+        mem_size_ = end - p;
+        memcpy(mem_, p, mem_size_);
+    }
+
+    void Update(const std::string& s) {
+        Update(s.data(), s.size());
+    }
+
+    uint64_t Digest() const {
+        uint64_t h;
+
+        if (total_len_ >= sizeof(mem_)) {
+            h = Rotl(v_[0], 1) + Rotl(v_[1], 7) + Rotl(v_[2], 12) + Rotl(v_[3], 18);
+
+            for (size_t i = 0; i < 4; i++) {
+                h ^= Round(0, v_[i]);
+                h = h * P1 + P4;
+            }
+        } else {
+            h = seed_ + P5;
+        }
+
+        h += total_len_;
+
+        const unsigned char* p = mem_;
+        const unsigned char* const end = mem_ + mem_size_;
+
+        for (; p + 8 <= end; p += 8) {
+            h ^= Round(0, Read64(p));
+            h = Rotl(h, 27) * P1 + P4;
+        }
+
+        if (p + 4 <= end) {
+            h ^= uint64_t(Read32(p)) * P1;
+            h = Rotl(h, 23) * P2 + P3;
+            p += 4;
+        }
+
+        for (; p < end; p++) {
+            h ^= (*p) * P5;
+            h = Rotl(h, 11) * P1;
+        }
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    static uint64_t Hash(const void* data, size_t len, uint64_t seed = 0) {
+        FastHash64 hasher(seed);
+        hasher.Update(data, len);
+        return hasher.Digest();
+    }
+
+    static uint64_t Hash(const std::string& s, uint64_t seed = 0) {
+        return Hash(s.data(), s.size(), seed);
+    }
+
+private:
+    static const uint64_t P1 = 11400714785074694791ULL;
+    static const uint64_t P2 = 14029467366897019727ULL;
+    static const uint64_t P3 = 1609587929392839161ULL;
+    static const uint64_t P4 = 9650029242287828579ULL;
+    static const uint64_t P5 = 2870177450012600261ULL;
+
+    static uint64_t Rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static uint64_t Round(uint64_t acc, uint64_t input) {
+        acc += input * P2;
+        acc = Rotl(acc, 31);
+        return acc * P1;
+    }
+
+    static uint64_t Read64(const unsigned char* p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint32_t Read32(const unsigned char* p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    void Consume(const unsigned char* p) {
+        for (size_t i = 0; i < 4; i++) {
+            v_[i] = Round(v_[i], Read64(p + 8 * i));
+        }
+    }
+
+    uint64_t seed_;
+    uint64_t v_[4];
+    uint64_t total_len_;
+    unsigned char mem_[32];
+    size_t mem_size_;
+}; // class FastHash64
+
+} // namespace cppjieba
@@ -9,7 +9,7 @@
 #include "Unicode.hpp"
 
 namespace cppjieba {
-class FullSegment: public SegmentBase {
+class FullSegment: public SegmentBase<FullSegment> {
 public:
     FullSegment(const DictTrie* dictTrie)
         : dictTrie_(dictTrie) {
@@ -17,21 +17,22 @@ public:
     }
     ~FullSegment() { }
 
-    virtual void Cut(RuneStrArray::const_iterator begin,
-                     RuneStrArray::const_iterator end,
-                     vector<WordRange>& res, bool, size_t) const override {
+    template <bool kHmm, bool kBoundedLen>
+    void Cut(RuneStrArray::const_iterator begin,
+             RuneStrArray::const_iterator end,
+             vector<WordRange>& res, size_t, SegmentContext& ctx) const {
         assert(dictTrie_);
-        vector<struct DatDag> dags;
-        dictTrie_->Find(begin, end, dags);
+        vector<struct DatDag>& dags = ctx.dags;
+        dictTrie_->Find<false>(begin, end, dags, MAX_WORD_LENGTH, ctx.text);
         size_t max_word_end_pos = 0;
 
         for (size_t i = 0; i < dags.size(); i++) {
             for (const auto & kv : dags[i].nexts) {
-                const size_t nextoffset = kv.first - 1;
+                const size_t nextoffset = kv.end - 1;
                 assert(nextoffset < dags.size());
                 const auto wordLen = nextoffset - i + 1;
                 const bool is_not_covered_single_word = ((dags[i].nexts.size() == 1) && (max_word_end_pos <= i));
-                const bool is_oov = (nullptr == kv.second); //Out-of-Vocabulary
+                const bool is_oov = (DAG_NO_WORD == kv.weight); //Out-of-Vocabulary
 
                 if ((is_not_covered_single_word) || ((not is_oov) && (wordLen >= 2))) {
                     WordRange wr(begin + i, begin + nextoffset);
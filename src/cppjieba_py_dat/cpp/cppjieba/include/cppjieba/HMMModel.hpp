@@ -1,12 +1,28 @@
 #pragma once
 
+#include <stdio.h>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include "limonp/Logging.hpp"
 #include "limonp/StringUtil.hpp"
+#include "Unicode.hpp"
+#include "FastHash.hpp"
+#include "MappedFile.hpp"
+#include "ModelBundle.hpp"
+#include "ModelContents.hpp"
 
 namespace cppjieba {
 
 using namespace limonp;
 typedef unordered_map<Rune, double> EmitProbMap;
 
+const uint32_t HMM_CACHE_MAGIC = 0x314d4d48; // "HMM1"
+
+// Emission log-probability of a (rune, state) pair the model lacks, the
+// MIN_DOUBLE Viterbi has always used.
+const double EMIT_PROB_MISSING = -3.14e+100;
+
 struct HMMModel {
     /*
      * STATUS:
@@ -14,31 +30,71 @@ struct HMMModel {
      * */
     enum {B = 0, E = 1, M = 2, S = 3, STATUS_SUM = 4};
 
-    HMMModel(const string& modelPath) {
-        memset(startProb, 0, sizeof(startProb));
-        memset(transProb, 0, sizeof(transProb));
-        statMap[0] = 'B';
-        statMap[1] = 'E';
-        statMap[2] = 'M';
-        statMap[3] = 'S';
-        emitProbVec.push_back(&emitProbB);
-        emitProbVec.push_back(&emitProbE);
-        emitProbVec.push_back(&emitProbM);
-        emitProbVec.push_back(&emitProbS);
-        LoadModel(modelPath);
+    // With cache_dir the model is compiled once into
+    // <cache_dir>/jieba_hmm_<content hash>.bin and later attached by mmap.
+    // With read_only that file must exist already: it is only attached,
+    // never rebuilt or written.
+    HMMModel(const string& modelPath, const string& cache_dir = "", bool read_only = false) {
+        InitStatMap();
+        Load(modelPath, cache_dir, read_only);
+    }
+    // The model parsed from contents->hmm_model, no cache file involved.
+    explicit HMMModel(const std::shared_ptr<const ModelContents>& contents) {
+        InitStatMap();
+        Load(contents);
+    }
+    // The model stored in bundle, used in place.
+    explicit HMMModel(const std::shared_ptr<const ModelBundle>& bundle) {
+        InitStatMap();
+        Load(bundle);
+    }
+    // Without a model until one of the Load functions is called, for owners
+    // that load it on first use. Not to be used before.
+    HMMModel() {
+        InitStatMap();
+    }
+
+    void Load(const string& modelPath, const string& cache_dir, bool read_only = false) {
+        if (cache_dir.empty()) {
+            if (read_only) {
+                throw std::runtime_error("No HMM model cache directory in read-only mode.");
+            }
+            LoadModel(modelPath);
+        } else {
+            LoadModelCached(modelPath, cache_dir, read_only);
+        }
+    }
+    void Load(const std::shared_ptr<const ModelContents>& contents) {
+        std::istringstream in(contents->hmm_model);
+        LoadModel(in, FastHash64::Hash(contents->hmm_model));
+    }
+    void Load(const std::shared_ptr<const ModelBundle>& bundle) {
+        bundle_ = bundle;
+        size_t size = 0;
+        const char* image = bundle->Section(BUNDLE_HMM, &size);
+
+        if (!image || size < sizeof(CacheHeader) ||
+            !Attach(image, size, reinterpret_cast<const CacheHeader*>(image)->model_hash)) {
+            throw std::runtime_error("Model bundle " + bundle->Path() + " has no valid HMM model");
+        }
     }
     ~HMMModel() {
     }
+    // These throw std::runtime_error on unreadable or malformed models, so
+    // that an owner loading on first use can report it and try again.
     void LoadModel(const string& filePath) {
         ifstream ifile(filePath.c_str());
-        XCHECK(ifile.is_open()) << "open " << filePath << " failed";
+        CheckModel(ifile.is_open(), "cannot open " + filePath);
+        LoadModel(ifile, 0);
+    }
+    void LoadModel(istream& ifile, uint64_t model_hash) {
         string line;
         vector<string> tmp;
         vector<string> tmp2;
         //Load startProb
-        XCHECK(GetLine(ifile, line));
+        CheckModel(GetLine(ifile, line), "no start probabilities");
         Split(line, tmp, " ");
-        XCHECK(tmp.size() == STATUS_SUM);
+        CheckModel(tmp.size() == STATUS_SUM, "start probabilities of " + std::to_string(tmp.size()) + " states");
 
         for (size_t j = 0; j < tmp.size(); j++) {
             startProb[j] = atof(tmp[j].c_str());
@@ -46,42 +102,66 @@ struct HMMModel {
 
         //Load transProb
         for (size_t i = 0; i < STATUS_SUM; i++) {
-            XCHECK(GetLine(ifile, line));
+            CheckModel(GetLine(ifile, line), "no transition probabilities");
             Split(line, tmp, " ");
-            XCHECK(tmp.size() == STATUS_SUM);
+            CheckModel(tmp.size() == STATUS_SUM,
+                       "transition probabilities of " + std::to_string(tmp.size()) + " states");
 
             for (size_t j = 0; j < tmp.size(); j++) {
                 transProb[i][j] = atof(tmp[j].c_str());
             }
         }
 
-        //Load emitProbB
-        XCHECK(GetLine(ifile, line));
-        XCHECK(LoadEmitProb(line, emitProbB));
+        EmitProbMap emitProb[STATUS_SUM];
 
-        //Load emitProbE
-        XCHECK(GetLine(ifile, line));
-        XCHECK(LoadEmitProb(line, emitProbE));
-
-        //Load emitProbM
-        XCHECK(GetLine(ifile, line));
-        XCHECK(LoadEmitProb(line, emitProbM));
+        //Load emitProbB, emitProbE, emitProbM, emitProbS
+        for (size_t i = 0; i < STATUS_SUM; i++) {
+            CheckModel(GetLine(ifile, line), "no emission probabilities");
+            CheckModel(LoadEmitProb(line, emitProb[i]), "malformed emission probabilities");
+        }
 
-        //Load emitProbS
-        XCHECK(GetLine(ifile, line));
-        XCHECK(LoadEmitProb(line, emitProbS));
+        BuildImage(emitProb, model_hash);
     }
-    double GetEmitProb(const EmitProbMap* ptMp, Rune key,
-                       double defVal)const {
-        EmitProbMap::const_iterator cit = ptMp->find(key);
 
-        if (cit == ptMp->end()) {
-            return defVal;
+    // Emission log-probabilities of rune in the B, E, M, S states.
+    const double* GetEmitRow(Rune rune) const {
+        size_t row = 0;
+
+        if (rune < BMP_SIZE) {
+            row = bmpRows_[rune];
+        } else {
+            const Rune* it = std::lower_bound(extraRunes_, extraRunes_ + extraNum_, rune);
+
+            if (it != extraRunes_ + extraNum_ && *it == rune) {
+                row = extraRows_[it - extraRunes_];
+            }
         }
 
-        return cit->second;
+        return emitRows_ + row * STATUS_SUM;
     }
-    bool GetLine(ifstream& ifile, string& line) {
+    double GetEmitProb(size_t status, Rune rune) const {
+        return GetEmitRow(rune)[status];
+    }
+
+    // whether the model was attached from its binary cache or a bundle
+    bool IsMapped() const {
+        return mapped_.Data() != NULL || bundle_;
+    }
+
+    // The binary cache the model is mapped from, empty if it is not
+    const string& GetCacheFile() const {
+        return cache_file_;
+    }
+
+    size_t GetCacheFileSize() const {
+        return mapped_.Size();
+    }
+
+    void WriteBundleSection(BundleWriter& writer) const {
+        writer.Add(BUNDLE_HMM, image_, imageSize_);
+    }
+
+    bool GetLine(istream& ifile, string& line) {
         while (getline(ifile, line)) {
             Trim(line);
 
@@ -98,6 +178,12 @@ struct HMMModel {
 
         return false;
     }
+    static void CheckModel(bool ok, const string& what) {
+        if (!ok) {
+            XLOG(ERROR) << "Invalid HMM model: " << what;
+            throw std::runtime_error("Invalid HMM model: " + what);
+        }
+    }
     bool LoadEmitProb(const string& line, EmitProbMap& mp) {
         if (line.empty()) {
             return false;
@@ -129,12 +215,197 @@ struct HMMModel {
     char statMap[STATUS_SUM];
     double startProb[STATUS_SUM];
     double transProb[STATUS_SUM][STATUS_SUM];
-    EmitProbMap emitProbB;
-    EmitProbMap emitProbE;
-    EmitProbMap emitProbM;
-    EmitProbMap emitProbS;
-    vector<EmitProbMap* > emitProbVec;
+
+private:
+    static const size_t BMP_SIZE = 0x10000;
+
+    // Image layout, the same in memory and in the cache file:
+    // header | uint16_t bmp rows[BMP_SIZE] | Rune extra runes[extra_num] (sorted, outside the BMP)
+    // | uint16_t extra rows[extra_num] | padding to 8 | double emit rows[rows_num][STATUS_SUM]
+    // Row 0 holds EMIT_PROB_MISSING for runes the model does not know.
+    struct CacheHeader {
+        uint32_t magic = HMM_CACHE_MAGIC;
+        uint32_t rows_num = 0;
+        uint64_t model_hash = 0;
+        uint32_t extra_num = 0;
+        uint32_t reserved = 0;
+        double start_prob[STATUS_SUM];
+        double trans_prob[STATUS_SUM][STATUS_SUM];
+    };
+
+    void InitStatMap() {
+        memset(startProb, 0, sizeof(startProb));
+        memset(transProb, 0, sizeof(transProb));
+        statMap[0] = 'B';
+        statMap[1] = 'E';
+        statMap[2] = 'M';
+        statMap[3] = 'S';
+    }
+
+    static size_t RowsOffset(size_t extra_num) {
+        const size_t end = sizeof(CacheHeader) + sizeof(uint16_t) * BMP_SIZE +
+                           (sizeof(Rune) + sizeof(uint16_t)) * extra_num;
+        return (end + 7) & ~size_t(7);
+    }
+
+    static size_t ImageSize(size_t extra_num, size_t rows_num) {
+        return RowsOffset(extra_num) + sizeof(double) * STATUS_SUM * rows_num;
+    }
+
+    void BuildImage(const EmitProbMap emitProb[STATUS_SUM], uint64_t model_hash) {
+        vector<Rune> runes;
+
+        for (size_t i = 0; i < STATUS_SUM; i++) {
+            for (const auto& kv : emitProb[i]) {
+                runes.push_back(kv.first);
+            }
+        }
+
+        std::sort(runes.begin(), runes.end());
+        runes.erase(std::unique(runes.begin(), runes.end()), runes.end());
+        CheckModel(runes.size() < 0xffff, "too many runes");
+
+        const size_t extra_num = runes.end() - std::lower_bound(runes.begin(), runes.end(), Rune(BMP_SIZE));
+        const size_t rows_num = runes.size() + 1;
+        owned_.assign((ImageSize(extra_num, rows_num) + sizeof(double) - 1) / sizeof(double), 0.0);
+        char* image = reinterpret_cast<char*>(owned_.data());
+
+        CacheHeader header;
+        header.rows_num = rows_num;
+        header.model_hash = model_hash;
+        header.extra_num = extra_num;
+        memcpy(header.start_prob, startProb, sizeof(startProb));
+        memcpy(header.trans_prob, transProb, sizeof(transProb));
+        memcpy(image, &header, sizeof(header));
+
+        uint16_t* bmp_rows = reinterpret_cast<uint16_t*>(image + sizeof(CacheHeader));
+        Rune* extra_runes = reinterpret_cast<Rune*>(bmp_rows + BMP_SIZE);
+        uint16_t* extra_rows = reinterpret_cast<uint16_t*>(extra_runes + extra_num);
+        double* rows = reinterpret_cast<double*>(image + RowsOffset(extra_num));
+
+        for (size_t i = 0; i < STATUS_SUM; i++) {
+            rows[i] = EMIT_PROB_MISSING;
+        }
+
+        for (size_t row = 1; row < rows_num; row++) {
+            const Rune rune = runes[row - 1];
+
+            for (size_t i = 0; i < STATUS_SUM; i++) {
+                const auto it = emitProb[i].find(rune);
+                rows[row * STATUS_SUM + i] = it == emitProb[i].end() ? EMIT_PROB_MISSING : it->second;
+            }
+
+            if (rune < BMP_SIZE) {
+                bmp_rows[rune] = row;
+            } else {
+                const size_t k = row - 1 - (runes.size() - extra_num);
+                extra_runes[k] = rune;
+                extra_rows[k] = row;
+            }
+        }
+
+        Attach(image, ImageSize(extra_num, rows_num), model_hash);
+    }
+
+    bool Attach(const char* image, size_t size, uint64_t model_hash) {
+        if (size < sizeof(CacheHeader)) {
+            return false;
+        }
+
+        const CacheHeader& header = *reinterpret_cast<const CacheHeader*>(image);
+
+        if (header.magic != HMM_CACHE_MAGIC || header.model_hash != model_hash || header.rows_num == 0 ||
+            size != ImageSize(header.extra_num, header.rows_num)) {
+            return false;
+        }
+
+        memcpy(startProb, header.start_prob, sizeof(startProb));
+        memcpy(transProb, header.trans_prob, sizeof(transProb));
+        bmpRows_ = reinterpret_cast<const uint16_t*>(image + sizeof(CacheHeader));
+        extraRunes_ = reinterpret_cast<const Rune*>(bmpRows_ + BMP_SIZE);
+        extraRows_ = reinterpret_cast<const uint16_t*>(extraRunes_ + header.extra_num);
+        extraNum_ = header.extra_num;
+        emitRows_ = reinterpret_cast<const double*>(image + RowsOffset(header.extra_num));
+        image_ = image;
+        imageSize_ = size;
+        return true;
+    }
+
+    void LoadModelCached(const string& modelPath, const string& cache_dir, bool read_only) {
+        ifstream ifile(modelPath.c_str(), std::ios::binary);
+        CheckModel(ifile.is_open(), "cannot open " + modelPath);
+        std::stringstream content;
+        content << ifile.rdbuf();
+        const string text = content.str();
+        const uint64_t model_hash = FastHash64::Hash(text);
+
+        char name[64];
+        snprintf(name, sizeof(name), "jieba_hmm_%016llx.bin", (unsigned long long)model_hash);
+        string path = cache_dir;
+        if (path.back() != '/' && path.back() != '\\') {
+            path += '/';
+        }
+        path += name;
+
+        if (mapped_.Open(path)) {
+            if (Attach(mapped_.Data(), mapped_.Size(), model_hash)) {
+                XLOG(DEBUG) << "Attached HMM model cache: " << path;
+                cache_file_ = path;
+                return;
+            }
+
+            mapped_.Close();
+        }
+
+        if (read_only) {
+            XLOG(ERROR) << "No HMM model cache to attach in read-only mode: " << path;
+            throw std::runtime_error("No HMM model cache " + path +
+                                     ", compile it with python -m cppjieba_py_dat.compile or jieba_compile.");
+        }
+
+        std::istringstream in(text);
+        LoadModel(in, model_hash);
+
+        // best effort: without a cache file this instance keeps its own copy
+        const string tmp_path = path + "." + std::to_string(reinterpret_cast<uintptr_t>(this)) + ".tmp";
+        const size_t size = ImageSize(extraNum_, reinterpret_cast<const CacheHeader*>(owned_.data())->rows_num);
+        {
+            std::ofstream out(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(owned_.data()), size);
+
+            if (!out.good()) {
+                XLOG(WARNING) << "failed to write HMM model cache " << tmp_path;
+                out.close();
+                ::remove(tmp_path.c_str());
+                return;
+            }
+        }
+
+        if (::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            ::remove(tmp_path.c_str()); // another process may have published it first
+        }
+
+        if (mapped_.Open(path) && Attach(mapped_.Data(), mapped_.Size(), model_hash)) {
+            vector<double>().swap(owned_);
+            XLOG(DEBUG) << "Built HMM model cache: " << path;
+            cache_file_ = path;
+        } else {
+            mapped_.Close();
+            Attach(reinterpret_cast<const char*>(owned_.data()), size, model_hash);
+        }
+    }
+
+    const uint16_t* bmpRows_ = NULL;
+    const Rune* extraRunes_ = NULL;
+    const uint16_t* extraRows_ = NULL;
+    size_t extraNum_ = 0;
+    const double* emitRows_ = NULL;
+    const char* image_ = NULL;
+    size_t imageSize_ = 0;
+    vector<double> owned_; // the image when it is not mapped
+    MappedFile mapped_;
+    string cache_file_;
+    std::shared_ptr<const ModelBundle> bundle_;
 }; // struct HMMModel
 
 } // namespace cppjieba
-
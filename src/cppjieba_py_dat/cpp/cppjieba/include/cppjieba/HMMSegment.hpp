@@ -8,22 +8,23 @@
 #include "SegmentBase.hpp"
 
 namespace cppjieba {
-class HMMSegment: public SegmentBase {
+class HMMSegment: public SegmentBase<HMMSegment> {
 public:
     HMMSegment(const HMMModel* model)
         : model_(model) {
     }
     ~HMMSegment() { }
 
-    virtual void Cut(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<WordRange>& res, bool,
-                     size_t) const override {
+    template <bool kHmm, bool kBoundedLen>
+    void Cut(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<WordRange>& res,
+             size_t, SegmentContext& ctx) const {
         RuneStrArray::const_iterator left = begin;
         RuneStrArray::const_iterator right = begin;
 
         while (right != end) {
             if (right->rune < 0x80) {
                 if (left != right) {
-                    InternalCut(left, right, res);
+                    InternalCut(left, right, res, ctx);
                 }
 
                 left = right;
@@ -53,7 +54,7 @@ public:
         }
 
         if (left != right) {
-            InternalCut(left, right, res);
+            InternalCut(left, right, res, ctx);
         }
     }
 private:
@@ -102,9 +103,10 @@ private:
 
         return begin;
     }
-    void InternalCut(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<WordRange>& res) const {
-        vector<size_t> status;
-        Viterbi(begin, end, status);
+    void InternalCut(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<WordRange>& res,
+                     SegmentContext& ctx) const {
+        vector<size_t>& status = ctx.status;
+        Viterbi(begin, end, status, ctx);
 
         RuneStrArray::const_iterator left = begin;
         RuneStrArray::const_iterator right;
@@ -121,7 +123,8 @@ private:
 
     void Viterbi(RuneStrArray::const_iterator begin,
                  RuneStrArray::const_iterator end,
-                 vector<size_t>& status) const {
+                 vector<size_t>& status,
+                 SegmentContext& ctx) const {
         size_t Y = HMMModel::STATUS_SUM;
         size_t X = end - begin;
 
@@ -129,23 +132,29 @@ private:
         size_t now, old, stat;
         double tmp, endE, endS;
 
-        vector<int> path(XYSize);
-        vector<double> weight(XYSize);
+        vector<int>& path = ctx.path;
+        vector<double>& weight = ctx.weight;
+        path.resize(XYSize);
+        weight.resize(XYSize);
 
         //start
+        const double* emitRow = model_->GetEmitRow(begin->rune);
+
         for (size_t y = 0; y < Y; y++) {
-            weight[0 + y * X] = model_->startProb[y] + model_->GetEmitProb(model_->emitProbVec[y], begin->rune, MIN_DOUBLE);
+            weight[0 + y * X] = model_->startProb[y] + emitRow[y];
             path[0 + y * X] = -1;
         }
 
         double emitProb;
 
         for (size_t x = 1; x < X; x++) {
+            emitRow = model_->GetEmitRow((begin + x)->rune);
+
             for (size_t y = 0; y < Y; y++) {
                 now = x + y * X;
                 weight[now] = MIN_DOUBLE;
                 path[now] = HMMModel::E; // warning
-                emitProb = model_->GetEmitProb(model_->emitProbVec[y], (begin + x)->rune, MIN_DOUBLE);
+                emitProb = emitRow[y];
 
                 for (size_t preY = 0; preY < Y; preY++) {
                     old = x - 1 + preY * X;
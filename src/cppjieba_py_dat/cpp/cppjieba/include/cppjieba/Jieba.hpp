@@ -1,11 +1,23 @@
 #pragma once
 
 #include <memory>
+#include <mutex>
 #include "QuerySegment.hpp"
 #include "KeywordExtractor.hpp"
 
 namespace cppjieba {
 
+// Components a Jieba loads on first use, see Jieba::Warmup
+enum JiebaComponent {
+    JIEBA_COMPONENT_HMM = 1,      // HMM model, for cuts with hmm and tagging
+    JIEBA_COMPONENT_KEYWORDS = 2, // IDF and stop words, for keyword extraction
+    JIEBA_COMPONENT_ALL = JIEBA_COMPONENT_HMM | JIEBA_COMPONENT_KEYWORDS,
+};
+
+// Only the dictionary is loaded by the constructors. The HMM model and the
+// keyword extractor are loaded the first time a call needs them, once even
+// when several threads get there together, so instances that only cut
+// without hmm never read them; Warmup loads them upfront.
 class Jieba {
 public:
     Jieba(const string& dict_path,
@@ -13,21 +25,58 @@ public:
           const string& user_dict_path,
           const string& idfPath = "",
           const string& stopWordPath = "",
-          const string& dat_cache_path = "")
-        : dict_trie_(dict_path, user_dict_path, dat_cache_path),
-          model_(model_path),
+          const string& dat_cache_path = "",
+          DictTrie::CacheValidation cache_validation = DictTrie::ValidateFast,
+          const MmapOptions& mmap_options = MmapOptions(),
+          DatElementFormat element_format = DAT_ELEMENTS_WIDE,
+          DatEngine engine = DAT_ENGINE_BYTES,
+          bool profiled_layout = false)
+        : dict_trie_(dict_path, user_dict_path, dat_cache_path, DictTrie::WordWeightMedian, cache_validation,
+                     mmap_options, element_format, engine, profiled_layout),
+          mp_seg_(&dict_trie_),
+          hmm_seg_(&model_),
+          mix_seg_(&dict_trie_, &model_),
+          full_seg_(&dict_trie_),
+          query_seg_(&dict_trie_, &model_),
+          model_path_(model_path),
+          model_cache_dir_(dat_cache_path),
+          model_read_only_(cache_validation == DictTrie::ValidateReadOnly),
+          idf_path_(idfPath),
+          stop_word_path_(stopWordPath) { }
+    // Dictionaries and HMM model from their contents, built in memory, see
+    // ModelContents.hpp
+    Jieba(const std::shared_ptr<const ModelContents>& contents,
+          const string& idfPath = "",
+          const string& stopWordPath = "",
+          const MmapOptions& mmap_options = MmapOptions(),
+          DatElementFormat element_format = DAT_ELEMENTS_WIDE,
+          DatEngine engine = DAT_ENGINE_BYTES)
+        : dict_trie_(contents, DictTrie::WordWeightMedian, mmap_options, element_format, engine),
           mp_seg_(&dict_trie_),
           hmm_seg_(&model_),
           mix_seg_(&dict_trie_, &model_),
           full_seg_(&dict_trie_),
           query_seg_(&dict_trie_, &model_),
-          extractor(&dict_trie_, &model_, idfPath, stopWordPath){ }
+          contents_(contents),
+          idf_path_(idfPath),
+          stop_word_path_(stopWordPath) { }
+    // Everything from one model bundle written by SaveBundle, see ModelBundle.hpp
+    explicit Jieba(const std::shared_ptr<const ModelBundle>& bundle)
+        : dict_trie_(bundle),
+          mp_seg_(&dict_trie_),
+          hmm_seg_(&model_),
+          mix_seg_(&dict_trie_, &model_),
+          full_seg_(&dict_trie_),
+          query_seg_(&dict_trie_, &model_),
+          bundle_(bundle) { }
     ~Jieba() { }
 
     void Cut(const string& sentence, vector<string>& words, bool hmm = true) const {
+        LoadModel(hmm);
         mix_seg_.CutToStr(sentence, words, hmm);
     }
     void Cut(const string& sentence, vector<Word>& words, bool hmm = true) const {
+        LoadModel(hmm);
         mix_seg_.CutToWord(sentence, words, hmm);
     }
     void CutAll(const string& sentence, vector<string>& words) const {
@@ -37,15 +86,71 @@ public:
         full_seg_.CutToWord(sentence, words);
     }
     void CutForSearch(const string& sentence, vector<string>& words, bool hmm = true) const {
+        LoadModel(hmm);
         query_seg_.CutToStr(sentence, words, hmm);
     }
     void CutForSearch(const string& sentence, vector<Word>& words, bool hmm = true) const {
+        LoadModel(hmm);
         query_seg_.CutToWord(sentence, words, hmm);
     }
+    // Overloads taking a SegmentContext reuse its buffers instead of allocating
+    // per call; keep one context per thread and pass it to every call.
+    void Cut(const string& sentence, vector<string>& words, bool hmm, SegmentContext& ctx) const {
+        LoadModel(hmm);
+        mix_seg_.CutToStr(sentence, words, hmm, MAX_WORD_LENGTH, ctx);
+    }
+    void CutAll(const string& sentence, vector<string>& words, SegmentContext& ctx) const {
+        full_seg_.CutToStr(sentence, words, true, MAX_WORD_LENGTH, ctx);
+    }
+    void CutForSearch(const string& sentence, vector<string>& words, bool hmm, SegmentContext& ctx) const {
+        LoadModel(hmm);
+        query_seg_.CutToStr(sentence, words, hmm, MAX_WORD_LENGTH, ctx);
+    }
+
+    // The *Ranges variants leave the words in ctx.wrs, as ranges over ctx.runes
+    // whose offsets index into sentence, without building any strings.
+    void CutRanges(const string& sentence, bool hmm, SegmentContext& ctx, size_t thread_num = 1) const {
+        LoadModel(hmm);
+        mix_seg_.CutToRanges(sentence, hmm, MAX_WORD_LENGTH, ctx, thread_num);
+    }
+    void CutAllRanges(const string& sentence, SegmentContext& ctx, size_t thread_num = 1) const {
+        full_seg_.CutToRanges(sentence, true, MAX_WORD_LENGTH, ctx, thread_num);
+    }
+    void CutForSearchRanges(const string& sentence, bool hmm, SegmentContext& ctx, size_t thread_num = 1) const {
+        LoadModel(hmm);
+        query_seg_.CutToRanges(sentence, hmm, MAX_WORD_LENGTH, ctx, thread_num);
+    }
+
+    // The *Parallel variants produce exactly the same words, cutting the
+    // separator-delimited pieces of a large sentence on up to thread_num threads.
+    void CutParallel(const string& sentence, vector<string>& words, size_t thread_num, bool hmm = true) const {
+        LoadModel(hmm);
+        mix_seg_.CutToStrParallel(sentence, words, thread_num, hmm);
+    }
+    void CutParallel(const string& sentence, vector<Word>& words, size_t thread_num, bool hmm = true) const {
+        LoadModel(hmm);
+        mix_seg_.CutToWordParallel(sentence, words, thread_num, hmm);
+    }
+    void CutAllParallel(const string& sentence, vector<string>& words, size_t thread_num) const {
+        full_seg_.CutToStrParallel(sentence, words, thread_num);
+    }
+    void CutAllParallel(const string& sentence, vector<Word>& words, size_t thread_num) const {
+        full_seg_.CutToWordParallel(sentence, words, thread_num);
+    }
+    void CutForSearchParallel(const string& sentence, vector<string>& words, size_t thread_num, bool hmm = true) const {
+        LoadModel(hmm);
+        query_seg_.CutToStrParallel(sentence, words, thread_num, hmm);
+    }
+    void CutForSearchParallel(const string& sentence, vector<Word>& words, size_t thread_num, bool hmm = true) const {
+        LoadModel(hmm);
+        query_seg_.CutToWordParallel(sentence, words, thread_num, hmm);
+    }
     void CutHMM(const string& sentence, vector<string>& words) const {
+        LoadModel(true);
         hmm_seg_.CutToStr(sentence, words);
     }
     void CutHMM(const string& sentence, vector<Word>& words) const {
+        LoadModel(true);
         hmm_seg_.CutToWord(sentence, words);
     }
     void CutSmall(const string& sentence, vector<string>& words, size_t max_word_len) const {
@@ -56,21 +161,56 @@ public:
     }
 
     void Tag(const string& sentence, vector<pair<string, string> >& words) const {
+        LoadModel(true);
         mix_seg_.Tag(sentence, words);
     }
     string LookupTag(const string &str) const {
         return mix_seg_.LookupTag(str);
     }
 
+    // Runtime insertions go to the dictionary's overlay, see DictTrie::InsertUserWord
     bool InsertUserWord(const string& word, const string& tag = UNKNOWN_TAG) {
-        return false;
+        return dict_trie_.InsertUserWord(word, tag);
     }
     bool InsertUserWord(const string& word,int freq, const string& tag = UNKNOWN_TAG) {
-        return false;
+        return dict_trie_.InsertUserWord(word, freq, tag);
+    }
+    void SetOverlayCompactThreshold(size_t threshold) {
+        dict_trie_.SetOverlayCompactThreshold(threshold);
+    }
+
+    // Hot reload of the dictionaries, see DictTrie::Reload
+    bool Reload(bool async = false) {
+        return dict_trie_.Reload(async);
+    }
+    bool ReloadUserDict(const string& user_dict_paths, bool async = false) {
+        return dict_trie_.ReloadUserDict(user_dict_paths, async);
+    }
+    void WaitForReload() {
+        dict_trie_.WaitForReload();
+    }
+
+    // Dictionary, user layer, HMM model, IDF and stop words as one bundle.
+    // Words from InsertUserWord are not saved.
+    void SaveBundle(const string& path) const {
+        BundleWriter writer;
+        BundleMeta meta;
+        memset(&meta, 0, sizeof(meta));
+        dict_trie_.WriteBundleSections(writer, meta);
+        GetHMMModel()->WriteBundleSection(writer);
+        GetKeywordExtractor().WriteBundleSections(writer, meta);
+        writer.Add(BUNDLE_META, &meta, sizeof(meta));
+        writer.Write(path);
+    }
+
+    // Main dictionary cache laid out for the words hot in a sample corpus,
+    // see DictTrie::SaveProfiledLayout
+    string SaveProfiledLayout(const string& corpus_paths) const {
+        return dict_trie_.SaveProfiledLayout(corpus_paths);
     }
 
     bool Find(const string& word) {
-        return nullptr != dict_trie_.Find(word);
+        return dict_trie_.Find(word);
     }
 
     void ResetSeparators(const string& s) {
@@ -82,17 +222,67 @@ public:
         query_seg_.ResetSeparators(s);
     }
 
+    bool SetRangeLimits(size_t max_range_len, size_t overlap = DEFAULT_RANGE_OVERLAP,
+                        size_t max_work_bytes = DEFAULT_MAX_WORK_BYTES) {
+        return mp_seg_.SetRangeLimits(max_range_len, overlap, max_work_bytes) &&
+               hmm_seg_.SetRangeLimits(max_range_len, overlap, max_work_bytes) &&
+               mix_seg_.SetRangeLimits(max_range_len, overlap, max_work_bytes) &&
+               full_seg_.SetRangeLimits(max_range_len, overlap, max_work_bytes) &&
+               query_seg_.SetRangeLimits(max_range_len, overlap, max_work_bytes);
+    }
+
     const DictTrie* GetDictTrie() const {
         return &dict_trie_;
     }
 
     const HMMModel* GetHMMModel() const {
+        LoadModel(true);
         return &model_;
     }
 
+    const KeywordExtractor& GetKeywordExtractor() const {
+        std::call_once(extractor_once_, [this]() {
+            LoadModel(true);
+            if (bundle_) {
+                extractor_.reset(new KeywordExtractor(&dict_trie_, &model_, bundle_));
+            } else {
+                extractor_.reset(new KeywordExtractor(&dict_trie_, &model_, idf_path_, stop_word_path_));
+            }
+        });
+        return *extractor_;
+    }
+
+    // Loads the given JiebaComponent flags now rather than on first use
+    void Warmup(int components = JIEBA_COMPONENT_ALL) const {
+        if (components & JIEBA_COMPONENT_HMM) {
+            LoadModel(true);
+        }
+        if (components & JIEBA_COMPONENT_KEYWORDS) {
+            GetKeywordExtractor();
+        }
+    }
+
 private:
+    // Loads model_ from wherever the constructor was given it, the first
+    // time a call may run the HMM. An unreadable model throws out of that
+    // call, and the next one tries again.
+    void LoadModel(bool hmm) const {
+        if (!hmm) {
+            return;
+        }
+        std::call_once(model_once_, [this]() {
+            if (bundle_) {
+                model_.Load(bundle_);
+            } else if (contents_) {
+                model_.Load(contents_);
+            } else {
+                model_.Load(model_path_, model_cache_dir_, model_read_only_);
+            }
+        });
+    }
+
     DictTrie dict_trie_;
-    HMMModel model_;
+    mutable HMMModel model_;
 
     // They share the same dict trie and model
     MPSegment mp_seg_;
@@ -101,8 +291,18 @@ private:
     FullSegment full_seg_;
     QuerySegment query_seg_;
 
-public:
-    KeywordExtractor extractor;
+    // Where model_ and the extractor are loaded from
+    std::shared_ptr<const ModelBundle> bundle_;
+    std::shared_ptr<const ModelContents> contents_;
+    string model_path_;
+    string model_cache_dir_;
+    bool model_read_only_ = false;
+    string idf_path_;
+    string stop_word_path_;
+
+    mutable std::once_flag model_once_;
+    mutable std::once_flag extractor_once_;
+    mutable std::unique_ptr<KeywordExtractor> extractor_;
 }; // class Jieba
 
 } // namespace cppjieba
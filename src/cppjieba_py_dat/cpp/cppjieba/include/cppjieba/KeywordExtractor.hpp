@@ -26,6 +26,14 @@ public:
         LoadIdfDict(idfPath);
         LoadStopWordDict(stopWordPath);
     }
+    // IDF and stop words looked up in the bundle's tries instead of hash maps
+    KeywordExtractor(const DictTrie* dictTrie,
+                     const HMMModel* model,
+                     const std::shared_ptr<const ModelBundle>& bundle)
+        : segment_(dictTrie, model), idfAverage_(bundle->Meta().idf_average), fromBundle_(true) {
+        idfTrie_.InitFromBundle(bundle, BUNDLE_IDF_ELEMENTS, BUNDLE_IDF_UNITS);
+        stopWordTrie_.InitFromBundle(bundle, BUNDLE_STOP_WORD_ELEMENTS, BUNDLE_STOP_WORD_UNITS);
+    }
     ~KeywordExtractor() {
     }
 
@@ -58,7 +66,7 @@ public:
             size_t t = offset;
             offset += words[i].size();
 
-            if (IsSingleWord(words[i]) || stopWords_.find(words[i]) != stopWords_.end()) {
+            if (IsSingleWord(words[i]) || IsStopWord(words[i])) {
                 continue;
             }
 
@@ -75,13 +83,7 @@ public:
         keywords.reserve(wordmap.size());
 
         for (map<string, Word>::iterator itr = wordmap.begin(); itr != wordmap.end(); ++itr) {
-            unordered_map<string, double>::const_iterator cit = idfMap_.find(itr->first);
-
-            if (cit != idfMap_.end()) {
-                itr->second.weight *= cit->second;
-            } else {
-                itr->second.weight *= idfAverage_;
-            }
+            itr->second.weight *= Idf(itr->first);
 
             itr->second.word = itr->first;
             keywords.push_back(itr->second);
@@ -91,7 +93,60 @@ public:
         partial_sort(keywords.begin(), keywords.begin() + topN, keywords.end(), Compare);
         keywords.resize(topN);
     }
+
+    // Adds the IDF and stop word tries to writer and fills in meta.idf_average.
+    void WriteBundleSections(BundleWriter& writer, BundleMeta& meta) const {
+        meta.idf_average = idfAverage_;
+
+        if (fromBundle_) {
+            idfTrie_.AddToBundle(writer, BUNDLE_IDF_ELEMENTS, BUNDLE_IDF_UNITS);
+            stopWordTrie_.AddToBundle(writer, BUNDLE_STOP_WORD_ELEMENTS, BUNDLE_STOP_WORD_UNITS);
+            return;
+        }
+
+        vector<DatElement> elements;
+        for (unordered_map<string, double>::const_iterator it = idfMap_.begin(); it != idfMap_.end(); ++it) {
+            if (!it->first.empty()) {
+                elements.push_back(DatElement());
+                elements.back().word = it->first;
+                elements.back().weight = it->second;
+            }
+        }
+
+        DatTrie idf_trie;
+        idf_trie.InitInMemory(elements);
+        idf_trie.AddToBundle(writer, BUNDLE_IDF_ELEMENTS, BUNDLE_IDF_UNITS);
+
+        elements.clear();
+        for (unordered_set<string>::const_iterator it = stopWords_.begin(); it != stopWords_.end(); ++it) {
+            if (!it->empty()) {
+                elements.push_back(DatElement());
+                elements.back().word = *it;
+            }
+        }
+
+        DatTrie stop_word_trie;
+        stop_word_trie.InitInMemory(elements);
+        stop_word_trie.AddToBundle(writer, BUNDLE_STOP_WORD_ELEMENTS, BUNDLE_STOP_WORD_UNITS);
+    }
 private:
+    double Idf(const string& word) const {
+        if (fromBundle_) {
+            DatMemElem elem;
+            return idfTrie_.Find(word, &elem) ? elem.weight : idfAverage_;
+        }
+
+        unordered_map<string, double>::const_iterator cit = idfMap_.find(word);
+        return cit != idfMap_.end() ? cit->second : idfAverage_;
+    }
+    bool IsStopWord(const string& word) const {
+        if (fromBundle_) {
+            return stopWordTrie_.Find(word);
+        }
+
+        return stopWords_.find(word) != stopWords_.end();
+    }
+
     void LoadIdfDict(const string& idfPath) {
         ifstream ifs(idfPath.c_str());
         if(not ifs.is_open()){
@@ -153,6 +208,10 @@ private:
     double idfAverage_;
 
     unordered_set<string> stopWords_;
+
+    bool fromBundle_ = false;
+    DatTrie idfTrie_;
+    DatTrie stopWordTrie_;
 }; // class KeywordExtractor
 
 inline ostream& operator << (ostream& os, const KeywordExtractor::Word& word) {
@@ -0,0 +1,541 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+#include "RuneDoubleArray.hpp"
+#include "Unicode.hpp"
+
+#if defined(_MSC_VER)
+#    include <intrin.h>
+#endif
+
+namespace cppjieba {
+
+// A succinct trie over runes for small memory budgets: the shape as a LOUDS
+// bit string of two bits a node, a terminal bit and a bit-packed label per
+// node, and bit-packed values, a few times smaller than a double array. A
+// transition costs a select on the bit string and a search among the
+// siblings' labels instead of one unit read.
+//
+// Nodes are numbered breadth first, the root 0. Each node in turn appends
+// one 1 per child and a 0 to the bit string, so a node's children are
+// consecutive, the first being the node whose 1 follows the previous node's 0.
+//
+// Image, usable in place from a mapping:
+//   LoudsTrieHeader | uint16_t bmp_codes[0x10000] | RuneCode extra[extra_num]
+//   | uint64_t bits[] | uint64_t leaves[] | uint64_t labels[] | uint64_t values[]
+//   | uint32_t selects[] | uint32_t zero_ranks[] | uint32_t leaf_ranks[]
+//   | int32_t value_table[value_table_num]
+// Codes number the runes in rune order from 1, so labels sort like keys.
+// leaves has a bit per node, set if a key ends there, and leaf_ranks[w]
+// counts the set bits before leaves[w]. selects[k] is the position of the
+// (k * kSelectStep)-th 0 in bits, zero_ranks[b] the number of 0s before
+// its block b of kBlockWords words. values holds the values of the terminal
+// nodes in node order, or indexes into value_table if that is not empty.
+struct LoudsTrieHeader {
+    uint32_t alphabet_num = 0;
+    uint32_t extra_num = 0;
+    uint32_t nodes_num = 0;
+    uint32_t values_num = 0; // terminal nodes
+    uint32_t label_bits = 0;
+    uint32_t value_bits = 0;
+    uint32_t value_table_num = 0;
+    uint32_t reserved = 0;
+};
+
+static_assert(sizeof(LoudsTrieHeader) == 32, "LoudsTrieHeader length invalid");
+
+class LoudsTrie {
+public:
+    static const size_t kBmpSize = 0x10000;
+    static const int32_t kRoot = 0;
+
+    bool Empty() const {
+        return bits_ == NULL;
+    }
+
+    // Builds over num UTF-8 keys sorted bytewise, i.e. by rune; of equal keys
+    // the first value is kept. Values must be non-negative. False if a key is
+    // no valid UTF-8 or the alphabet does not fit 16-bit codes.
+    bool Build(size_t num, const char* const* keys, const int* values) {
+        Clear();
+        if (num == 0) {
+            return false;
+        }
+
+        vector<uint32_t> codes;
+        vector<size_t> starts(1, 0);
+        RuneArray runes;
+
+        for (size_t i = 0; i < num; i++) {
+            if (!DecodeRunesInString(keys[i], runes)) {
+                return false;
+            }
+
+            codes.insert(codes.end(), runes.begin(), runes.end());
+            starts.push_back(codes.size());
+        }
+
+        vector<uint32_t> alphabet(codes);
+        std::sort(alphabet.begin(), alphabet.end());
+        alphabet.erase(std::unique(alphabet.begin(), alphabet.end()), alphabet.end());
+        if (alphabet.size() > 0xffff) {
+            return false;
+        }
+
+        vector<uint16_t> bmp_codes(kBmpSize, 0);
+        vector<RuneCode> extra;
+        for (size_t i = 0; i < alphabet.size(); i++) {
+            const RuneCode code = {alphabet[i], uint32_t(i + 1)};
+            if (code.rune < kBmpSize) {
+                bmp_codes[code.rune] = code.code;
+            } else {
+                extra.push_back(code);
+            }
+        }
+
+        for (size_t i = 0; i < codes.size(); i++) {
+            codes[i] = std::lower_bound(alphabet.begin(), alphabet.end(), codes[i]) - alphabet.begin() + 1;
+        }
+
+        LoudsTrieHeader header;
+        header.alphabet_num = alphabet.size();
+        header.extra_num = extra.size();
+        header.label_bits = BitsFor(alphabet.size());
+
+        Builder builder;
+        builder.Build(codes, starts, values, header);
+
+        image_.reserve(ImageSize(header));
+        Append(&header, sizeof(header));
+        Append(bmp_codes.data(), sizeof(uint16_t) * bmp_codes.size());
+        Append(extra.data(), sizeof(RuneCode) * extra.size());
+        Append(builder.bits.data(), sizeof(uint64_t) * builder.bits.size());
+        Append(builder.leaves.data(), sizeof(uint64_t) * builder.leaves.size());
+        Append(builder.labels.data(), sizeof(uint64_t) * builder.labels.size());
+        Append(builder.values.data(), sizeof(uint64_t) * builder.values.size());
+        Append(builder.selects.data(), sizeof(uint32_t) * builder.selects.size());
+        Append(builder.zero_ranks.data(), sizeof(uint32_t) * builder.zero_ranks.size());
+        Append(builder.leaf_ranks.data(), sizeof(uint32_t) * builder.leaf_ranks.size());
+        Append(builder.value_table.data(), sizeof(int32_t) * builder.value_table.size());
+        return Attach(image_.data(), image_.size());
+    }
+
+    // Uses an image in place, e.g. from a cache file; the memory must outlive
+    // this object or the next Attach/Clear.
+    bool Attach(const char* data, size_t size) {
+        if (size < sizeof(LoudsTrieHeader)) {
+            return false;
+        }
+
+        const LoudsTrieHeader& header = *reinterpret_cast<const LoudsTrieHeader*>(data);
+        if (header.nodes_num == 0 || header.alphabet_num > 0xffff || header.label_bits == 0 ||
+            header.label_bits > 16 || header.value_bits == 0 || header.value_bits > 32 ||
+            ImageSize(header) != size) {
+            return false;
+        }
+
+        header_ = &header;
+        bmp_codes_ = reinterpret_cast<const uint16_t*>(data + sizeof(header));
+        extra_ = reinterpret_cast<const RuneCode*>(bmp_codes_ + kBmpSize);
+        bits_ = reinterpret_cast<const uint64_t*>(extra_ + header.extra_num);
+        leaves_ = bits_ + BitsWords(header.nodes_num);
+        labels_ = leaves_ + WordsFor(header.nodes_num, 1);
+        values_ = labels_ + WordsFor(header.nodes_num, header.label_bits);
+        selects_ = reinterpret_cast<const uint32_t*>(values_ + WordsFor(header.values_num, header.value_bits));
+        zero_ranks_ = selects_ + SelectsNum(header.nodes_num);
+        leaf_ranks_ = zero_ranks_ + BlocksNum(header.nodes_num);
+        value_table_ = reinterpret_cast<const int32_t*>(leaf_ranks_ + WordsFor(header.nodes_num, 1));
+        return true;
+    }
+
+    void Clear() {
+        header_ = NULL;
+        bmp_codes_ = NULL;
+        extra_ = NULL;
+        bits_ = NULL;
+        leaves_ = NULL;
+        labels_ = NULL;
+        values_ = NULL;
+        selects_ = NULL;
+        zero_ranks_ = NULL;
+        leaf_ranks_ = NULL;
+        value_table_ = NULL;
+        string().swap(image_);
+    }
+
+    const char* Image() const {
+        return reinterpret_cast<const char*>(header_);
+    }
+
+    size_t ImageSize() const {
+        return header_ ? ImageSize(*header_) : 0;
+    }
+
+    // Child of node by rune, -1 if there is none
+    int32_t Child(int32_t node, Rune rune) const {
+        const uint32_t code = Code(rune);
+        if (code == 0) {
+            return -1;
+        }
+
+        // the 1s before the children's are those of nodes 1..first-1, the 0s
+        // those of nodes 0..node-1
+        const size_t begin = node == kRoot ? 0 : Select0(node - 1) + 1;
+        const size_t first = begin - node + 1;
+        const size_t num = ChildrenEnd(begin, node) - begin;
+        const size_t label_bits = header_->label_bits;
+
+        size_t lo = 0;
+        size_t hi = num;
+        while (hi - lo > kLinearLabels) {
+            const size_t mid = (lo + hi) / 2;
+            if (Unpack(labels_, label_bits, first + mid) < code) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        // the label at hi, if any, is not below code, so this stops by hi
+        for (; lo < num; lo++) {
+            const uint32_t label = Unpack(labels_, label_bits, first + lo);
+            if (label >= code) {
+                return label == code ? int32_t(first + lo) : -1;
+            }
+        }
+
+        return -1;
+    }
+
+    // Value of the key ending at node, -1 if none does
+    int32_t Value(int32_t node) const {
+        const size_t word = size_t(node) / 64;
+        const uint64_t bit = uint64_t(1) << (node % 64);
+        if (!(leaves_[word] & bit)) {
+            return -1;
+        }
+
+        const uint32_t value = Unpack(values_, header_->value_bits, leaf_ranks_[word] + PopCount(leaves_[word] & (bit - 1)));
+        return header_->value_table_num ? value_table_[value] : int32_t(value);
+    }
+
+    int32_t ExactMatch(const string& key) const {
+        RuneArray runes;
+        if (!DecodeRunesInString(key, runes)) {
+            return -1;
+        }
+
+        int32_t node = kRoot;
+        for (size_t i = 0; i < runes.size() && node >= 0; i++) {
+            node = Child(node, runes[i]);
+        }
+
+        return node >= 0 ? Value(node) : -1;
+    }
+
+private:
+    static const size_t kSelectStep = 64;
+    static const size_t kBlockWords = 8;
+    static const size_t kLinearLabels = 8; // sibling ranges searched without bisecting
+
+    // The LOUDS bit string of nodes_num nodes has 2 * nodes_num - 1 bits
+    static size_t BitsWords(size_t nodes_num) {
+        return (2 * nodes_num + 62) / 64;
+    }
+
+    static size_t WordsFor(size_t num, size_t bits) {
+        return (num * bits + 63) / 64;
+    }
+
+    static size_t SelectsNum(size_t nodes_num) {
+        return (nodes_num + kSelectStep - 1) / kSelectStep;
+    }
+
+    static size_t BlocksNum(size_t nodes_num) {
+        return (BitsWords(nodes_num) + kBlockWords - 1) / kBlockWords;
+    }
+
+    // Bits to store values up to max, at least one
+    static uint32_t BitsFor(uint64_t max) {
+        uint32_t bits = 1;
+        while (bits < 64 && (max >> bits) != 0) {
+            bits++;
+        }
+        return bits;
+    }
+
+    static size_t ImageSize(const LoudsTrieHeader& header) {
+        const size_t nodes_num = header.nodes_num;
+        return sizeof(header) + sizeof(uint16_t) * kBmpSize + sizeof(RuneCode) * header.extra_num +
+               sizeof(uint64_t) * (BitsWords(nodes_num) + WordsFor(nodes_num, 1) +
+                                   WordsFor(nodes_num, header.label_bits) +
+                                   WordsFor(header.values_num, header.value_bits)) +
+               sizeof(uint32_t) * (SelectsNum(nodes_num) + BlocksNum(nodes_num) + WordsFor(nodes_num, 1)) +
+               sizeof(int32_t) * size_t(header.value_table_num);
+    }
+
+    void Append(const void* data, size_t size) {
+        image_.append(static_cast<const char*>(data), size);
+    }
+
+    uint32_t Code(Rune rune) const {
+        if (rune < kBmpSize) {
+            return bmp_codes_[rune];
+        }
+
+        const RuneCode key = {rune, 0};
+        const RuneCode* end = extra_ + header_->extra_num;
+        const RuneCode* it = std::lower_bound(extra_, end, key);
+        return it != end && it->rune == rune ? it->code : 0;
+    }
+
+    // Entry i of an array of bits-wide fields, bits at most 32
+    static uint32_t Unpack(const uint64_t* words, size_t bits, size_t i) {
+        const size_t pos = i * bits;
+        const size_t shift = pos % 64;
+        uint64_t field = words[pos / 64] >> shift;
+
+        if (shift + bits > 64) {
+            field |= words[pos / 64 + 1] << (64 - shift);
+        }
+
+        return uint32_t(field & ((uint64_t(1) << bits) - 1));
+    }
+
+    static void Pack(vector<uint64_t>& words, size_t bits, size_t i, uint64_t field) {
+        const size_t pos = i * bits;
+        const size_t shift = pos % 64;
+        words[pos / 64] |= field << shift;
+
+        if (shift + bits > 64) {
+            words[pos / 64 + 1] |= field >> (64 - shift);
+        }
+    }
+
+    // Position of the k-th 0, counting from 0: the samples around it bound
+    // the blocks to bisect, then the words of its block are counted through.
+    // Long runs of 1s, the children of nodes near the root, cost a few more
+    // bisection steps instead of a scan.
+    size_t Select0(size_t k) const {
+        const size_t sample = k / kSelectStep;
+        size_t lo = selects_[sample] / 64 / kBlockWords;
+        size_t hi = sample + 1 < SelectsNum(header_->nodes_num) ? selects_[sample + 1] / 64 / kBlockWords
+                                                                 : BlocksNum(header_->nodes_num) - 1;
+
+        while (lo < hi) {
+            const size_t mid = (lo + hi + 1) / 2;
+            if (zero_ranks_[mid] <= k) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+
+        size_t rest = k - zero_ranks_[lo];
+        size_t word = lo * kBlockWords;
+        uint64_t zeros = ~bits_[word];
+
+        for (size_t num = PopCount(zeros); rest >= num; num = PopCount(zeros)) {
+            rest -= num;
+            zeros = ~bits_[++word];
+        }
+
+        return word * 64 + SelectInWord(zeros, rest);
+    }
+
+    // End of the children of node, which begin at pos: the next 0, in pos's
+    // word for all but large sibling sets
+    size_t ChildrenEnd(size_t pos, size_t node) const {
+        const uint64_t zeros = ~bits_[pos / 64] & (~uint64_t(0) << (pos % 64));
+        return zeros ? pos / 64 * 64 + CountTrailingZeros(zeros) : Select0(node);
+    }
+
+    // The builtin is a library call unless the target has the instruction
+    static size_t PopCount(uint64_t x) {
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__POPCNT__)
+        return __builtin_popcountll(x);
+#elif defined(_MSC_VER) && defined(_M_X64) && defined(__AVX__)
+        return __popcnt64(x);
+#else
+        x = x - ((x >> 1) & 0x5555555555555555ULL);
+        x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+        x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        return (x * 0x0101010101010101ULL) >> 56;
+#endif
+    }
+
+    static size_t CountTrailingZeros(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+        unsigned long index = 0;
+        _BitScanForward64(&index, x);
+        return index;
+#else
+        size_t n = 0;
+        for (; !(x & 1); x >>= 1) {
+            n++;
+        }
+        return n;
+#endif
+    }
+
+    // Position of the k-th set bit of x, which has more than k
+    static size_t SelectInWord(uint64_t x, size_t k) {
+        size_t shift = 0;
+        for (size_t num = PopCount(x & 0xff); k >= num; num = PopCount((x >> shift) & 0xff)) {
+            k -= num;
+            shift += 8;
+        }
+
+        for (x >>= shift; k > 0; k--) {
+            x &= x - 1;
+        }
+
+        return shift + CountTrailingZeros(x);
+    }
+
+    // Lays the nodes out level by level, then packs labels and values
+    struct Builder {
+        vector<uint64_t> bits;
+        vector<uint64_t> leaves;
+        vector<uint64_t> labels;
+        vector<uint64_t> values;
+        vector<uint32_t> selects;
+        vector<uint32_t> zero_ranks;
+        vector<uint32_t> leaf_ranks;
+        vector<int32_t> value_table;
+
+        // Fills in the node, value and value width fields of header
+        void Build(const vector<uint32_t>& codes, const vector<size_t>& starts, const int* values_in,
+                   LoudsTrieHeader& header) {
+            typedef std::pair<size_t, size_t> Range; // keys below a node
+
+            vector<Range> level(1, Range(0, starts.size() - 1));
+            vector<Range> next_level;
+            vector<uint16_t> node_labels(1, 0);
+            vector<int32_t> node_values;
+            size_t bits_num = 0;
+
+            for (size_t depth = 0; !level.empty(); depth++) {
+                next_level.clear();
+
+                for (size_t k = 0; k < level.size(); k++) {
+                    const size_t node = nodes_num_++;
+                    size_t i = level[k].first;
+                    const size_t hi = level[k].second;
+
+                    if (starts[i + 1] - starts[i] == depth) {
+                        SetBit(leaves, node);
+                        node_values.push_back(values_in[i]);
+                        while (i < hi && starts[i + 1] - starts[i] == depth) {
+                            i++;
+                        }
+                    }
+
+                    while (i < hi) {
+                        const uint32_t code = codes[starts[i] + depth];
+                        const size_t lo = i;
+                        while (i < hi && codes[starts[i] + depth] == code) {
+                            i++;
+                        }
+
+                        next_level.push_back(Range(lo, i));
+                        node_labels.push_back(uint16_t(code));
+                        SetBit(bits, bits_num++);
+                    }
+
+                    if (node % kSelectStep == 0) {
+                        selects.push_back(uint32_t(bits_num));
+                    }
+                    bits_num++;
+                }
+
+                level.swap(next_level);
+            }
+
+            header.nodes_num = nodes_num_;
+            header.values_num = node_values.size();
+            bits.resize(BitsWords(nodes_num_), 0);
+
+            uint32_t zeros = 0;
+            for (size_t w = 0; w < bits.size(); w++) {
+                if (w % kBlockWords == 0) {
+                    zero_ranks.push_back(zeros);
+                }
+                zeros += 64 - PopCount(bits[w]);
+            }
+            leaves.resize(WordsFor(nodes_num_, 1), 0);
+
+            uint32_t rank = 0;
+            for (size_t w = 0; w < leaves.size(); w++) {
+                leaf_ranks.push_back(rank);
+                rank += PopCount(leaves[w]);
+            }
+
+            labels.assign(WordsFor(nodes_num_, header.label_bits), 0);
+            for (size_t i = 0; i < node_labels.size(); i++) {
+                Pack(labels, header.label_bits, i, node_labels[i]);
+            }
+
+            PackValues(node_values, header);
+        }
+
+    private:
+        // Values go in as they are or as indexes into a table of the
+        // distinct ones, whichever is smaller
+        void PackValues(const vector<int32_t>& node_values, LoudsTrieHeader& header) {
+            vector<int32_t> table(node_values);
+            std::sort(table.begin(), table.end());
+            table.erase(std::unique(table.begin(), table.end()), table.end());
+
+            const uint32_t raw_bits = BitsFor(table.empty() ? 0 : uint32_t(table.back()));
+            const uint32_t index_bits = BitsFor(table.empty() ? 0 : table.size() - 1);
+            const bool indexed = WordsFor(node_values.size(), index_bits) * 64 + table.size() * 32 <
+                                 WordsFor(node_values.size(), raw_bits) * 64;
+
+            header.value_bits = indexed ? index_bits : raw_bits;
+            values.assign(WordsFor(node_values.size(), header.value_bits), 0);
+            for (size_t i = 0; i < node_values.size(); i++) {
+                const uint32_t value =
+                    indexed ? std::lower_bound(table.begin(), table.end(), node_values[i]) - table.begin()
+                            : uint32_t(node_values[i]);
+                Pack(values, header.value_bits, i, value);
+            }
+
+            if (indexed) {
+                value_table.swap(table);
+                header.value_table_num = value_table.size();
+            }
+        }
+
+        static void SetBit(vector<uint64_t>& words, size_t pos) {
+            if (pos / 64 >= words.size()) {
+                words.resize(pos / 64 + 1, 0);
+            }
+            words[pos / 64] |= uint64_t(1) << (pos % 64);
+        }
+
+        size_t nodes_num_ = 0;
+    }; // struct Builder
+
+    const LoudsTrieHeader* header_ = NULL;
+    const uint16_t* bmp_codes_ = NULL;
+    const RuneCode* extra_ = NULL;
+    const uint64_t* bits_ = NULL;
+    const uint64_t* leaves_ = NULL;
+    const uint64_t* labels_ = NULL;
+    const uint64_t* values_ = NULL;
+    const uint32_t* selects_ = NULL;
+    const uint32_t* zero_ranks_ = NULL;
+    const uint32_t* leaf_ranks_ = NULL;
+    const int32_t* value_table_ = NULL;
+    string image_; // built here rather than attached
+}; // class LoudsTrie
+
+} // namespace cppjieba
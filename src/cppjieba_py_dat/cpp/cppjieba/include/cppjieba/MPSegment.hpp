@@ -10,7 +10,7 @@
 
 namespace cppjieba {
 
-class MPSegment: public SegmentTagged {
+class MPSegment: public SegmentTagged<MPSegment> {
 public:
     MPSegment(const DictTrie* dictTrie)
         : dictTrie_(dictTrie) {
@@ -18,39 +18,39 @@ public:
     }
     ~MPSegment() { }
 
-    virtual void Cut(RuneStrArray::const_iterator begin,
-                     RuneStrArray::const_iterator end,
-                     vector<WordRange>& words,
-                     bool, size_t max_word_len) const override {
-        vector<DatDag> dags;
-        dictTrie_->Find(begin, end, dags, max_word_len);
+    template <bool kHmm, bool kBoundedLen>
+    void Cut(RuneStrArray::const_iterator begin,
+             RuneStrArray::const_iterator end,
+             vector<WordRange>& words,
+             size_t max_word_len, SegmentContext& ctx) const {
+        vector<DatDag>& dags = ctx.dags;
+        const auto pin = dictTrie_->Pin(); // DAG weights and min weight from the same layers
+        dictTrie_->Find<kBoundedLen>(begin, end, dags, max_word_len, ctx.text);
         CalcDP(dags);
         CutByDag(begin, end, dags, words);
     }
 
-    const DictTrie* GetDictTrie() const override {
+    const DictTrie* GetDictTrie() const {
         return dictTrie_;
     }
 
-    bool Tag(const string& src, vector<pair<string, string> >& res) const override {
-        return tagger_.Tag(src, res, *this);
-    }
-
     bool IsUserDictSingleChineseWord(const Rune& value) const {
         return dictTrie_->IsUserDictSingleChineseWord(value);
     }
 private:
     void CalcDP(vector<DatDag>& dags) const {
+        const double min_weight = dictTrie_->GetMinWeight();
+
         for (auto rit = dags.rbegin(); rit != dags.rend(); rit++) {
             rit->max_next = -1;
             rit->max_weight = MIN_DOUBLE;
 
             for (const auto & it : rit->nexts) {
-                const auto nextPos = it.first;
-                double val = dictTrie_->GetMinWeight();
+                const auto nextPos = it.end;
+                double val = it.weight;
 
-                if (nullptr != it.second) {
-                    val = it.second->weight;
+                if (DAG_NO_WORD == val) {
+                    val = min_weight;
                 }
 
                 if (nextPos  < dags.size()) {
@@ -81,7 +81,6 @@ private:
     }
 
     const DictTrie* dictTrie_;
-    PosTagger tagger_;
 
 }; // class MPSegment
 
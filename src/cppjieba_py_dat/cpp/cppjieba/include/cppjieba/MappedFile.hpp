@@ -0,0 +1,242 @@
+#pragma once
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#if defined(_WIN32) || defined(_WIN64)
+#    include <windows.h>
+#else
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+#include "limonp/Logging.hpp"
+
+namespace cppjieba {
+
+// Hints applied to read-only mappings once they are attached, so the first
+// lookups after a deploy do not page-fault their way through the trie.
+// Unsupported hints are skipped and failures only logged.
+struct MmapOptions {
+    enum Prefetch {
+        PrefetchNone,
+        PrefetchWillNeed, // MADV_WILLNEED, readahead in the background
+        PrefetchPopulate, // fault every page in before returning, like MAP_POPULATE
+    };
+    enum Access {
+        AccessNormal,
+        AccessRandom,     // MADV_RANDOM, no readahead around faults
+        AccessSequential, // MADV_SEQUENTIAL
+    };
+
+    Prefetch prefetch = PrefetchNone;
+    Access access = AccessNormal;
+    bool huge_pages = false; // MADV_HUGEPAGE, needs THP for file mappings in the kernel
+    bool lock = false;       // mlock, bounded by RLIMIT_MEMLOCK
+
+    bool Empty() const {
+        return prefetch == PrefetchNone && access == AccessNormal && !huge_pages && !lock;
+    }
+};
+
+// Pages of some mappings currently resident in memory (mincore). Always
+// zero where mincore is not available.
+struct Residency {
+    size_t resident_pages = 0;
+    size_t total_pages = 0;
+};
+
+inline size_t MmapPageSize() {
+#if defined(_WIN32) || defined(_WIN64)
+    SYSTEM_INFO info;
+    ::GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return ::sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Applies options to the pages covering [data, data + size).
+inline void AdviseMapping(const void* data, size_t size, const MmapOptions& options) {
+    if (!data || size == 0 || options.Empty()) {
+        return;
+    }
+
+    const size_t page = MmapPageSize();
+    char* begin = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(data) & ~uintptr_t(page - 1));
+    const size_t len = static_cast<const char*>(data) + size - begin;
+#if defined(_WIN32) || defined(_WIN64)
+    if (options.lock && !::VirtualLock(begin, len)) {
+        XLOG(WARNING) << "VirtualLock of " << len << " bytes failed, error code: " << ::GetLastError();
+    }
+#else
+    if (options.access != MmapOptions::AccessNormal &&
+        ::madvise(begin, len, options.access == MmapOptions::AccessRandom ? MADV_RANDOM : MADV_SEQUENTIAL) != 0) {
+        XLOG(WARNING) << "madvise access hint failed, errno: " << errno;
+    }
+#    ifdef MADV_HUGEPAGE
+    if (options.huge_pages && ::madvise(begin, len, MADV_HUGEPAGE) != 0) {
+        XLOG(WARNING) << "madvise(MADV_HUGEPAGE) failed, errno: " << errno;
+    }
+#    endif
+    if (options.prefetch == MmapOptions::PrefetchWillNeed && ::madvise(begin, len, MADV_WILLNEED) != 0) {
+        XLOG(WARNING) << "madvise(MADV_WILLNEED) failed, errno: " << errno;
+    }
+    if (options.lock && ::mlock(begin, len) != 0) {
+        XLOG(WARNING) << "mlock of " << len << " bytes failed, errno: " << errno;
+    }
+#endif
+    if (options.prefetch == MmapOptions::PrefetchPopulate) {
+#if defined(MADV_POPULATE_READ)
+        if (::madvise(begin, len, MADV_POPULATE_READ) == 0) {
+            return;
+        }
+#endif
+        // the mapping already exists, so MAP_POPULATE is not an option: touch it
+        volatile char sink = 0;
+        for (size_t off = 0; off < len; off += page) {
+            sink ^= begin[off];
+        }
+        (void)sink;
+    }
+}
+
+// Adds the pages covering [data, data + size) to residency.
+inline void AddResidency(const void* data, size_t size, Residency& residency) {
+    if (!data || size == 0) {
+        return;
+    }
+
+    const size_t page = MmapPageSize();
+    char* begin = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(data) & ~uintptr_t(page - 1));
+    const size_t pages = (static_cast<const char*>(data) + size - begin + page - 1) / page;
+    residency.total_pages += pages;
+#if !defined(_WIN32) && !defined(_WIN64)
+#    if defined(__linux__)
+    std::vector<unsigned char> vec(pages);
+#    else
+    std::vector<char> vec(pages);
+#    endif
+    if (::mincore(begin, pages * page, vec.data()) != 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < pages; i++) {
+        residency.resident_pages += vec[i] & 1;
+    }
+#endif
+}
+
+// A whole file mapped read-only and shared, so every process mapping the
+// same file uses the same physical pages.
+class MappedFile {
+public:
+    MappedFile() {}
+    ~MappedFile() {
+        Close();
+    }
+
+    bool Open(const std::string& path) {
+        Close();
+#if defined(_WIN32) || defined(_WIN64)
+        file_ = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_ATTRIBUTE_READONLY, NULL);
+        if (INVALID_HANDLE_VALUE == file_) {
+            file_ = NULL;
+            return false;
+        }
+
+        LARGE_INTEGER file_size;
+        if (!::GetFileSizeEx(file_, &file_size) || file_size.QuadPart == 0) {
+            Close();
+            return false;
+        }
+
+        map_ = ::CreateFileMapping(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!map_) {
+            Close();
+            return false;
+        }
+
+        data_ = static_cast<const char*>(::MapViewOfFile(map_, FILE_MAP_READ, 0, 0, 0));
+        if (!data_) {
+            Close();
+            return false;
+        }
+
+        size_ = static_cast<size_t>(file_size.QuadPart);
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+
+        void* addr = ::mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if (MAP_FAILED == addr) {
+            return false;
+        }
+
+        data_ = static_cast<const char*>(addr);
+        size_ = st.st_size;
+#endif
+        return true;
+    }
+
+    void Close() {
+#if defined(_WIN32) || defined(_WIN64)
+        if (data_) {
+            ::UnmapViewOfFile(data_);
+        }
+        if (map_) {
+            ::CloseHandle(map_);
+        }
+        if (file_) {
+            ::CloseHandle(file_);
+        }
+        map_ = NULL;
+        file_ = NULL;
+#else
+        if (data_) {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+        data_ = NULL;
+        size_ = 0;
+    }
+
+    const char* Data() const {
+        return data_;
+    }
+
+    void Advise(const MmapOptions& options) const {
+        AdviseMapping(data_, size_, options);
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const char* data_ = NULL;
+    size_t size_ = 0;
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE file_ = NULL;
+    HANDLE map_ = NULL;
+#endif
+}; // class MappedFile
+
+} // namespace cppjieba
@@ -7,26 +7,29 @@
 #include "PosTagger.hpp"
 
 namespace cppjieba {
-class MixSegment: public SegmentTagged {
+class MixSegment: public SegmentTagged<MixSegment> {
 public:
     MixSegment(const DictTrie* dictTrie, const HMMModel* model)
         : mpSeg_(dictTrie), hmmSeg_(model) {
     }
     ~MixSegment() {}
 
-    virtual void Cut(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<WordRange>& res, bool hmm,
-                     size_t) const override {
-        if (!hmm) {
-            mpSeg_.CutRuneArray(begin, end, res);
+    template <bool kHmm, bool kBoundedLen>
+    void Cut(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<WordRange>& res,
+             size_t, SegmentContext& ctx) const {
+        if (!kHmm) {
+            mpSeg_.Cut<false, false>(begin, end, res, MAX_WORD_LENGTH, ctx);
             return;
         }
 
-        vector<WordRange> words;
+        vector<WordRange>& words = ctx.mp_res;
         assert(end >= begin);
+        words.clear();
         words.reserve(end - begin);
-        mpSeg_.CutRuneArray(begin, end, words);
+        mpSeg_.Cut<false, false>(begin, end, words, MAX_WORD_LENGTH, ctx);
 
-        vector<WordRange> hmmRes;
+        vector<WordRange>& hmmRes = ctx.hmm_res;
+        hmmRes.clear();
         hmmRes.reserve(end - begin);
 
         for (size_t i = 0; i < words.size(); i++) {
@@ -48,7 +51,7 @@ public:
             // Cut the sequence with hmm
             assert(j - 1 >= i);
             // TODO
-            hmmSeg_.CutRuneArray(words[i].left, words[j - 1].left + 1, hmmRes);
+            hmmSeg_.Cut<true, false>(words[i].left, words[j - 1].left + 1, hmmRes, MAX_WORD_LENGTH, ctx);
 
             //put hmm result to result
             for (size_t k = 0; k < hmmRes.size(); k++) {
@@ -63,22 +66,13 @@ public:
         }
     }
 
-    const DictTrie* GetDictTrie() const override {
+    const DictTrie* GetDictTrie() const {
         return mpSeg_.GetDictTrie();
     }
 
-    bool Tag(const string& src, vector<pair<string, string> >& res) const override {
-        return tagger_.Tag(src, res, *this);
-    }
-
-    string LookupTag(const string &str) const {
-        return tagger_.LookupTag(str, *this);
-    }
-
 private:
     MPSegment mpSeg_;
     HMMSegment hmmSeg_;
-    PosTagger tagger_;
 
 }; // class MixSegment
 
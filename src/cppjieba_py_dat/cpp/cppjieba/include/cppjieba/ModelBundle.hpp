@@ -0,0 +1,276 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "MappedFile.hpp"
+
+namespace cppjieba {
+
+// One file holding everything a Jieba needs, mapped with a single mmap:
+//
+//   BundleHeader | BundleSection[section_num] | sections, each 64-byte aligned
+//
+// Readers reject other magics, versions and byte orders instead of
+// misreading them; a section they do not know is ignored, a missing one is
+// an error for whoever needs it.
+const char BUNDLE_MAGIC[8] = {'J', 'I', 'E', 'B', 'A', 'B', 'N', 'D'};
+const uint32_t BUNDLE_VERSION = 1;
+const uint32_t BUNDLE_ENDIAN_TAG = 0x01020304; // as written by the producing machine
+const size_t BUNDLE_SECTION_ALIGN = 64;
+
+enum BundleSectionId {
+    BUNDLE_META = 1,               // BundleMeta
+    BUNDLE_DICT_ELEMENTS = 2,      // DatMemElem[], main dictionary
+    BUNDLE_DICT_UNITS = 3,         // darts units, main dictionary
+    BUNDLE_USER_ELEMENTS = 4,      // user layer, absent without user words
+    BUNDLE_USER_UNITS = 5,
+    BUNDLE_USER_SINGLE_WORDS = 6,  // Rune[], single-character user words
+    BUNDLE_HMM = 7,                // HMMModel image
+    BUNDLE_IDF_ELEMENTS = 8,       // DatMemElem[] with the IDF as weight
+    BUNDLE_IDF_UNITS = 9,
+    BUNDLE_STOP_WORD_ELEMENTS = 10,
+    BUNDLE_STOP_WORD_UNITS = 11,
+    BUNDLE_DICT_WEIGHTS = 12,      // double[], main dictionary with values inline instead of DICT_ELEMENTS
+    BUNDLE_DICT_TAGS = 13,         // DatTag[]
+    BUNDLE_DICT_RUNE_UNITS = 14,   // RuneDoubleArray image, main dictionary instead of DICT_UNITS
+    BUNDLE_DICT_LOUDS_UNITS = 15,  // LoudsTrie image, likewise
+};
+
+struct BundleHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_tag;
+    uint32_t section_num;
+    uint32_t reserved;
+    uint64_t file_size;
+};
+
+struct BundleSection {
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct BundleMeta {
+    double min_weight;
+    double freq_sum;
+    double user_word_default_weight;
+    double idf_average;
+    uint64_t total_dict_size;
+    uint32_t user_word_weight_opt;
+    uint32_t dict_words_num; // with BUNDLE_DICT_WEIGHTS
+};
+
+static_assert(sizeof(BundleHeader) == 32, "BundleHeader length invalid");
+static_assert(sizeof(BundleSection) == 24, "BundleSection length invalid");
+
+// Collects sections and writes them out as one file, atomically replacing
+// any previous one.
+class BundleWriter {
+public:
+    void Add(uint32_t id, const void* data, size_t size) {
+        Section section;
+        section.id = id;
+        section.data.assign(static_cast<const char*>(data), static_cast<const char*>(data) + size);
+        sections_.push_back(section);
+    }
+
+    void Write(const std::string& path) const {
+        BundleHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+        header.version = BUNDLE_VERSION;
+        header.endian_tag = BUNDLE_ENDIAN_TAG;
+        header.section_num = sections_.size();
+
+        std::vector<BundleSection> directory(sections_.size());
+        uint64_t offset = Align(sizeof(header) + sizeof(BundleSection) * sections_.size());
+
+        for (size_t i = 0; i < sections_.size(); i++) {
+            memset(&directory[i], 0, sizeof(directory[i]));
+            directory[i].id = sections_[i].id;
+            directory[i].offset = offset;
+            directory[i].size = sections_[i].data.size();
+            offset = Align(offset + sections_[i].data.size());
+        }
+
+        header.file_size = offset;
+
+        const std::string tmp_path = path + "." + std::to_string(reinterpret_cast<uintptr_t>(this)) + ".tmp";
+        {
+            std::ofstream out(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(directory.data()), sizeof(BundleSection) * directory.size());
+
+            for (size_t i = 0; i < sections_.size(); i++) {
+                Pad(out, directory[i].offset);
+                out.write(sections_[i].data.data(), sections_[i].data.size());
+            }
+
+            Pad(out, header.file_size);
+
+            if (!out.good()) {
+                out.close();
+                ::remove(tmp_path.c_str());
+                throw std::runtime_error("Failed to write model bundle " + tmp_path);
+            }
+        }
+
+#if defined(_WIN32) || defined(_WIN64)
+        if (!::MoveFileExA(tmp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+#else
+        if (::rename(tmp_path.c_str(), path.c_str()) != 0) {
+#endif
+            ::remove(tmp_path.c_str());
+            throw std::runtime_error("Failed to rename model bundle to " + path);
+        }
+    }
+
+private:
+    struct Section {
+        uint32_t id;
+        std::vector<char> data;
+    };
+
+    static uint64_t Align(uint64_t offset) {
+        return (offset + BUNDLE_SECTION_ALIGN - 1) & ~uint64_t(BUNDLE_SECTION_ALIGN - 1);
+    }
+
+    static void Pad(std::ofstream& out, uint64_t offset) {
+        static const char zeros[BUNDLE_SECTION_ALIGN] = {};
+        const uint64_t pos = out.tellp();
+
+        if (pos < offset) {
+            out.write(zeros, offset - pos);
+        }
+    }
+
+    std::vector<Section> sections_;
+}; // class BundleWriter
+
+// A validated, mapped bundle. Tries and models attached to it hold a
+// shared_ptr, so the mapping lives as long as any of them.
+class ModelBundle {
+public:
+    // Throws std::runtime_error for missing, truncated or incompatible files.
+    static std::shared_ptr<const ModelBundle> Open(const std::string& path,
+                                                   const MmapOptions& mmap_options = MmapOptions()) {
+        std::shared_ptr<ModelBundle> bundle(new ModelBundle());
+
+        if (!bundle->file_.Open(path)) {
+            throw std::runtime_error("Failed to map model bundle " + path);
+        }
+
+        const char* data = bundle->file_.Data();
+        const size_t size = bundle->file_.Size();
+
+        if (size < sizeof(BundleHeader)) {
+            throw std::runtime_error("Truncated model bundle " + path);
+        }
+
+        const BundleHeader& header = *reinterpret_cast<const BundleHeader*>(data);
+
+        if (memcmp(header.magic, BUNDLE_MAGIC, sizeof(header.magic)) != 0) {
+            throw std::runtime_error("Not a model bundle: " + path);
+        }
+
+        if (header.endian_tag != BUNDLE_ENDIAN_TAG) {
+            throw std::runtime_error("Model bundle was written with another byte order: " + path);
+        }
+
+        if (header.version != BUNDLE_VERSION) {
+            throw std::runtime_error("Unsupported model bundle version " + std::to_string(header.version) + ": " + path);
+        }
+
+        if (header.file_size != size ||
+            sizeof(BundleHeader) + sizeof(BundleSection) * uint64_t(header.section_num) > size) {
+            throw std::runtime_error("Truncated model bundle " + path);
+        }
+
+        const BundleSection* directory = reinterpret_cast<const BundleSection*>(data + sizeof(BundleHeader));
+
+        for (uint32_t i = 0; i < header.section_num; i++) {
+            if (directory[i].offset % BUNDLE_SECTION_ALIGN != 0 || directory[i].offset > size ||
+                directory[i].size > size - directory[i].offset) {
+                throw std::runtime_error("Corrupt section directory in model bundle " + path);
+            }
+        }
+
+        bundle->path_ = path;
+        bundle->directory_ = directory;
+        bundle->section_num_ = header.section_num;
+        bundle->mmap_options_ = mmap_options;
+        bundle->file_.Advise(mmap_options);
+        return bundle;
+    }
+
+    // NULL if the bundle has no such section
+    const char* Section(uint32_t id, size_t* size = NULL) const {
+        for (size_t i = 0; i < section_num_; i++) {
+            if (directory_[i].id == id) {
+                if (size) {
+                    *size = directory_[i].size;
+                }
+
+                return file_.Data() + directory_[i].offset;
+            }
+        }
+
+        return NULL;
+    }
+
+    // Section that must exist and hold a whole number of T.
+    template <class T>
+    const T* Array(uint32_t id, size_t* num) const {
+        size_t size = 0;
+        const char* data = Section(id, &size);
+
+        if (!data || size % sizeof(T) != 0) {
+            throw std::runtime_error("Model bundle " + path_ + " lacks section " + std::to_string(id));
+        }
+
+        *num = size / sizeof(T);
+        return reinterpret_cast<const T*>(data);
+    }
+
+    const BundleMeta& Meta() const {
+        size_t num = 0;
+        const BundleMeta* meta = Array<BundleMeta>(BUNDLE_META, &num);
+
+        if (num != 1) {
+            throw std::runtime_error("Model bundle " + path_ + " has a malformed meta section");
+        }
+
+        return *meta;
+    }
+
+    const std::string& Path() const {
+        return path_;
+    }
+
+    size_t Size() const {
+        return file_.Size();
+    }
+
+    const MmapOptions& GetMmapOptions() const {
+        return mmap_options_;
+    }
+
+private:
+    ModelBundle() {}
+
+    MappedFile file_;
+    std::string path_;
+    const BundleSection* directory_ = NULL;
+    size_t section_num_ = 0;
+    MmapOptions mmap_options_;
+}; // class ModelBundle
+
+} // namespace cppjieba
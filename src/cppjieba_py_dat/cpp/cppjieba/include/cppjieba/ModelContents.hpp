@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+namespace cppjieba {
+
+// Dictionary and HMM model passed by their contents instead of by path,
+// e.g. as bytes from Python. Everything is built in memory: nothing is
+// read from or written to disk, so hosts without a writable file system
+// can start from it.
+struct ModelContents {
+    std::string dict;      // in the format of jieba.dict.utf8
+    std::string hmm_model; // in the format of hmm_model.utf8
+    std::string user_dict; // user dictionary lines, may be empty
+};
+
+} // namespace cppjieba
@@ -2,7 +2,6 @@
 
 #include "limonp/StringUtil.hpp"
 #include "DictTrie.hpp"
-#include "SegmentTagged.hpp"
 
 namespace cppjieba {
 using namespace limonp;
@@ -18,7 +17,8 @@ public:
     ~PosTagger() {
     }
 
-    bool Tag(const string& src, vector<pair<string, string> >& res, const SegmentTagged& segment) const {
+    template <class Segment>
+    bool Tag(const string& src, vector<pair<string, string> >& res, const Segment& segment) const {
         vector<string> CutRes;
         segment.CutToStr(src, CutRes);
 
@@ -29,12 +29,13 @@ public:
         return !res.empty();
     }
 
-    string LookupTag(const string &str, const SegmentTagged& segment) const {
+    template <class Segment>
+    string LookupTag(const string &str, const Segment& segment) const {
         const DictTrie * dict = segment.GetDictTrie();
         assert(dict != NULL);
-        const auto tmp = dict->Find(str);
+        DatMemElem elem;
 
-        if (tmp == NULL || tmp->GetTag().empty()) {
+        if (!dict->Find(str, &elem) || elem.GetTag().empty()) {
             RuneStrArray runes;
 
             if (!DecodeRunesInString(str, runes)) {
@@ -44,7 +45,7 @@ public:
 
             return SpecialRule(runes);
         } else {
-            return tmp->GetTag();
+            return elem.GetTag();
         }
     }
 
@@ -10,7 +10,13 @@ class PreFilter {
 public:
     PreFilter(const std::unordered_set<Rune>& symbols,
               const string& sentence)
-        : symbols_(symbols) {
+        : PreFilter(symbols, sentence, own_sentence_) {
+    }
+    // decodes into runes, which must outlive the filter and the ranges it returns
+    PreFilter(const std::unordered_set<Rune>& symbols,
+              const string& sentence,
+              RuneStrArray& runes)
+        : sentence_(runes), symbols_(symbols) {
         if (!DecodeRunesInString(sentence, sentence_)) {
             XLOG(ERROR) << "decode failed. "<<sentence;
         }
@@ -43,7 +49,8 @@ public:
     }
 private:
     RuneStrArray::const_iterator cursor_;
-    RuneStrArray sentence_;
+    RuneStrArray own_sentence_;
+    RuneStrArray& sentence_;
     const std::unordered_set<Rune>& symbols_;
 }; // class PreFilter
 
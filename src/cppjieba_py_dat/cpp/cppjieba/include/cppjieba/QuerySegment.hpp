@@ -12,7 +12,7 @@
 #include "DictTrie.hpp"
 
 namespace cppjieba {
-class QuerySegment: public SegmentBase {
+class QuerySegment: public SegmentBase<QuerySegment> {
 public:
     QuerySegment(const DictTrie* dictTrie, const HMMModel* model)
         : mixSeg_(dictTrie, model), trie_(dictTrie) {
@@ -20,20 +20,20 @@ public:
     ~QuerySegment() {
     }
 
-    virtual void Cut(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<WordRange>& res, bool hmm,
-                     size_t) const override {
+    template <bool kHmm, bool kBoundedLen>
+    void Cut(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<WordRange>& res,
+             size_t, SegmentContext& ctx) const {
         //use mix Cut first
-        vector<WordRange> mixRes;
-        mixSeg_.CutRuneArray(begin, end, mixRes, hmm);
-
-        vector<WordRange> fullRes;
+        vector<WordRange>& mixRes = ctx.mix_res;
+        mixRes.clear();
+        mixSeg_.Cut<kHmm, false>(begin, end, mixRes, MAX_WORD_LENGTH, ctx);
 
         for (vector<WordRange>::const_iterator mixResItr = mixRes.begin(); mixResItr != mixRes.end(); mixResItr++) {
             if (mixResItr->Length() > 2) {
                 for (size_t i = 0; i + 1 < mixResItr->Length(); i++) {
-                    string text = EncodeRunesToString(mixResItr->left + i, mixResItr->left + i + 2);
+                    EncodeRunesToString(mixResItr->left + i, mixResItr->left + i + 2, ctx.text);
 
-                    if (trie_->Find(text) != NULL) {
+                    if (trie_->Find(ctx.text)) {
                         WordRange wr(mixResItr->left + i, mixResItr->left + i + 1);
                         res.push_back(wr);
                     }
@@ -42,9 +42,9 @@ public:
 
             if (mixResItr->Length() > 3) {
                 for (size_t i = 0; i + 2 < mixResItr->Length(); i++) {
-                    string text = EncodeRunesToString(mixResItr->left + i, mixResItr->left + i + 3);
+                    EncodeRunesToString(mixResItr->left + i, mixResItr->left + i + 3, ctx.text);
 
-                    if (trie_->Find(text) != NULL) {
+                    if (trie_->Find(ctx.text)) {
                         WordRange wr(mixResItr->left + i, mixResItr->left + i + 2);
                         res.push_back(wr);
                     }
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+namespace cppjieba {
+
+// Minimal epoch-based read-copy-update.
+//
+// Readers hold a ReadGuard while they use data reached through a published
+// pointer; entering and leaving are two atomic increments on a per-thread
+// stripe and never block. A writer swaps the pointer, then calls
+// Synchronize(), which returns once every reader that could still see the old
+// data has left, so it can be freed. Writers must be serialized by the caller.
+// Guards may nest.
+class RcuDomain {
+public:
+    class ReadGuard {
+    public:
+        explicit ReadGuard(const RcuDomain& domain)
+            : counter_(domain.Enter()) {
+        }
+        ReadGuard(ReadGuard&& other)
+            : counter_(other.counter_) {
+            other.counter_ = NULL;
+        }
+        ~ReadGuard() {
+            if (counter_) {
+                counter_->fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+    private:
+        ReadGuard(const ReadGuard&);
+        ReadGuard& operator=(const ReadGuard&);
+
+        std::atomic<size_t>* counter_;
+    }; // class ReadGuard
+
+    RcuDomain()
+        : epoch_(0) {
+        for (size_t i = 0; i < 2; i++) {
+            for (size_t j = 0; j < STRIPES; j++) {
+                readers_[i][j].n.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    ReadGuard Read() const {
+        return ReadGuard(*this);
+    }
+
+    void Synchronize() const {
+        // Readers that entered under the old parity are waited for; any that
+        // increment it afterwards see the new epoch and back out.
+        const size_t epoch = epoch_.fetch_add(1);
+
+        for (size_t j = 0; j < STRIPES; j++) {
+            while (readers_[epoch & 1][j].n.load(std::memory_order_acquire) != 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    static const size_t STRIPES = 16;
+
+    struct Counter {
+        std::atomic<size_t> n;
+        char pad[64 - sizeof(std::atomic<size_t>)];
+    };
+
+    static size_t Stripe() {
+        static thread_local const size_t stripe = std::hash<std::thread::id>()(std::this_thread::get_id()) % STRIPES;
+        return stripe;
+    }
+
+    std::atomic<size_t>* Enter() const {
+        const size_t stripe = Stripe();
+
+        for (;;) {
+            const size_t epoch = epoch_.load();
+            std::atomic<size_t>& n = readers_[epoch & 1][stripe].n;
+            n.fetch_add(1);
+
+            if (epoch_.load() == epoch) {
+                return &n;
+            }
+
+            n.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    RcuDomain(const RcuDomain&);
+    RcuDomain& operator=(const RcuDomain&);
+
+    mutable std::atomic<size_t> epoch_;
+    mutable Counter readers_[2][STRIPES];
+}; // class RcuDomain
+
+} // namespace cppjieba
@@ -0,0 +1,501 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Unicode.hpp"
+
+#if defined(__GNUC__) || defined(__clang__)
+#    define CPPJIEBA_PREFETCH(addr) __builtin_prefetch(addr)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#    include <xmmintrin.h>
+#    define CPPJIEBA_PREFETCH(addr) _mm_prefetch(reinterpret_cast<const char*>(addr), _MM_HINT_T0)
+#else
+#    define CPPJIEBA_PREFETCH(addr) ((void)(addr))
+#endif
+
+namespace cppjieba {
+
+// A double array over runes instead of UTF-8 bytes: one transition, one
+// unit read, per character where darts needs three for a CJK one. Runes
+// are renumbered at build time into a dense alphabet, the most frequent
+// ones first, so sibling sets are small ranges that pack well.
+//
+// Image, usable in place from a mapping:
+//   RuneTrieHeader | uint16_t bmp_codes[0x10000] | RuneCode extra[extra_num] | RuneUnit units[units_num]
+// Code 0 means the rune occurs in no key. Runes beyond the BMP are looked
+// up in extra, sorted by rune.
+struct RuneTrieHeader {
+    uint32_t alphabet_num = 0; // codes are 1..alphabet_num
+    uint32_t extra_num = 0;
+    uint32_t units_num = 0;
+    uint32_t reserved = 0;
+};
+
+struct RuneCode {
+    uint32_t rune;
+    uint32_t code;
+
+    bool operator<(const RuneCode& b) const {
+        return rune < b.rune;
+    }
+};
+
+// Child of node s by code c is t = units[s].base + c if units[t].check == s.
+// Units past the last base are padded so t never leaves the array.
+struct RuneUnit {
+    int32_t base = 0;
+    int32_t check = -1; // -1: free
+    int32_t value = -1; // -1: no key ends here
+};
+
+static_assert(sizeof(RuneTrieHeader) == 16, "RuneTrieHeader length invalid");
+static_assert(sizeof(RuneUnit) == 12, "RuneUnit length invalid");
+
+class RuneDoubleArray {
+public:
+    static const size_t kBmpSize = 0x10000;
+    static const int32_t kRoot = 0;
+
+    bool Empty() const {
+        return units_ == NULL;
+    }
+
+    // Builds over num UTF-8 keys sorted bytewise, i.e. by rune; of equal keys
+    // the first value is kept. Values must be non-negative. False if a key is
+    // no valid UTF-8 or the alphabet does not fit 16-bit codes.
+    // heats, if given, says how often each key is looked up: the nodes on
+    // the way to hot keys are then placed first, hottest first, so they share
+    // the units at the start of the array; the image grows somewhat.
+    bool Build(size_t num, const char* const* keys, const int* values, const uint64_t* heats = NULL) {
+        Clear();
+        if (num == 0) {
+            return false;
+        }
+
+        vector<uint32_t> codes;
+        vector<size_t> starts(1, 0);
+        RuneArray runes;
+
+        for (size_t i = 0; i < num; i++) {
+            if (!DecodeRunesInString(keys[i], runes)) {
+                return false;
+            }
+
+            codes.insert(codes.end(), runes.begin(), runes.end());
+            starts.push_back(codes.size());
+        }
+
+        vector<RuneCode> alphabet;
+        if (!RankAlphabet(codes, starts, heats, alphabet)) {
+            return false;
+        }
+
+        Builder builder;
+        builder.Build(codes, starts, values, heats, alphabet.size());
+
+        RuneTrieHeader header;
+        header.alphabet_num = alphabet.size();
+        header.units_num = builder.units.size();
+        std::sort(alphabet.begin(), alphabet.end());
+
+        vector<uint16_t> bmp_codes(kBmpSize, 0);
+        vector<RuneCode> extra;
+        for (size_t i = 0; i < alphabet.size(); i++) {
+            if (alphabet[i].rune < kBmpSize) {
+                bmp_codes[alphabet[i].rune] = alphabet[i].code;
+            } else {
+                extra.push_back(alphabet[i]);
+            }
+        }
+        header.extra_num = extra.size();
+
+        image_.reserve(ImageSize(header));
+        image_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        image_.append(reinterpret_cast<const char*>(bmp_codes.data()), sizeof(uint16_t) * bmp_codes.size());
+        image_.append(reinterpret_cast<const char*>(extra.data()), sizeof(RuneCode) * extra.size());
+        image_.append(reinterpret_cast<const char*>(builder.units.data()), sizeof(RuneUnit) * builder.units.size());
+        return Attach(image_.data(), image_.size());
+    }
+
+    // Uses an image in place, e.g. from a cache file; the memory must outlive
+    // this object or the next Attach/Clear.
+    bool Attach(const char* data, size_t size) {
+        if (size < sizeof(RuneTrieHeader)) {
+            return false;
+        }
+
+        const RuneTrieHeader& header = *reinterpret_cast<const RuneTrieHeader*>(data);
+        if (ImageSize(header) != size || header.units_num == 0 || header.alphabet_num > 0xffff) {
+            return false;
+        }
+
+        header_ = &header;
+        bmp_codes_ = reinterpret_cast<const uint16_t*>(data + sizeof(header));
+        extra_ = reinterpret_cast<const RuneCode*>(bmp_codes_ + kBmpSize);
+        units_ = reinterpret_cast<const RuneUnit*>(extra_ + header.extra_num);
+        return true;
+    }
+
+    void Clear() {
+        header_ = NULL;
+        bmp_codes_ = NULL;
+        extra_ = NULL;
+        units_ = NULL;
+        string().swap(image_);
+    }
+
+    const char* Image() const {
+        return reinterpret_cast<const char*>(header_);
+    }
+
+    size_t ImageSize() const {
+        return header_ ? ImageSize(*header_) : 0;
+    }
+
+    // Child of node by rune, -1 if there is none
+    int32_t Child(int32_t node, Rune rune) const {
+        const int32_t next = Next(node, rune);
+        return next >= 0 && IsChild(node, next) ? next : -1;
+    }
+
+    // Child() in two steps, for walks interleaved with others: the unit the
+    // child would be, -1 if the rune is in no key; then whether it is.
+    int32_t Next(int32_t node, Rune rune) const {
+        const uint32_t code = Code(rune);
+        return code == 0 ? -1 : units_[node].base + int32_t(code);
+    }
+
+    bool IsChild(int32_t node, int32_t next) const {
+        return units_[next].check == node;
+    }
+
+    void Prefetch(int32_t unit) const {
+        CPPJIEBA_PREFETCH(units_ + unit);
+    }
+
+    // Value of the key ending at node, -1 if none does
+    int32_t Value(int32_t node) const {
+        return units_[node].value;
+    }
+
+    int32_t ExactMatch(const string& key) const {
+        RuneArray runes;
+        if (!DecodeRunesInString(key, runes)) {
+            return -1;
+        }
+
+        int32_t node = kRoot;
+        for (size_t i = 0; i < runes.size() && node >= 0; i++) {
+            node = Child(node, runes[i]);
+        }
+
+        return node >= 0 ? Value(node) : -1;
+    }
+
+private:
+    static size_t ImageSize(const RuneTrieHeader& header) {
+        return sizeof(header) + sizeof(uint16_t) * kBmpSize + sizeof(RuneCode) * header.extra_num +
+               sizeof(RuneUnit) * size_t(header.units_num);
+    }
+
+    uint32_t Code(Rune rune) const {
+        if (rune < kBmpSize) {
+            return bmp_codes_[rune];
+        }
+
+        const RuneCode key = {rune, 0};
+        const RuneCode* end = extra_ + header_->extra_num;
+        const RuneCode* it = std::lower_bound(extra_, end, key);
+        return it != end && it->rune == rune ? it->code : 0;
+    }
+
+    // Codes by descending heat of the keys a rune occurs in, then by
+    // descending frequency in the keys, ties by rune; the runes in keys are
+    // replaced by their codes.
+    static bool RankAlphabet(vector<uint32_t>& keys, const vector<size_t>& starts, const uint64_t* heats,
+                             vector<RuneCode>& alphabet) {
+        struct Rank {
+            uint64_t heat = 0;
+            size_t count = 0;
+            Rune rune = 0;
+        };
+
+        std::unordered_map<Rune, Rank> ranks;
+        for (size_t k = 0; k + 1 < starts.size(); k++) {
+            for (size_t i = starts[k]; i < starts[k + 1]; i++) {
+                Rank& rank = ranks[keys[i]];
+                rank.heat += heats ? heats[k] : 0;
+                rank.count++;
+            }
+        }
+
+        if (ranks.size() > 0xffff) {
+            return false;
+        }
+
+        vector<Rank> ranked;
+        ranked.reserve(ranks.size());
+        for (auto& kv : ranks) {
+            kv.second.rune = kv.first;
+            ranked.push_back(kv.second);
+        }
+        std::sort(ranked.begin(), ranked.end(), [](const Rank& a, const Rank& b) {
+            if (a.heat != b.heat) {
+                return a.heat > b.heat;
+            }
+            return a.count != b.count ? a.count > b.count : a.rune < b.rune;
+        });
+
+        std::unordered_map<Rune, uint32_t> codes;
+        alphabet.clear();
+        for (size_t i = 0; i < ranked.size(); i++) {
+            const RuneCode code = {ranked[i].rune, uint32_t(i + 1)};
+            alphabet.push_back(code);
+            codes[code.rune] = code.code;
+        }
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            keys[i] = codes[keys[i]];
+        }
+
+        return true;
+    }
+
+    // Places the nodes depth first, each sibling set at the first base where
+    // all of it fits, searching a list of the free units. With heats, the
+    // nodes leading to hot keys are placed before the others, hottest first.
+    struct Builder {
+        vector<RuneUnit> units;
+
+        void Build(const vector<uint32_t>& codes, const vector<size_t>& starts, const int* values,
+                   const uint64_t* heats, size_t alphabet_num) {
+            struct Task {
+                int32_t node;
+                size_t lo, hi, depth;
+                uint64_t heat; // of the keys in [lo, hi)
+
+                bool operator<(const Task& b) const {
+                    return heat < b.heat;
+                }
+            };
+
+            units.assign(1, RuneUnit());
+            next_.assign(1, -1);
+            prev_.assign(1, -1);
+            trials_.assign(1, 0);
+            free_head_ = -1;
+
+            vector<uint64_t> heat_sums(starts.size(), 0);
+            for (size_t k = 0; heats && k + 1 < starts.size(); k++) {
+                heat_sums[k + 1] = heat_sums[k] + heats[k];
+            }
+
+            vector<Task> tasks;
+            vector<Task> hot_tasks; // heap, hottest on top
+            bool relist = false;
+            vector<uint32_t> children;
+            vector<std::pair<size_t, size_t> > ranges;
+            const Task root = {kRoot, 0, starts.size() - 1, 0, heat_sums.back()};
+            tasks.push_back(root);
+
+            while (!tasks.empty() || !hot_tasks.empty()) {
+                Task task;
+                if (!hot_tasks.empty()) {
+                    std::pop_heap(hot_tasks.begin(), hot_tasks.end());
+                    task = hot_tasks.back();
+                    hot_tasks.pop_back();
+                    relist = hot_tasks.empty();
+                } else {
+                    if (relist) {
+                        Relist();
+                        relist = false;
+                    }
+                    task = tasks.back();
+                    tasks.pop_back();
+                }
+                size_t i = task.lo;
+
+                if (starts[i + 1] - starts[i] == task.depth) {
+                    units[task.node].value = values[i];
+                    while (i < task.hi && starts[i + 1] - starts[i] == task.depth) {
+                        i++;
+                    }
+                }
+
+                children.clear();
+                ranges.clear();
+                while (i < task.hi) {
+                    const uint32_t code = codes[starts[i] + task.depth];
+                    const size_t lo = i;
+                    while (i < task.hi && codes[starts[i] + task.depth] == code) {
+                        i++;
+                    }
+                    children.push_back(code);
+                    ranges.push_back(std::pair<size_t, size_t>(lo, i));
+                }
+
+                if (children.empty()) {
+                    continue;
+                }
+
+                const int32_t base = FindBase(children);
+                units[task.node].base = base;
+
+                for (size_t k = 0; k < children.size(); k++) {
+                    const int32_t child = base + children[k];
+                    Use(child);
+                    units[child].check = task.node;
+                    const Task next = {child, ranges[k].first, ranges[k].second, task.depth + 1,
+                                       heat_sums[ranges[k].second] - heat_sums[ranges[k].first]};
+                    if (next.heat > 0) {
+                        hot_tasks.push_back(next);
+                        std::push_heap(hot_tasks.begin(), hot_tasks.end());
+                    } else {
+                        tasks.push_back(next);
+                    }
+                }
+            }
+
+            int32_t max_base = 0;
+            for (size_t k = 0; k < units.size(); k++) {
+                max_base = std::max(max_base, units[k].base);
+            }
+            units.resize(std::max(units.size(), size_t(max_base) + alphabet_num + 1));
+        }
+
+    private:
+        int32_t FindBase(const vector<uint32_t>& children) {
+            const uint32_t lowest = *std::min_element(children.begin(), children.end());
+            const uint32_t highest = *std::max_element(children.begin(), children.end());
+
+            if (free_head_ < 0) {
+                Extend(units.size() + highest + 1);
+            }
+
+            for (int32_t pos = free_head_;;) {
+                const int32_t base = pos - int32_t(lowest);
+
+                if (base >= 1) {
+                    if (size_t(base) + highest >= units.size()) {
+                        Extend(size_t(base) + highest + 1);
+                    }
+
+                    bool fits = true;
+                    for (size_t k = 0; k < children.size() && fits; k++) {
+                        fits = units[base + children[k]].check < 0;
+                    }
+
+                    if (fits) {
+                        return base;
+                    }
+                }
+
+                int32_t next = next_[pos];
+                const bool wrapped = next == free_head_;
+
+                // units that keep failing are no longer tried as a start,
+                // but can still be taken by a sibling set
+                if (++trials_[pos] >= kMaxTrials) {
+                    Unlink(pos);
+                }
+
+                if (wrapped || free_head_ < 0) {
+                    next = int32_t(units.size());
+                    Extend(units.size() + highest + 1);
+                }
+                pos = next;
+            }
+        }
+
+        // Lists all free units again with fresh trials: placing the hot nodes
+        // gave up on many units that the cold sibling sets can still fill
+        void Relist() {
+            int32_t tail = -1;
+            free_head_ = -1;
+
+            for (size_t i = 1; i < units.size(); i++) {
+                const int32_t unit = int32_t(i);
+                if (units[i].check >= 0) {
+                    next_[i] = -1;
+                    continue;
+                }
+
+                trials_[i] = 0;
+                if (free_head_ < 0) {
+                    free_head_ = unit;
+                } else {
+                    next_[tail] = unit;
+                    prev_[unit] = tail;
+                }
+                tail = unit;
+            }
+
+            if (free_head_ >= 0) {
+                next_[tail] = free_head_;
+                prev_[free_head_] = tail;
+            }
+        }
+
+        // Appends free units at the tail of the circular free list
+        void Extend(size_t size) {
+            for (size_t i = units.size(); i < size; i++) {
+                const int32_t unit = int32_t(i);
+                units.push_back(RuneUnit());
+                next_.push_back(unit);
+                prev_.push_back(unit);
+                trials_.push_back(0);
+
+                if (free_head_ < 0) {
+                    free_head_ = unit;
+                    continue;
+                }
+
+                const int32_t tail = prev_[free_head_];
+                next_[tail] = unit;
+                prev_[unit] = tail;
+                next_[unit] = free_head_;
+                prev_[free_head_] = unit;
+            }
+        }
+
+        void Use(int32_t unit) {
+            if (next_[unit] >= 0) {
+                Unlink(unit);
+            }
+        }
+
+        void Unlink(int32_t unit) {
+            if (next_[unit] == unit) {
+                free_head_ = -1;
+            } else {
+                next_[prev_[unit]] = next_[unit];
+                prev_[next_[unit]] = prev_[unit];
+                if (free_head_ == unit) {
+                    free_head_ = next_[unit];
+                }
+            }
+
+            next_[unit] = -1;
+        }
+
+        static const uint8_t kMaxTrials = 16;
+
+        vector<int32_t> next_;
+        vector<int32_t> prev_;   // of listed units, next_ is -1 for others
+        vector<uint8_t> trials_;
+        int32_t free_head_ = -1;
+    }; // struct Builder
+
+    const RuneTrieHeader* header_ = NULL;
+    const uint16_t* bmp_codes_ = NULL;
+    const RuneCode* extra_ = NULL;
+    const RuneUnit* units_ = NULL;
+    string image_; // built here rather than attached
+}; // class RuneDoubleArray
+
+} // namespace cppjieba
@@ -2,51 +2,129 @@
 
 #include "limonp/Logging.hpp"
 #include "PreFilter.hpp"
+#include "SegmentContext.hpp"
+#include "WorkerPool.hpp"
+#include <algorithm>
 #include <cassert>
+#include <exception>
+#include <thread>
 
 
 namespace cppjieba {
 
 const char* const SPECIAL_SEPARATORS = " \t\n\xEF\xBC\x8C\xE3\x80\x82";
 
+// Chunks smaller than this are not worth a thread of their own.
+const size_t MIN_PARALLEL_CHUNK_RUNES = 16 * 1024;
+
+// Separator-free ranges longer than the window are cut piecewise, see SetRangeLimits.
+const size_t DEFAULT_MAX_RANGE_LENGTH = 64 * 1024;
+const size_t DEFAULT_RANGE_OVERLAP = 1024;
+const size_t DEFAULT_MAX_WORK_BYTES = 64 << 20;
+// Upper estimate of the transient state one rune of a window costs:
+// a DatDag, the intermediate WordRanges and the Viterbi weight/path cells.
+const size_t WINDOW_BYTES_PER_RUNE = 512;
+
 using namespace limonp;
 
+// Static (CRTP) base of the segments. Derived implements
+//
+//     template <bool kHmm, bool kBoundedLen>
+//     void Cut(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end,
+//              vector<WordRange>& res, size_t max_word_len, SegmentContext& ctx) const;
+//
+// The hmm flag and whether max_word_len restricts anything are resolved once
+// per call, so each mode combination is its own instantiation and the trie
+// scan, DP and HMM fallback inline into one another without virtual calls.
+template <class Derived>
 class SegmentBase {
 public:
     SegmentBase() {
         XCHECK(ResetSeparators(SPECIAL_SEPARATORS));
+        XCHECK(SetRangeLimits(DEFAULT_MAX_RANGE_LENGTH, DEFAULT_RANGE_OVERLAP, DEFAULT_MAX_WORK_BYTES));
     }
-    virtual ~SegmentBase() { }
-
-    virtual void Cut(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<WordRange>& res, bool hmm,
-                     size_t max_word_len) const = 0;
 
     void CutToStr(const string& sentence, vector<string>& words, bool hmm = true,
                   size_t max_word_len = MAX_WORD_LENGTH) const {
-        vector<Word> tmp;
-        CutToWord(sentence, tmp, hmm, max_word_len);
-        GetStringsFromWords(tmp, words);
+        SegmentContext ctx;
+        CutToStr(sentence, words, hmm, max_word_len, ctx);
+    }
+
+    void CutToStr(const string& sentence, vector<string>& words, bool hmm, size_t max_word_len,
+                  SegmentContext& ctx, size_t thread_num = 1) const {
+        CutToRanges(sentence, hmm, max_word_len, ctx, thread_num);
+        GetStringsFromWordRanges(sentence, ctx.wrs, words);
     }
 
     void CutToWord(const string& sentence, vector<Word>& words, bool hmm = true,
                    size_t max_word_len = MAX_WORD_LENGTH) const {
-        PreFilter pre_filter(symbols_, sentence);
-        vector<WordRange> wrs;
-        wrs.reserve(sentence.size() / 2);
+        SegmentContext ctx;
+        CutToWord(sentence, words, hmm, max_word_len, ctx);
+    }
 
-        while (pre_filter.HasNext()) {
-            auto range = pre_filter.Next();
-            Cut(range.left, range.right, wrs, hmm, max_word_len);
+    void CutToWord(const string& sentence, vector<Word>& words, bool hmm, size_t max_word_len,
+                   SegmentContext& ctx, size_t thread_num = 1) const {
+        CutToRanges(sentence, hmm, max_word_len, ctx, thread_num);
+        words.clear();
+        words.reserve(ctx.wrs.size());
+        GetWordsFromWordRanges(sentence, ctx.wrs, words);
+    }
+
+    // Leaves the result in ctx.wrs, ranges over ctx.runes. With thread_num > 1
+    // the separator-delimited ranges of the decoded sentence are grouped into
+    // up to thread_num chunks of similar rune count which are cut concurrently
+    // by the calling thread and those of WorkerPool::Shared(); the output is
+    // the same as with a single thread.
+    void CutToRanges(const string& sentence, bool hmm, size_t max_word_len, SegmentContext& ctx,
+                     size_t thread_num = 1) const {
+        if (hmm) {
+            if (max_word_len < MAX_WORD_LENGTH) {
+                CutToRanges<true, true>(sentence, max_word_len, ctx, thread_num);
+            } else {
+                CutToRanges<true, false>(sentence, max_word_len, ctx, thread_num);
+            }
+        } else {
+            if (max_word_len < MAX_WORD_LENGTH) {
+                CutToRanges<false, true>(sentence, max_word_len, ctx, thread_num);
+            } else {
+                CutToRanges<false, false>(sentence, max_word_len, ctx, thread_num);
+            }
         }
+    }
 
-        words.clear();
-        words.reserve(wrs.size());
-        GetWordsFromWordRanges(sentence, wrs, words);
+    void CutToStrParallel(const string& sentence, vector<string>& words, size_t thread_num, bool hmm = true,
+                          size_t max_word_len = MAX_WORD_LENGTH) const {
+        SegmentContext ctx;
+        CutToStr(sentence, words, hmm, max_word_len, ctx, thread_num);
+    }
+
+    void CutToWordParallel(const string& sentence, vector<Word>& words, size_t thread_num, bool hmm = true,
+                           size_t max_word_len = MAX_WORD_LENGTH) const {
+        SegmentContext ctx;
+        CutToWord(sentence, words, hmm, max_word_len, ctx, thread_num);
     }
 
     void CutRuneArray(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<WordRange>& res,
                       bool hmm = true, size_t max_word_len = MAX_WORD_LENGTH) const {
-        Cut(begin, end, res, hmm, max_word_len);
+        SegmentContext ctx;
+        CutRuneArray(begin, end, res, hmm, max_word_len, ctx);
+    }
+
+    void CutRuneArray(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<WordRange>& res,
+                      bool hmm, size_t max_word_len, SegmentContext& ctx) const {
+        if (hmm) {
+            if (max_word_len < MAX_WORD_LENGTH) {
+                Self().template Cut<true, true>(begin, end, res, max_word_len, ctx);
+            } else {
+                Self().template Cut<true, false>(begin, end, res, max_word_len, ctx);
+            }
+        } else {
+            if (max_word_len < MAX_WORD_LENGTH) {
+                Self().template Cut<false, true>(begin, end, res, max_word_len, ctx);
+            } else {
+                Self().template Cut<false, false>(begin, end, res, max_word_len, ctx);
+            }
+        }
     }
 
     bool ResetSeparators(const string& s) {
@@ -67,8 +145,185 @@ public:
 
         return true;
     }
+
+    // A range without separators (minified text, base64, long unpunctuated
+    // CJK) would otherwise need one DatDag per rune and a Viterbi lattice over
+    // the whole range. Such ranges are cut in windows of at most
+    // max_range_len runes, further capped so that a window's state stays below
+    // max_work_bytes. Each window looks overlap runes past the point where its
+    // words are committed, so DP and HMM decisions up to there see the same
+    // context as an unwindowed cut. A limit of 0 disables it; max_work_bytes
+    // keeps its default cap unless 0 is passed.
+    //
+    // max_work_bytes only covers the per-window DAG and Viterbi state. The
+    // decoded runes of the whole text and the output word ranges still grow
+    // with the input.
+    bool SetRangeLimits(size_t max_range_len, size_t overlap = DEFAULT_RANGE_OVERLAP,
+                        size_t max_work_bytes = DEFAULT_MAX_WORK_BYTES) {
+        size_t span = max_range_len;
+
+        if (max_work_bytes > 0) {
+            const size_t work_span = std::max<size_t>(max_work_bytes / WINDOW_BYTES_PER_RUNE, 2);
+            span = (span == 0) ? work_span : std::min(span, work_span);
+        }
+
+        if (span > 0 && overlap >= span) {
+            XLOG(ERROR) << "range overlap " << overlap << " must be smaller than the window of " << span << " runes";
+            return false;
+        }
+
+        window_runes_ = span;
+        window_overlap_ = overlap;
+        return true;
+    }
 protected:
+    const Derived& Self() const {
+        return static_cast<const Derived&>(*this);
+    }
+
+    template <bool kHmm, bool kBoundedLen>
+    void CutToRanges(const string& sentence, size_t max_word_len, SegmentContext& ctx, size_t thread_num) const {
+        PreFilter pre_filter(symbols_, sentence, ctx.runes);
+        ctx.wrs.clear();
+
+        if (thread_num <= 1) {
+            while (pre_filter.HasNext()) {
+                auto range = pre_filter.Next();
+                CutRange<kHmm, kBoundedLen>(range.left, range.right, ctx.wrs, max_word_len, ctx);
+            }
+
+            return;
+        }
+
+        ctx.ranges.clear();
+
+        while (pre_filter.HasNext()) {
+            ctx.ranges.push_back(pre_filter.Next());
+        }
+
+        CutRangesParallel<kHmm, kBoundedLen>(ctx.ranges, ctx.wrs, thread_num, max_word_len, ctx);
+    }
+
+    template <bool kHmm, bool kBoundedLen>
+    void CutRange(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, vector<WordRange>& res,
+                  size_t max_word_len, SegmentContext& ctx) const {
+        if (window_runes_ == 0 || size_t(end - begin) <= window_runes_) {
+            Self().template Cut<kHmm, kBoundedLen>(begin, end, res, max_word_len, ctx);
+            return;
+        }
+
+        const size_t step = window_runes_ - window_overlap_;
+        vector<WordRange>& window_res = ctx.window_res;
+
+        while (size_t(end - begin) > window_runes_) {
+            const auto commit = begin + step;
+            window_res.clear();
+            Self().template Cut<kHmm, kBoundedLen>(begin, begin + window_runes_, window_res, max_word_len, ctx);
+
+            // Words are committed up to the earliest start of any word that
+            // reaches the commit point; the next window restarts there.
+            auto next = begin + window_runes_;
+
+            for (const auto& wr : window_res) {
+                if (wr.right >= commit && wr.left < next) {
+                    next = wr.left;
+                }
+            }
+
+            if (next == begin) {
+                // a single word covers the whole committed part, keep it whole
+                for (const auto& wr : window_res) {
+                    if (wr.left == begin && wr.right >= next) {
+                        next = wr.right + 1;
+                    }
+                }
+            }
+
+            for (const auto& wr : window_res) {
+                if (wr.left < next) {
+                    res.push_back(wr);
+                }
+            }
+
+            begin = next;
+        }
+
+        Self().template Cut<kHmm, kBoundedLen>(begin, end, res, max_word_len, ctx);
+    }
+
+    // ranges are [left, right) as produced by PreFilter::Next
+    template <bool kHmm, bool kBoundedLen>
+    void CutRangesParallel(const vector<WordRange>& ranges, vector<WordRange>& res, size_t thread_num,
+                           size_t max_word_len, SegmentContext& ctx) const {
+        size_t rune_num = 0;
+
+        for (const auto& range : ranges) {
+            rune_num += range.right - range.left;
+        }
+
+        thread_num = std::min(thread_num, rune_num / MIN_PARALLEL_CHUNK_RUNES);
+        const size_t hardware_threads = std::thread::hardware_concurrency();
+
+        if (hardware_threads > 0) {
+            thread_num = std::min(thread_num, hardware_threads);
+        }
+
+        if (thread_num <= 1) {
+            for (const auto& range : ranges) {
+                CutRange<kHmm, kBoundedLen>(range.left, range.right, res, max_word_len, ctx);
+            }
+
+            return;
+        }
+
+        // chunk i covers ranges [bounds[i], bounds[i + 1])
+        vector<size_t> bounds(1, 0);
+        const size_t chunk_runes = (rune_num + thread_num - 1) / thread_num;
+        size_t acc = 0;
+
+        for (size_t i = 0; i < ranges.size(); i++) {
+            acc += ranges[i].right - ranges[i].left;
+
+            if (acc >= chunk_runes && i + 1 < ranges.size()) {
+                bounds.push_back(i + 1);
+                acc = 0;
+            }
+        }
+
+        bounds.push_back(ranges.size());
+        const size_t chunk_num = bounds.size() - 1;
+        vector<std::exception_ptr> errors(chunk_num);
+
+        for (size_t c = 0; c < chunk_num; c++) {
+            ctx.Worker(c).wrs.clear();
+        }
+
+        auto cut_chunk = [&](size_t c) {
+            try {
+                SegmentContext& worker_ctx = *ctx.workers[c];
+
+                for (size_t i = bounds[c]; i < bounds[c + 1]; i++) {
+                    CutRange<kHmm, kBoundedLen>(ranges[i].left, ranges[i].right, worker_ctx.wrs, max_word_len, worker_ctx);
+                }
+            } catch (...) {
+                errors[c] = std::current_exception();
+            }
+        };
+
+        WorkerPool::Shared().Run(chunk_num, cut_chunk);
+
+        for (size_t c = 0; c < chunk_num; c++) {
+            if (errors[c]) {
+                std::rethrow_exception(errors[c]);
+            }
+
+            res.insert(res.end(), ctx.workers[c]->wrs.begin(), ctx.workers[c]->wrs.end());
+        }
+    }
+
     unordered_set<Rune> symbols_;
+    size_t window_runes_ = 0;
+    size_t window_overlap_ = 0;
 }; // class SegmentBase
 
 } // cppjieba
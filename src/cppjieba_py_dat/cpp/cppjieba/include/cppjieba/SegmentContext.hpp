@@ -0,0 +1,41 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "Unicode.hpp"
+#include "DatTrie.hpp"
+
+namespace cppjieba {
+
+// Scratch buffers for one segmentation call. Every stage of the pipeline
+// writes into its own member, and all of them keep their capacity between
+// calls, so a context reused by one thread (owned by the caller or kept
+// thread_local) stops allocating once it has seen inputs of a similar size.
+// A context must not be shared by concurrent calls.
+struct SegmentContext {
+    RuneStrArray runes;                 // decoded sentence, all WordRanges point into it
+    vector<WordRange> ranges;           // PreFilter output, only kept for parallel cuts
+    vector<WordRange> wrs;              // final result of a call
+    vector<WordRange> window_res;       // one window of a long range
+    vector<WordRange> mix_res;          // QuerySegment: the MixSegment pass
+    vector<WordRange> mp_res;           // MixSegment: the MPSegment pass
+    vector<WordRange> hmm_res;          // MixSegment: the HMMSegment pass
+    vector<DatDag> dags;                // MPSegment / FullSegment
+    string text;                        // UTF-8 of the range being looked up
+    vector<size_t> status;              // HMMSegment: Viterbi output
+    vector<int> path;                   // HMMSegment: Viterbi back pointers
+    vector<double> weight;              // HMMSegment: Viterbi lattice
+    string sentence;                    // optional input buffer for callers converting from other string types
+    vector<std::unique_ptr<SegmentContext> > workers; // per-thread contexts of parallel cuts
+
+    SegmentContext& Worker(size_t i) {
+        while (workers.size() <= i) {
+            workers.emplace_back(new SegmentContext());
+        }
+
+        return *workers[i];
+    }
+}; // struct SegmentContext
+
+} // namespace cppjieba
@@ -1,21 +1,29 @@
 #pragma once
 
 #include "SegmentBase.hpp"
+#include "PosTagger.hpp"
 
 namespace cppjieba {
 
-class SegmentTagged : public SegmentBase {
+// Segments that can tag their words. Derived provides GetDictTrie().
+template <class Derived>
+class SegmentTagged : public SegmentBase<Derived> {
 public:
     SegmentTagged() {
     }
-    virtual ~SegmentTagged() {
+    ~SegmentTagged() {
     }
 
-    virtual bool Tag(const string& src, vector<pair<string, string> >& res) const = 0;
+    bool Tag(const string& src, vector<pair<string, string> >& res) const {
+        return tagger_.Tag(src, res, this->Self());
+    }
 
-    virtual const DictTrie* GetDictTrie() const = 0;
+    string LookupTag(const string &str) const {
+        return tagger_.LookupTag(str, this->Self());
+    }
 
+protected:
+    PosTagger tagger_;
 }; // class SegmentTagged
 
 } // cppjieba
-
@@ -93,22 +93,31 @@ inline RuneArray DecodeRunesInString(const string& s) {
     return result;
 }
 
-inline bool DecodeRunesInString(const string& s, RuneStrArray& runes) {
-    RuneArray arr;
-
-    if (not DecodeRunesInString(s, arr)) {
-        return false;
+// Lets Utf8ToUnicode32 decode straight into a RuneStrArray, reusing its buffer.
+class RuneStrArrayAppender {
+public:
+    explicit RuneStrArrayAppender(RuneStrArray& runes) : runes_(runes) {
     }
+    void clear() {
+        runes_.reset();
+        offset_ = 0;
+    }
+    void push_back(uint32_t rune) {
+        const uint32_t len = limonp::UnicodeToUtf8Bytes(rune);
+        runes_.push_back(RuneInfo(rune, offset_, len, runes_.size(), 1));
+        offset_ += len;
+    }
+private:
+    RuneStrArray& runes_;
+    uint32_t offset_ = 0;
+};
 
-    runes.clear();
-
-    uint32_t offset = 0;
+inline bool DecodeRunesInString(const string& s, RuneStrArray& runes) {
+    RuneStrArrayAppender appender(runes);
 
-    for (uint32_t i = 0; i < arr.size(); ++i) {
-        const uint32_t len = limonp::UnicodeToUtf8Bytes(arr[i]);
-        RuneInfo x(arr[i], offset, len, i, 1);
-        runes.push_back(x);
-        offset += len;
+    if (not limonp::Utf8ToUnicode32(s, appender)) {
+        runes.reset();
+        return false;
     }
 
     return true;
@@ -135,10 +144,14 @@ public:
     }
 };
 
-inline string EncodeRunesToString(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end) {
-    string str;
+inline void EncodeRunesToString(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end, string& str) {
     RunePtrWrapper it_begin(begin), it_end(end);
     limonp::Unicode32ToUtf8(it_begin, it_end, str);
+}
+
+inline string EncodeRunesToString(RuneStrArray::const_iterator begin, RuneStrArray::const_iterator end) {
+    string str;
+    EncodeRunesToString(begin, end, str);
     return str;
 }
 
@@ -186,6 +199,17 @@ inline void GetWordsFromWordRanges(const string& s, const vector<WordRange>& wrs
     }
 }
 
+// Reuses the strings already in strs, so a caller keeping strs around
+// does not reallocate them on every call.
+inline void GetStringsFromWordRanges(const string& s, const vector<WordRange>& wrs, vector<string>& strs) {
+    strs.resize(wrs.size());
+
+    for (size_t i = 0; i < wrs.size(); ++i) {
+        const uint32_t len = wrs[i].right->offset - wrs[i].left->offset + wrs[i].right->len;
+        strs[i].assign(s, wrs[i].left->offset, len);
+    }
+}
+
 inline void GetStringsFromWords(const vector<Word>& words, vector<string>& strs) {
     strs.resize(words.size());
 
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#    include <unistd.h>
+#endif
+
+namespace cppjieba {
+
+// Threads kept for the parallel cuts, so that a call hands its chunks to
+// running threads instead of starting and joining threads of its own.
+//
+// Run splits one call into n parts. The caller and up to n - 1 pool threads
+// take parts off a shared counter until none is left, so a call never waits
+// for a part that no thread has started: if the pool is busy with other
+// calls, the caller does the parts itself.
+class WorkerPool {
+public:
+    explicit WorkerPool(size_t thread_num)
+        : stop_(false) {
+        for (size_t i = 0; i < thread_num; i++) {
+            threads_.emplace_back(&WorkerPool::Loop, this);
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+
+        for (size_t i = 0; i < threads_.size(); i++) {
+            threads_[i].join();
+        }
+    }
+
+    // The process-wide pool, one thread less than the hardware has. It is
+    // never destroyed, so no thread is joined while the process exits, and
+    // a child process forked afterwards, which has none of its threads,
+    // gets a new one.
+    static WorkerPool& Shared() {
+        static std::mutex mutex;
+        static WorkerPool* pool = NULL;
+        static long owner = 0;
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (!pool || owner != ProcessId()) {
+            const size_t hardware_threads = std::thread::hardware_concurrency();
+            pool = new WorkerPool(hardware_threads > 1 ? hardware_threads - 1 : 1);
+            owner = ProcessId();
+        }
+
+        return *pool;
+    }
+
+    size_t Size() const {
+        return threads_.size();
+    }
+
+    // Calls fn(0) .. fn(n - 1), each once, and returns when all are done.
+    // fn must not throw.
+    template <class Fn>
+    void Run(size_t n, Fn fn) {
+        if (n == 0) {
+            return;
+        }
+
+        const std::function<void(size_t)> part(fn);
+        const std::shared_ptr<Job> job = std::make_shared<Job>(n, &part);
+        const size_t helpers = std::min(n - 1, threads_.size());
+
+        if (helpers > 0) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (size_t i = 0; i < helpers; i++) {
+                    queue_.push_back(job); // may be taken after Run returned, then it finds no part left
+                }
+            }
+            cv_.notify_all();
+        }
+
+        job->Work();
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->cv.wait(lock, [&]() { return job->done == n; });
+    }
+
+private:
+    struct Job {
+        Job(size_t n, const std::function<void(size_t)>* fn)
+            : n(n), fn(fn), next(0), done(0) {
+        }
+
+        // fn is only called for parts not taken yet, so never after Run returned
+        void Work() {
+            for (size_t i = next.fetch_add(1); i < n; i = next.fetch_add(1)) {
+                (*fn)(i);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (++done == n) {
+                    cv.notify_all();
+                }
+            }
+        }
+
+        const size_t n;
+        const std::function<void(size_t)>* fn;
+        std::atomic<size_t> next;
+        size_t done; // guarded by mutex
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+
+    static long ProcessId() {
+#if defined(_WIN32) || defined(_WIN64)
+        return 0; // no fork
+#else
+        return long(::getpid());
+#endif
+    }
+
+    void Loop() {
+        for (;;) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+
+                if (queue_.empty()) {
+                    return; // stopped
+                }
+
+                job = queue_.front();
+                queue_.pop_front();
+            }
+            job->Work();
+        }
+    }
+
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<Job> > queue_;
+    bool stop_;
+    std::vector<std::thread> threads_;
+}; // class WorkerPool
+
+} // namespace cppjieba
@@ -122,6 +122,10 @@ class LocalVector {
     }
     init_();
   }
+  // drops the elements but keeps an allocated buffer for reuse
+  void reset() {
+    size_ = 0;
+  }
 };
 
 template <class T>
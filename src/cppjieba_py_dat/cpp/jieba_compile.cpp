@@ -0,0 +1,67 @@
+// Offline cache compiler: builds the dictionary and HMM model caches a Jieba
+// attaches, e.g. during an image build, so that instances started with
+// cache_validation="readonly" only map them.
+//
+//   jieba_compile --dict jieba.dict.utf8 --hmm hmm_model.utf8 --cache-dir DIR
+//                 [--user-dict a.utf8;b.utf8] [--element-format wide|compact|inline]
+//                 [--dat-engine bytes|runes|louds]
+#include <stdio.h>
+#include <exception>
+#include <string>
+#include "cppjieba/CacheCompiler.hpp"
+#include "limonp/ArgvContext.hpp"
+
+namespace {
+
+const char* const kUsage =
+    "usage: jieba_compile --dict PATH --hmm PATH --cache-dir DIR [--user-dict PATHS]\n"
+    "                     [--element-format wide|compact|inline] [--dat-engine bytes|runes|louds]\n";
+
+const char* const kFormatNames[] = {"wide", "compact", "inline"};
+const char* const kEngineNames[] = {"bytes", "runes", "louds"};
+
+// index of name in names, or -1
+int Lookup(const std::string& name, const char* const* names, int num) {
+    for (int i = 0; i < num; ++i) {
+        if (name == names[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    limonp::ArgvContext args(argc, argv);
+    const std::string dict_path = args["--dict"];
+    const std::string model_path = args["--hmm"];
+    const std::string cache_dir = args["--cache-dir"];
+    const std::string format_name = args.HasKey("--element-format") ? args["--element-format"] : "wide";
+    const std::string engine_name = args.HasKey("--dat-engine") ? args["--dat-engine"] : "bytes";
+    const int format = Lookup(format_name, kFormatNames, 3);
+    const int engine = Lookup(engine_name, kEngineNames, 3);
+
+    if (args.HasKey("--help") || dict_path.empty() || cache_dir.empty() || format < 0 || engine < 0) {
+        fputs(kUsage, stderr);
+        return 2;
+    }
+
+    try {
+        const cppjieba::CompiledCaches caches =
+            cppjieba::CompileCaches(dict_path, model_path, args["--user-dict"], cache_dir,
+                                    cppjieba::DatElementFormat(format), cppjieba::DatEngine(engine));
+
+        printf("element format: %s, engine: %s, dictionaries: %zu bytes, %.2f s\n", format_name.c_str(),
+               engine_name.c_str(), caches.total_dict_size, caches.seconds);
+        for (const auto& file : caches.files) {
+            printf("%-4s %12zu bytes %10zu words  %s\n", file.kind.c_str(), file.size, file.words_num,
+                   file.path.c_str());
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "jieba_compile: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
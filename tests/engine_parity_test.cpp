@@ -0,0 +1,69 @@
+// Every element format and engine cuts and tags exactly as the wide
+// darts-clone cache does, whether the cache is built or attached.
+#include <stdio.h>
+#include "cppjieba/Jieba.hpp"
+#include "test_util.hpp"
+
+using namespace cppjieba;
+
+namespace {
+
+std::string Segment(const Jieba& jieba) {
+    std::string out;
+    vector<string> words;
+    vector<pair<string, string> > tags;
+
+    for (const char* sentence : test::kSentences) {
+        jieba.Cut(sentence, words, true);
+        out += limonp::Join(words.begin(), words.end(), "/") + "\n";
+        jieba.Cut(sentence, words, false);
+        out += limonp::Join(words.begin(), words.end(), "/") + "\n";
+        jieba.CutAll(sentence, words);
+        out += limonp::Join(words.begin(), words.end(), "/") + "\n";
+        jieba.CutForSearch(sentence, words, true);
+        out += limonp::Join(words.begin(), words.end(), "/") + "\n";
+        jieba.CutSmall(sentence, words, 2);
+        out += limonp::Join(words.begin(), words.end(), "/") + "\n";
+        jieba.Tag(sentence, tags);
+        for (size_t i = 0; i < tags.size(); i++) {
+            out += tags[i].first + ":" + tags[i].second + " ";
+        }
+        out += "\n";
+    }
+    return out;
+}
+
+} // namespace
+
+int main() {
+    const std::string dir = test::ScratchDir("engine_parity");
+    const std::string dict_path = test::WriteFile(dir, "dict.utf8", test::kDict);
+    const std::string user_path = test::WriteFile(dir, "user.utf8", "云计算 n\n杭研大厦 30 nt\n京都大学 nt\n");
+    const std::string cache_dir = dir + PATH_SEPARATOR + "cache";
+
+    const std::string expected = Segment(Jieba(dict_path, test::HmmModelPath(), user_path, "", "", cache_dir));
+    CHECK(expected.find("杭研大厦") != std::string::npos);
+
+    const DatElementFormat formats[] = {DAT_ELEMENTS_WIDE, DAT_ELEMENTS_COMPACT, DAT_ELEMENTS_INLINE};
+    const DatEngine engines[] = {DAT_ENGINE_BYTES, DAT_ENGINE_RUNES, DAT_ENGINE_LOUDS};
+
+    for (DatElementFormat format : formats) {
+        for (DatEngine engine : engines) {
+            for (int profiled = 0; profiled < 2; profiled++) {
+                // built, then attached from the cache just written
+                for (int pass = 0; pass < 2; pass++) {
+                    const Jieba jieba(dict_path, test::HmmModelPath(), user_path, "", "", cache_dir,
+                                      DictTrie::ValidateFast, MmapOptions(), format, engine, profiled != 0);
+                    if (Segment(jieba) != expected) {
+                        fprintf(stderr, "format %d engine %d profiled %d pass %d differs\n", format, engine,
+                                profiled, pass);
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("engine_parity_test passed\n");
+    return 0;
+}
@@ -0,0 +1,61 @@
+// The HMM model is loaded on first use: a bad one fails the calls that
+// need it with an exception, each trying again, and leaves the others be.
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "cppjieba/Jieba.hpp"
+#include "test_util.hpp"
+
+using namespace cppjieba;
+
+namespace {
+
+bool CutThrows(const Jieba& jieba, bool hmm) {
+    vector<string> words;
+    try {
+        jieba.Cut(test::kSentences[2], words, hmm);
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return words.empty();
+}
+
+} // namespace
+
+int main() {
+    const std::string dir = test::ScratchDir("lazy_model");
+    const std::string dict_path = test::WriteFile(dir, "dict.utf8", test::kDict);
+    const std::string missing = dir + PATH_SEPARATOR + "missing.utf8";
+    const std::string truncated = test::WriteFile(dir, "truncated.utf8", "-0.26 -3.14e+100 -3.14e+100 -1.46\n");
+
+    const Jieba reference(dict_path, test::HmmModelPath(), "");
+    vector<string> expected;
+    reference.Cut(test::kSentences[2], expected, true);
+
+    for (const std::string& model_path : {missing, truncated}) {
+        // with and without a cache directory
+        for (int cached = 0; cached < 2; cached++) {
+            const Jieba jieba(dict_path, model_path, "", "", "", cached ? dir + PATH_SEPARATOR + "cache" : "");
+            CHECK(!CutThrows(jieba, false));
+            CHECK(CutThrows(jieba, true));
+            CHECK(CutThrows(jieba, true));
+            CHECK(!CutThrows(jieba, false));
+        }
+    }
+
+    // a model that appears later is picked up
+    const std::string late = dir + PATH_SEPARATOR + "late.utf8";
+    const Jieba jieba(dict_path, late, "");
+    CHECK(CutThrows(jieba, true));
+    std::ifstream model(test::HmmModelPath().c_str(), std::ios::binary);
+    std::stringstream text;
+    text << model.rdbuf();
+    test::WriteFile(dir, "late.utf8", text.str());
+    vector<string> words;
+    jieba.Cut(test::kSentences[2], words, true);
+    CHECK(words == expected);
+
+    printf("lazy_model_test passed\n");
+    return 0;
+}
@@ -0,0 +1,101 @@
+// Words inserted at runtime are found at once, while other threads cut,
+// across the rebuilds of the overlay and its compaction into the user layer.
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include "cppjieba/Jieba.hpp"
+#include "test_util.hpp"
+
+using namespace cppjieba;
+
+namespace {
+
+std::string Cut(const Jieba& jieba, const std::string& sentence) {
+    vector<string> words;
+    jieba.Cut(sentence, words, false);
+    return limonp::Join(words.begin(), words.end(), "/");
+}
+
+std::string TestWord(int i) {
+    char buf[32];
+    snprintf(buf, sizeof buf, "测试词%04d", i);
+    return buf;
+}
+
+} // namespace
+
+int main() {
+    const std::string dir = test::ScratchDir("overlay");
+    const std::string dict_path = test::WriteFile(dir, "dict.utf8", test::kDict);
+    Jieba jieba(dict_path, test::HmmModelPath(), "", "", "", dir + PATH_SEPARATOR + "cache");
+
+    CHECK(Cut(jieba, "他来到了网易杭研大厦") == "他/来到/了/网易/杭研/大厦");
+    CHECK(jieba.InsertUserWord("杭研大厦", "nt"));
+    CHECK(Cut(jieba, "他来到了网易杭研大厦") == "他/来到/了/网易/杭研大厦");
+    CHECK(jieba.LookupTag("杭研大厦") == "nt");
+    CHECK(!jieba.InsertUserWord("", "n"));
+    CHECK(!jieba.InsertUserWord("网易杭研", 0, "nz"));
+    CHECK(!jieba.Find("网易杭研"));
+
+    // enough words for several overlay rebuilds and one compaction
+    const int kWords = 600;
+    jieba.SetOverlayCompactThreshold(kWords / 2);
+    std::atomic<bool> stop(false);
+    vector<std::thread> readers;
+    for (int t = 0; t < 3; t++) {
+        readers.emplace_back([&]() {
+            SegmentContext ctx;
+            vector<string> words;
+            while (!stop) {
+                jieba.Cut("他来到了网易杭研大厦", words, true, ctx);
+                CHECK(words.size() == 5);
+                jieba.CutForSearch("这是测试词0007", words, true, ctx);
+            }
+        });
+    }
+
+    for (int i = 0; i < kWords; i++) {
+        CHECK(jieba.InsertUserWord(TestWord(i), 10 + i, "x"));
+        CHECK(jieba.Find(TestWord(i)));
+    }
+    // the last insertion wins
+    CHECK(jieba.InsertUserWord(TestWord(7), 20, "y"));
+    const_cast<DictTrie*>(jieba.GetDictTrie())->WaitForCompaction();
+    stop = true;
+    for (size_t t = 0; t < readers.size(); t++) {
+        readers[t].join();
+    }
+
+    for (int i = 0; i < kWords; i++) {
+        CHECK(jieba.Find(TestWord(i)));
+    }
+    CHECK(jieba.GetDictTrie()->GetOverlaySize() < size_t(kWords));
+    CHECK(jieba.LookupTag(TestWord(7)) == "y");
+    CHECK(jieba.LookupTag("杭研大厦") == "nt");
+    CHECK(Cut(jieba, "这是测试词0007") == "这/是/测试词0007");
+
+    // a second compaction keeps the words the first folded into the user
+    // layer, which stays in memory: the cache file is still the user
+    // dictionaries' one
+    {
+        Jieba other(dict_path, test::HmmModelPath(), "", "", "", dir + PATH_SEPARATOR + "cache");
+        DictTrie* trie = const_cast<DictTrie*>(other.GetDictTrie());
+        const std::string user_cache_file = trie->GetUserCacheFile();
+        trie->SetOverlayCompactThreshold(4);
+        for (int round = 0; round < 2; round++) {
+            for (int i = round * 4; i < round * 4 + 4; i++) {
+                CHECK(other.InsertUserWord(TestWord(1000 + i), 10, "x"));
+            }
+            trie->WaitForCompaction();
+            CHECK(trie->GetOverlaySize() == 0);
+        }
+        for (int i = 0; i < 8; i++) {
+            CHECK(other.Find(TestWord(1000 + i)));
+        }
+        CHECK(Cut(other, "这是测试词1002") == "这/是/测试词1002");
+        CHECK(trie->GetUserCacheFile() == user_cache_file);
+    }
+
+    printf("overlay_test passed\n");
+    return 0;
+}
@@ -0,0 +1,63 @@
+// Parallel cuts run on the shared worker pool and cut as a single thread
+// does, from many callers at once and in a process forked after the pool
+// started.
+#include <stdio.h>
+#include <thread>
+#include "cppjieba/Jieba.hpp"
+#include "test_util.hpp"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#    include <sys/wait.h>
+#    include <unistd.h>
+#endif
+
+using namespace cppjieba;
+
+int main() {
+    const std::string dir = test::ScratchDir("parallel_cut");
+    const std::string dict_path = test::WriteFile(dir, "dict.utf8", test::kDict);
+    const Jieba jieba(dict_path, test::HmmModelPath(), "", "", "", dir + PATH_SEPARATOR + "cache");
+
+    // several chunks of MIN_PARALLEL_CHUNK_RUNES
+    std::string text;
+    while (text.size() < 3 * 4 * MIN_PARALLEL_CHUNK_RUNES) {
+        for (const char* sentence : test::kSentences) {
+            text += sentence;
+        }
+    }
+
+    vector<string> expected;
+    jieba.Cut(text, expected, true);
+
+    auto check = [&](size_t thread_num) {
+        vector<string> words;
+        jieba.CutParallel(text, words, thread_num, true);
+        return words == expected;
+    };
+
+    CHECK(check(2));
+    CHECK(check(64)); // more chunks than pool threads
+
+    bool ok[4] = {false, false, false, false};
+    vector<std::thread> callers;
+    for (size_t t = 0; t < 4; t++) {
+        callers.emplace_back([&, t]() { ok[t] = check(4) && check(3); });
+    }
+    for (size_t t = 0; t < callers.size(); t++) {
+        callers[t].join();
+        CHECK(ok[t]);
+    }
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    const pid_t child = fork();
+    if (child == 0) {
+        _exit(check(4) ? 0 : 1);
+    }
+    int status = 0;
+    CHECK(child > 0 && waitpid(child, &status, 0) == child);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+#endif
+
+    printf("parallel_cut_test passed\n");
+    return 0;
+}
@@ -0,0 +1,93 @@
+// Caches written by CompileCaches are what read-only instances attach, for
+// every kind of user dictionary, and read-only instances never build one.
+#include <stdio.h>
+#include <stdexcept>
+#include "cppjieba/CacheCompiler.hpp"
+#include "cppjieba/Jieba.hpp"
+#include "test_util.hpp"
+
+using namespace cppjieba;
+
+namespace {
+
+std::string CutAll(const Jieba& jieba) {
+    std::string out;
+    for (const char* sentence : test::kSentences) {
+        vector<string> words;
+        jieba.Cut(sentence, words, true);
+        out += limonp::Join(words.begin(), words.end(), "/") + "\n";
+    }
+    return out;
+}
+
+// Compiles the caches for user_dict, then checks that a read-only instance
+// attaches them and cuts like one that may build its own.
+void CheckRoundTrip(const std::string& name, const std::string& user_dict, size_t expected_user_words) {
+    const std::string dir = test::ScratchDir(name);
+    const std::string dict_path = test::WriteFile(dir, "dict.utf8", test::kDict);
+    const std::string user_path = test::WriteFile(dir, "user.utf8", user_dict);
+    const std::string cache_dir = dir + PATH_SEPARATOR + "cache";
+
+    const CompiledCaches caches = CompileCaches(dict_path, test::HmmModelPath(), user_path, cache_dir);
+    CHECK(caches.files.size() == 3);
+    CHECK(caches.files[1].kind == "user");
+    CHECK(caches.files[1].size > 0);
+    CHECK(caches.files[1].words_num == expected_user_words);
+
+    const Jieba reference(dict_path, test::HmmModelPath(), user_path, "", "", dir + PATH_SEPARATOR + "ref");
+    const Jieba read_only(dict_path, test::HmmModelPath(), user_path, "", "", cache_dir, DictTrie::ValidateReadOnly);
+    CHECK(read_only.GetDictTrie()->GetUserCacheFile() == caches.files[1].path);
+    CHECK(CutAll(read_only) == CutAll(reference));
+    CHECK(read_only.GetHMMModel()->GetCacheFile() == caches.files[2].path);
+
+    // the one-character user words come from the cache
+    const RuneArray runes = DecodeRunesInString(user_dict);
+    for (size_t i = 0; i < runes.size(); i++) {
+        CHECK(read_only.GetDictTrie()->IsUserDictSingleChineseWord(runes[i]) ==
+              reference.GetDictTrie()->IsUserDictSingleChineseWord(runes[i]));
+    }
+}
+
+template <class F>
+bool Throws(F f) {
+    try {
+        f();
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+} // namespace
+
+int main() {
+    CheckRoundTrip("user_words", "云计算 n\n杭研大厦 30 nt\n", 2);
+    // 北京 is heavier in the main dictionary, the user layer keeps nothing
+    CheckRoundTrip("user_words_in_base", "北京 ns\n", 0);
+    CheckRoundTrip("user_blank_lines", "\n\n", 0);
+    // 我 stays with the heavier base word, yet is a one-character user word
+    CheckRoundTrip("user_single_words", "鑫 n\n我 5 r\n", 1);
+
+    // nothing compiled: the dictionary cache is missing at construction, the
+    // HMM model cache at first use
+    const std::string dir = test::ScratchDir("missing");
+    const std::string dict_path = test::WriteFile(dir, "dict.utf8", test::kDict);
+    const std::string empty_dir = test::ScratchDir("missing_cache");
+    CHECK(Throws([&]() {
+        Jieba jieba(dict_path, test::HmmModelPath(), "", "", "", empty_dir, DictTrie::ValidateReadOnly);
+    }));
+
+    const std::string cache_dir = dir + PATH_SEPARATOR + "cache";
+    {
+        DictTrie dict_trie(dict_path, "", cache_dir);
+    }
+    Jieba jieba(dict_path, test::HmmModelPath(), "", "", "", cache_dir, DictTrie::ValidateReadOnly);
+    vector<string> words;
+    jieba.Cut(test::kSentences[0], words, false);
+    CHECK(!words.empty());
+    CHECK(Throws([&]() { jieba.Cut(test::kSentences[0], words, true); }));
+    CHECK(Throws([&]() { jieba.Cut(test::kSentences[0], words, true); })); // still not written
+
+    printf("readonly_cache_test passed\n");
+    return 0;
+}
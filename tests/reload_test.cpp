@@ -0,0 +1,52 @@
+// A reload of a broken main dictionary fails, and the instance keeps cutting
+// with the dictionaries it had, instead of taking the process down.
+#include <stdio.h>
+#include <string>
+#include "cppjieba/Jieba.hpp"
+#include "test_util.hpp"
+
+using namespace cppjieba;
+
+namespace {
+
+std::string Cut(const Jieba& jieba, const std::string& sentence) {
+    vector<string> words;
+    jieba.Cut(sentence, words, false);
+    return limonp::Join(words.begin(), words.end(), "/");
+}
+
+} // namespace
+
+int main() {
+    const std::string dir = test::ScratchDir("reload");
+    const std::string dict_path = test::WriteFile(dir, "dict.utf8", test::kDict);
+    Jieba jieba(dict_path, test::HmmModelPath(), "", "", "", dir + PATH_SEPARATOR + "cache");
+    const std::string before = Cut(jieba, "他来到了网易杭研大厦");
+    CHECK(before == "他/来到/了/网易/杭研/大厦");
+
+    // a line without frequency and tag
+    test::WriteFile(dir, "dict.utf8", std::string(test::kDict) + "杭研大厦\n");
+    CHECK(!jieba.Reload());
+    CHECK(!jieba.GetDictTrie()->LastReloadSucceeded());
+    CHECK(Cut(jieba, "他来到了网易杭研大厦") == before);
+
+    // the same, parsed on the reload thread
+    CHECK(jieba.Reload(true));
+    jieba.WaitForReload();
+    CHECK(!jieba.GetDictTrie()->LastReloadSucceeded());
+    CHECK(Cut(jieba, "他来到了网易杭研大厦") == before);
+
+    test::WriteFile(dir, "dict.utf8", "");
+    CHECK(!jieba.Reload());
+    CHECK(!jieba.GetDictTrie()->LastReloadSucceeded());
+    CHECK(Cut(jieba, "他来到了网易杭研大厦") == before);
+
+    // a good dictionary afterwards is picked up as usual
+    test::WriteFile(dir, "dict.utf8", std::string(test::kDict) + "杭研大厦 30 nt\n");
+    CHECK(jieba.Reload());
+    CHECK(jieba.GetDictTrie()->LastReloadSucceeded());
+    CHECK(Cut(jieba, "他来到了网易杭研大厦") == "他/来到/了/网易/杭研大厦");
+
+    printf("reload_test passed\n");
+    return 0;
+}
@@ -0,0 +1,42 @@
+// Instances over the same main dictionary share one base even when they
+// start together; those over another dictionary get their own.
+#include <stdio.h>
+#include <memory>
+#include <thread>
+#include "cppjieba/DictTrie.hpp"
+#include "test_util.hpp"
+
+using namespace cppjieba;
+
+int main() {
+    const std::string dir = test::ScratchDir("shared_base");
+    const std::string dict_path = test::WriteFile(dir, "dict.utf8", test::kDict);
+    const std::string other_path = test::WriteFile(dir, "other.utf8", std::string(test::kDict) + "云计算 100 n\n");
+    const std::string cache_dir = dir + PATH_SEPARATOR + "cache";
+
+    const size_t kThreads = 8;
+    std::unique_ptr<DictTrie> tries[kThreads];
+    vector<std::thread> threads;
+    for (size_t t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t]() {
+            tries[t].reset(new DictTrie(t % 2 ? other_path : dict_path, "", cache_dir));
+        });
+    }
+    for (size_t t = 0; t < kThreads; t++) {
+        threads[t].join();
+    }
+
+    for (size_t t = 2; t < kThreads; t++) {
+        CHECK(tries[t]->GetBaseLayer() == tries[t % 2]->GetBaseLayer());
+    }
+    CHECK(tries[0]->GetBaseLayer() != tries[1]->GetBaseLayer());
+    CHECK(!tries[0]->Find("云计算"));
+    CHECK(tries[1]->Find("云计算"));
+
+    // a later instance shares it too
+    const std::shared_ptr<const DatTrie> base = tries[0]->GetBaseLayer();
+    CHECK(DictTrie(dict_path, "", cache_dir).GetBaseLayer() == base);
+
+    printf("shared_base_test passed\n");
+    return 0;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+// Shared by the tests: failing checks, scratch directories and small
+// dictionaries written into them.
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include "cppjieba/DictTrie.hpp"
+
+#define CHECK(cond)                                                                  \
+    do {                                                                             \
+        if (!(cond)) {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                                 \
+        }                                                                            \
+    } while (0)
+
+namespace test {
+
+// A new empty directory under the build tree, named after the test
+inline std::string ScratchDir(const std::string& name) {
+    MKDIR(CPPJIEBA_TEST_TMP_DIR);
+    const std::string dir = std::string(CPPJIEBA_TEST_TMP_DIR) + PATH_SEPARATOR + name + "_" +
+                            std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    CHECK(MKDIR(dir.c_str()) == 0);
+    return dir;
+}
+
+inline std::string WriteFile(const std::string& dir, const std::string& name, const std::string& text) {
+    const std::string path = dir + PATH_SEPARATOR + name;
+    std::ofstream out(path.c_str(), std::ios::binary);
+    out << text;
+    CHECK(out.good());
+    return path;
+}
+
+// A main dictionary in the jieba.dict.utf8 format, enough to tell the
+// segmenters apart
+const char* const kDict =
+    "我 100 r\n"
+    "来到 500 v\n"
+    "来 300 v\n"
+    "到 300 v\n"
+    "北京 100000 ns\n"
+    "清华 200 nz\n"
+    "清华大学 800 nt\n"
+    "大学 600 n\n"
+    "华大 50 nz\n"
+    "他 200 r\n"
+    "了 400 ul\n"
+    "网易 300 nz\n"
+    "杭研 20 nz\n"
+    "大厦 300 n\n"
+    "小明 100 nr\n"
+    "硕士 200 n\n"
+    "毕业 300 n\n"
+    "于 500 p\n"
+    "中国 1000 ns\n"
+    "科学 400 n\n"
+    "科学院 300 nt\n"
+    "学院 300 n\n"
+    "中国科学院 200 nt\n"
+    "计算 300 v\n"
+    "计算所 50 nt\n"
+    "所 500 u\n"
+    "是 800 v\n"
+    "拖拉机 50 n\n"
+    "手扶拖拉机 20 n\n"
+    "专业 300 n\n"
+    "的 1000 uj\n";
+
+const char* const kSentences[] = {
+    "我来到北京清华大学",
+    "他来到了网易杭研大厦",
+    "小明硕士毕业于中国科学院计算所，后在日本京都大学深造",
+    "我是拖拉机学院手扶拖拉机专业的。不用多久，我就会升职加薪，当上CEO，走上人生巅峰。",
+};
+
+inline std::string HmmModelPath() {
+    return std::string(CPPJIEBA_DICT_DIR) + PATH_SEPARATOR + "hmm_model.utf8";
+}
+
+} // namespace test